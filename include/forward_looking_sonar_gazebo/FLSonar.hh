@@ -3,8 +3,11 @@
 #ifndef _GAZEBO_RENDERING_SONAR_HH_
 #define _GAZEBO_RENDERING_SONAR_HH_
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <sdf/sdf.hh>
@@ -16,6 +19,7 @@
 #include "gazebo/util/system.hh"
 #include "ignition/math/Pose3.hh"
 #include "sonar_msgs/SonarStamped.h"
+#include "forward_looking_sonar_gazebo/SonarProcessor.hh"
 
 #include <gazebo/physics/physics.hh>
 
@@ -80,6 +84,8 @@ public:
   virtual void Fini();
 
   /// \brief Create the texture which is used to render laser data.
+  /// The texture and material names are scoped by the camera unique name,
+  /// so many sonars can live in the same scene.
   /// \param[in] _textureName Name of the new texture.
 public:
   void CreateTexture(const std::string &_textureName);
@@ -146,10 +152,16 @@ public:
   double FarClip() const;
 
   /// \brief Get the shader output
-  /// \return shader output
+  /// \return shader output as (intensity, depth, 0) whatever the texture
+  /// format, converted on each call
 public:
   cv::Mat ShaderImage() const;
 
+  /// \brief Get the number of channels of the render textures
+  /// \return 3 for R32G32B32, 2 for the compact formats
+public:
+  int TextureChannels() const;
+
   /// \brief Get the sonar image on polar coordinates
   /// \return sonar image output
 public:
@@ -235,6 +247,37 @@ public:
 public:
   sonar_msgs::SonarStamped SonarRosMsg(const physics::WorldPtr _world);
 
+  /**
+   * @brief Get the Ros sonar msg from the last processed data, without
+   * reading the texture back
+   *
+   * @param _stamp Simulation time of the data
+   */
+public:
+  sonar_msgs::SonarStamped SonarRosMsg(const common::Time &_stamp);
+
+  /**
+   * @brief Read the rendered texture into a cv::Mat without any conversion.
+   * With GPU binning the bin counts are read instead. With field of view
+   * tiles, which the render already read back and binned, the buffer of
+   * _image is swapped with their bin counts. Must be called from the render
+   * thread.
+   *
+   * @param _image Output image, allocated on first use
+   */
+public:
+  void ReadTexture(cv::Mat &_image);
+
+  /**
+   * @brief Run the CPU side of the sonar (binning and polar transform) on a
+   * texture read by ReadTexture. Does not touch Ogre, so it can run on a
+   * worker thread.
+   *
+   * @param _image Texture data from ReadTexture
+   */
+public:
+  void ProcessTexture(const cv::Mat &_image);
+
   /**
    * @brief Update the data for the sonar
    *
@@ -243,28 +286,85 @@ public:
   void UpdateData();
 
   /**
-   * @brief Cv mat to sonar bin data
+   * @brief Set the simulation time of the next RenderImpl, kept with the
+   * texture it renders into
    *
-   * @param _accumData vector with all image data
+   * @param _time Simulation time of the render
    */
-  void CvToSonarBin(std::vector<float> &_accumData);
+public:
+  void SetRenderTime(const common::Time &_time);
 
   /**
-   * @brief Create transfer table from cartesian to polar
+   * @brief Get the simulation time of the render ReadTexture reads back.
+   * With a readback ring it is readbackBuffers - 1 renders old.
    *
-   * @param _transfer Transfer vector that will be Generated
+   * @return common::Time Simulation time set before that render
    */
-protected:
-  void GenerateTransferTable(std::vector<int> &_transfer);
+public:
+  common::Time ReadbackTime() const;
 
   /**
-   * @brief Transfer the sonar bin data to cv::Mat sonarImage using transfer matrix
+   * @brief Tell if the beams and bins are accumulated on the GPU. Only the
+   * bin counts are then read back, and the shader image is not.
    *
-   * @param _accumData Vector with sonar bins data
-   * @param _transfer Vector with tranfer function cartesian to polar
+   * @return true With GPU binning
    */
-protected:
-  void TransferTableToSonar(const std::vector<float> &_accumData, const std::vector<int> &_transfer);
+public:
+  bool GpuBinning() const;
+
+  /**
+   * @brief Tell if ReadTexture reads bin counts, binned on the GPU or tile
+   * by tile by the render, instead of the shader image
+   *
+   * @return true With GPU binning or field of view tiles
+   */
+public:
+  bool ReadsBinCounts() const;
+
+  /**
+   * @brief Compare the sonar pose, set by PreRender, and the poses of the
+   * visuals in its field of view with the last scene that changed. A change
+   * becomes the new reference. Always false without incremental rendering.
+   *
+   * @return true If the last processed frame still shows the scene, so the
+   * render can be skipped and only the noise redrawn
+   */
+public:
+  bool SceneUnchanged();
+
+  /**
+   * @brief Forget the reference scene so the next frame is rendered, when
+   * the last render was dropped before being processed
+   *
+   */
+public:
+  void ResetScene();
+
+  /**
+   * @brief Get the CPU side of the sonar
+   *
+   * @return SonarProcessor& Binning and polar transform of this sonar
+   */
+public:
+  SonarProcessor &Processor();
+
+  /**
+   * @brief Get the number of per frame buffer allocations since the sonar
+   * was created. Stays constant once the buffers are sized.
+   *
+   * @return uint64_t Allocation count
+   */
+public:
+  uint64_t AllocationCount() const;
+
+  /**
+   * @brief Set the statistics the render, readback and processing stages
+   * are timed into
+   *
+   * @param _stats Statistics, null to disable the timing
+   */
+public:
+  void SetStats(SonarStats *_stats);
 
   /**
    * @brief
@@ -277,6 +377,101 @@ protected:
 protected:
   void PixelBoxTextureToCV(Ogre::Texture *_texture, cv::Mat &_image, int _width, int _height);
 
+  /**
+   * @brief Create the target, material and points of the GPU binning pass
+   *
+   * @param _uniqueName Name scoping the Ogre resources of this sonar
+   */
+protected:
+  void CreateBinScatter(const std::string &_uniqueName);
+
+  /**
+   * @brief Check that a render texture of a two channel format was created
+   * with that format, not substituted by one the GPU can render to
+   *
+   * @param _texture Texture just created with textureFormat
+   * @return False if the format was substituted
+   */
+protected:
+  bool CompactFormatRenderable(Ogre::Texture *_texture) const;
+
+  /**
+   * @brief Check whether the two channel render textures are backed by
+   * LUMINANCE_ALPHA, which keeps R and A of the shader output instead of
+   * R and G
+   *
+   * @return True on the legacy GL render system with a compact format
+   */
+protected:
+  bool CompactLuminanceAlpha() const;
+
+  /**
+   * @brief Accumulate the last render into the bin counts target
+   */
+protected:
+  void RenderBinScatter();
+
+  /**
+   * @brief Read the bin counts target back
+   *
+   * @param _counts Bin counts, see SonarProcessor::BinCounts
+   */
+protected:
+  void ReadBinCounts(cv::Mat &_counts);
+
+  /**
+   * @brief Render every field of view tile, alternating between two tile
+   * textures, and bin each one into binCounts once the next is rendered
+   */
+protected:
+  void RenderFovTiles();
+
+  /**
+   * @brief Read a rendered field of view tile back and bin its beams
+   *
+   * @param _tile Tile index, rendered into texture _tile % 2
+   */
+protected:
+  void BinFovTile(const int _tile);
+
+  /**
+   * @brief Append the id and world pose of a visual and of its visible
+   * descendants to frameVisuals
+   *
+   * @param _visual Visual
+   */
+protected:
+  void CollectSceneVisuals(VisualPtr _visual);
+
+  /**
+   * @brief Tell if two poses are the same within the scene tolerances
+   *
+   * @param _pose1 First pose
+   * @param _pose2 Second pose
+   * @return true If the poses are within the tolerances
+   */
+protected:
+  bool SamePose(const ignition::math::Pose3d &_pose1, const ignition::math::Pose3d &_pose2) const;
+
+  /**
+   * @brief Get the texture to read back. With more than one readback buffer
+   * this is the texture rendered readbackBuffers - 1 frames ago, so its
+   * rendering has likely finished on the GPU. The readback is still a
+   * synchronous blit.
+   *
+   * @return Ogre::Texture* Texture to read back
+   */
+protected:
+  Ogre::Texture *ReadbackTexture();
+
+  /**
+   * @brief Get the ring index of the texture to read back
+   *
+   * @return size_t Index in camTextures
+   */
+protected:
+  size_t ReadbackIndex() const;
+
   /**
    * @brief Get image width
    *
@@ -352,15 +547,6 @@ public:
 protected:
   float Sigmoid(float x);
 
-  /// \brief Vertical field-of-view.
-protected:
-  double vfov;
-
-/// \brief Horizontal field-of-view.
-protected:
-  double hfov;
-
-
   /// \brief Near clip plane.
 protected:
   double nearClip;
@@ -377,72 +563,181 @@ public:
 public:
   Ogre::Material *camMaterial;
 
+  //// \brief Per instance clone of the sonar material, owns camMaterial
+protected:
+  Ogre::MaterialPtr camMaterialPtr;
+
+  //// \brief Pass of camMaterial, resolved by CreateTexture
+protected:
+  Ogre::Pass *camPass;
+
+  //// \brief Fragment program parameters of camPass
+protected:
+  Ogre::GpuProgramParametersSharedPtr fragmentParams;
+
+  //// \brief Physical index of the farPlane fragment constant
+protected:
+  size_t farPlaneIndex;
+
+  //// \brief Physical index of the drawNormal fragment constant
+protected:
+  size_t drawNormalIndex;
+
+  //// \brief Physical index of the drawDepth fragment constant
+protected:
+  size_t drawDepthIndex;
+
+  //// \brief Physical index of the reflectance fragment constant
+protected:
+  size_t reflectanceIndex;
+
+  //// \brief Physical index of the attenuationCoeff fragment constant
+protected:
+  size_t attenuationCoeffIndex;
+
+  //// \brief Physical index of the compactOutput fragment constant
+protected:
+  size_t compactOutputIndex;
+
+  //// \brief Reflectance of each renderable, read once from its custom
+  //// parameter. Only cleared when entities are added or removed, so a
+  //// laser_retro changed on an existing visual is not seen until then.
+protected:
+  std::unordered_map<const Ogre::Renderable *, float> reflectanceCache;
+
+  //// \brief Renders that still clear reflectanceCache, set by the entity
+  //// events from the world thread
+protected:
+  std::atomic<int> reflectanceClears;
+
+  //// \brief Connection to the entity addition event
+protected:
+  event::ConnectionPtr addEntityConnection;
+
+  //// \brief Connection to the entity deletion event
+protected:
+  event::ConnectionPtr deleteEntityConnection;
+
   //// \brief Camera Target
 public:
   Ogre::RenderTarget *camTarget;
 
-  //// \brief Sonar beams depth data
-public:
-  std::vector<int> sonarBinsDepth;
+  //// \brief Ring of render textures, camTexture is the one being rendered
+protected:
+  std::vector<Ogre::Texture *> camTextures;
 
-  //// \brief Number of bins
+  //// \brief Render targets of camTextures
 protected:
-  int binCount;
+  std::vector<Ogre::RenderTarget *> camTargets;
 
-  //// \brief Image width for texture
+  //// \brief Number of textures in the readback ring
 protected:
-  int imageWidth;
+  int readbackBuffers;
 
-  //// \brief Image height for texture
+  //// \brief Number of renders since the textures were created
 protected:
-  int imageHeight;
+  unsigned int renderCount;
 
-  //// \brief Bins vector
-public:
-  std::vector<float> bins;
+  //// \brief Simulation time of the render held by each texture of the ring
+protected:
+  std::vector<common::Time> renderTimes;
 
-  //// \brief Image mask for polar image output
+  //// \brief Simulation time of the next render
 protected:
-  cv::Mat sonarImageMask;
+  common::Time nextRenderTime;
 
-  //// \brief Image of the pure sonar image in cartesian coordinates
-public:
-  cv::Mat sonarImage;
+  //// \brief Orientation of the camera for a single field of view tile,
+  //// the tiles are yawed from it
+protected:
+  Ogre::Quaternion cameraOrientation;
 
-  //// \brief Raw image with texture data
+  //// \brief Shader image of one field of view tile, read back before it is
+  //// binned
 protected:
-  cv::Mat rawImage;
+  cv::Mat tileImage;
 
-  //// \brief Number of beams
+  //// \brief Accumulate the beams and bins on the GPU
 protected:
-  int beamCount;
+  bool bGpuBinning;
 
-  //// \brief Data from sensor
+  //// \brief Beam x bin target of (sample count, intensity sum)
 protected:
-  std::vector<float> accumData;
+  Ogre::Texture *binTexture;
 
-  /**
-   * @brief Additional variables - Quan
-   *
-   */
+  //// \brief Render target of binTexture
+protected:
+  Ogre::RenderTarget *binTarget;
+
+  //// \brief Material of the GPU binning pass, cloned per sonar
+protected:
+  Ogre::MaterialPtr binMaterialPtr;
 
-  //// \brief Mats for remapping from camera pixels to sonar beams
+  //// \brief Pass of the GPU binning
 protected:
-  cv::Mat map_x, map_y, dest;
+  Ogre::Pass *binPass;
 
-  //// \brief Focal length of camera in pixel
+  //// \brief One point per beam sample of the shader image
 protected:
-  double focal_length;
+  Ogre::VertexData *binVertexData;
 
-  
+  //// \brief Point list drawn by the GPU binning pass
+protected:
+  Ogre::RenderOperation binOperation;
+
+  //// \brief Bin counts read back from binTexture, or binned from the field
+  //// of view tiles of the last render
+protected:
+  cv::Mat binCounts;
+
+  //// \brief Pixel format of the render textures, PF_FLOAT32_RGB or a
+  //// compact two channel format holding (intensity, depth)
+protected:
+  Ogre::PixelFormat textureFormat;
+
+  //// \brief Binning and polar transform, shared by the CPU backend
+protected:
+  SonarProcessor processor;
+
+  //// \brief Stage timings, null when disabled
+protected:
+  SonarStats *stats;
+
+  //// \brief Skip the render while the scene does not change
+protected:
+  bool bIncremental;
+
+  //// \brief Distance the sonar or a visual must move to change the scene
+protected:
+  double positionTolerance;
+
+  //// \brief Angle the sonar or a visual must turn to change the scene
+protected:
+  double angleTolerance;
+
+  //// \brief Sonar pose of the reference scene
+protected:
+  ignition::math::Pose3d scenePose;
+
+  //// \brief Ids and world poses of the visuals of the reference scene
+protected:
+  std::vector<std::pair<uint32_t, ignition::math::Pose3d>> sceneVisuals;
+
+  //// \brief Ids and world poses of the visuals of the current frame
+protected:
+  std::vector<std::pair<uint32_t, ignition::math::Pose3d>> frameVisuals;
+
+  //// \brief True when sceneVisuals and scenePose hold a reference
+protected:
+  bool bSceneReference;
+
+  //// \brief Frames the scene did not change for, up to readbackBuffers
+protected:
+  int unchangedFrames;
 
 /// \brief Flag to check if the message was updated.
 private:
   bool bUpdated;
 
-  //// \brief Sonar image from ogre
-  Ogre::Image imgSonar;
-
   /**
    * @brief Debug Functions
    *
@@ -1,7 +1,11 @@
 // Copyright 2018 Brazilian Intitute of Robotics"
 
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <boost/scoped_ptr.hpp>
 #include <math.h>
 
@@ -19,15 +23,105 @@
 #include <image_transport/image_transport.h>
 #include <opencv2/highgui/highgui.hpp>
 #include <cv_bridge/cv_bridge.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <sensor_msgs/Image.h>
 
 // FLSonar Dependencies
 #include "forward_looking_sonar_gazebo/FLSonar.hh"
+#include "forward_looking_sonar_gazebo/SonarColorMap.hh"
+#include "forward_looking_sonar_gazebo/SonarMsgPool.hh"
+#include "forward_looking_sonar_gazebo/SonarPipeline.hh"
+#include "forward_looking_sonar_gazebo/SonarProcessor.hh"
+#include "forward_looking_sonar_gazebo/SonarRayCaster.hh"
+#include "forward_looking_sonar_gazebo/SonarStats.hh"
 
 namespace gazebo
 {
+class FLSonarRos;
+
+/**
+ * @brief Sonars of one world driven by one set of render event
+ * connections. Each due sonar is rendered in turn with its own pass setup,
+ * then read back on the next pre-render and handed to its own pipeline
+ * worker, so the sonars are processed in parallel off the render thread.
+ *
+ */
+class FLSonarBatch
+{
+public:
+  /**
+   * @brief Get the batch of a world, created on first use
+   *
+   * @param _worldName Name of the world
+   * @return std::shared_ptr<FLSonarBatch> Shared batch of the world
+   */
+  static std::shared_ptr<FLSonarBatch> Get(const std::string &_worldName);
+
+  /**
+   * @brief Constructor, connects the batch to the render events
+   *
+   */
+  FLSonarBatch();
+
+  /**
+   * @brief Add a sonar to the batch
+   *
+   * @param _sonar Sonar plugin
+   */
+  void Add(FLSonarRos *_sonar);
+
+  /**
+   * @brief Remove a sonar from the batch
+   *
+   * @param _sonar Sonar plugin
+   */
+  void Remove(FLSonarRos *_sonar);
+
+  /**
+   * @brief Schedule every sonar of the batch and hand their last renders to
+   * their pipelines
+   *
+   */
+  void OnPreRender();
+
+  /**
+   * @brief Render every due sonar of the batch
+   *
+   */
+  void OnUpdate();
+
+  /**
+   * @brief Post render of every due sonar of the batch
+   *
+   */
+  void OnPostRender();
+
+private:
+  // Sonars of the batch
+  std::vector<FLSonarRos *> sonars;
+
+  // Protects sonars, plugins load outside the render thread
+  std::mutex mutex;
+
+  // Render event connection
+  event::ConnectionPtr updateConnection;
+
+  // Post render event connection
+  event::ConnectionPtr updatePostRender;
+
+  // Pre render event connection
+  event::ConnectionPtr updatePreRender;
+};
+
 class FLSonarRos : public SensorPlugin
 {
 public:
+  /**
+   * @brief Destructor, stops the worker pipeline before the sonar goes away
+   *
+   */
+  virtual ~FLSonarRos();
+
   /**
    * @brief Documentation Iherited
    *
@@ -54,6 +148,65 @@ public:
    */
   void OnPostRender();
 
+  /**
+   * @brief Hand the poses of the CPU backend to the worker pipeline, which
+   * ray casts, processes and publishes them. Called on each world update.
+   *
+   * @param _info World update information
+   */
+  void OnWorldUpdate(const common::UpdateInfo &_info);
+
+  /**
+   * @brief Schedule the sonar for this render tick, hand a pending readback
+   * to the worker pipeline and set the sonar pose
+   *
+   * @return true if the sonar is due on this tick
+   */
+  bool PrepareFrame();
+
+  /**
+   * @brief Process a frame read back by the render thread, called by the
+   * worker pipeline
+   *
+   * @param _frame Frame to process
+   */
+  void ProcessFrame(SonarFrame &_frame);
+
+  /**
+   * @brief Publish the sonar image, the beams message and the debug image
+   * of the last processed frame. The image and beams are written into
+   * pooled messages published by pointer, without intermediate copies.
+   *
+   * @param _stamp Simulation time of the frame
+   */
+  void PublishSonar(const common::Time &_stamp);
+
+  /**
+   * @brief Publish the stage timings if the statistics period elapsed
+   *
+   */
+  void PublishStats();
+
+  /**
+   * @brief Check if the sensor must render and publish on this render tick,
+   * based on its update rate and, in lazy mode, on the subscribers
+   *
+   * @return true if the sonar is due
+   */
+  bool IsDue();
+
+  /**
+   * @brief Check if any of the sonar topics has a subscriber
+   *
+   */
+  bool HasSubscribers() const;
+
+  /**
+   * @brief Get the simulation time of the world
+   *
+   */
+  common::Time SimTime() const;
+
 public:
   //// \brief Scene parent containing sensor
   rendering::ScenePtr scene;
@@ -82,6 +235,9 @@ private:
 
   event::ConnectionPtr updatePreRender;
 
+  // World update event connection of the CPU backend
+  event::ConnectionPtr updateWorld;
+
   // Ros node handle
   std::unique_ptr<ros::NodeHandle> rosNode;
 
@@ -105,6 +261,93 @@ private:
 
   // Debug flag
   bool bDebug;
+
+  // True when the sonar is due on the current render tick
+  bool bActiveFrame;
+
+  // Period between two sonar updates in sim time, 0 for every render
+  double updatePeriod;
+
+  // Batch this sonar is rendered with, null when it renders on its own
+  std::shared_ptr<FLSonarBatch> batch;
+
+  // Sim time of the last sonar update
+  common::Time lastUpdateTime;
+
+  // False until the first sonar update
+  bool bUpdatedOnce;
+
+  // Skip rendering and processing when no one subscribes to the sonar
+  bool bLazy;
+
+  // True when a render happened and its texture was not read back yet
+  bool bPendingReadback;
+
+  // True when the scene did not change on this tick, the render is skipped
+  bool bReuseFrame;
+
+  // True when a render was skipped and its frame not handed over yet
+  bool bPendingReuse;
+
+  // Number of renders, the frames of an unchanged scene refer to the last
+  uint64_t renderIndex;
+
+  // Last render processed, only used by the thread processing the frames
+  uint64_t processedRender;
+
+  // Set when an unchanged frame refers to a render that was dropped, so
+  // the next frame is rendered again
+  std::atomic<bool> bSceneLost;
+
+  // Simulation time of the last render
+  common::Time renderTime;
+
+  // Converts the sonar image to the published one
+  rendering::SonarColorMap colorMap;
+
+  // Reused sonar image messages
+  SonarMsgPool<sensor_msgs::Image> imageMsgPool;
+
+  // Reused beams messages
+  SonarMsgPool<sonar_msgs::SonarStamped> sonarMsgPool;
+
+  // Processing of the active backend, owned by the sonar or cpuProcessor
+  rendering::SonarProcessor *processor;
+
+  // Processing of the CPU backend, null on the GPU backend
+  std::unique_ptr<rendering::SonarProcessor> cpuProcessor;
+
+  // Shader image source of the CPU backend, null on the GPU backend
+  std::unique_ptr<rendering::SonarRayCaster> rayCaster;
+
+  // Near and far clip distances of the CPU backend
+  double nearClip, farClip;
+
+  // Ids of the models the ray caster geometry was loaded from, sorted
+  std::vector<uint32_t> cpuModelIds;
+
+  // Ids of the models of the current world update, kept to reuse its storage
+  std::vector<uint32_t> modelIds;
+
+  // Serializes reloading the ray caster geometry on the world update with
+  // casting on the worker
+  std::mutex rayCasterMutex;
+
+  // Stage timings, null when the statistics are disabled
+  std::unique_ptr<rendering::SonarStats> stats;
+
+  // Stage timings publisher
+  ros::Publisher statsPub;
+
+  // Sim time between two statistics messages
+  double statsPeriod;
+
+  // Sim time of the last statistics message
+  common::Time lastStatsTime;
+
+  // Worker pipeline, null when processing runs on the render thread.
+  // Declared last so it is stopped before the members it uses go away.
+  std::unique_ptr<SonarPipeline> pipeline;
 };
 
 // Register this plugin with the simulator
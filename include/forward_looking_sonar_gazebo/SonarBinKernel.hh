@@ -0,0 +1,112 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_BIN_KERNEL_HH_
+#define _GAZEBO_RENDERING_SONAR_BIN_KERNEL_HH_
+
+#include <cstddef>
+#include <string>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarBinKernel SonarBinKernel.hh
+/// \brief Depth histogram kernel of the sonar. Turns the samples of one
+/// beam into per bin hit counts and intensity sums in a single pass, then
+/// into mean intensities with one divide per bin. The SIMD variant (AVX2,
+/// SSE2 or scalar) is picked at runtime from the CPU features.
+class SonarBinKernel
+{
+  /// \brief Instruction sets the kernel is implemented for
+public:
+  enum Isa
+  {
+    /// \brief Portable C++
+    ISA_SCALAR,
+
+    /// \brief SSE2, baseline on x86_64
+    ISA_SSE2,
+
+    /// \brief AVX2
+    ISA_AVX2
+  };
+
+  /// \brief Constructor, uses the best instruction set of this CPU
+public:
+  SonarBinKernel();
+
+  /// \brief Constructor
+  /// \param[in] _isa Requested instruction set, falls back to the best
+  /// supported one if this CPU lacks it
+public:
+  explicit SonarBinKernel(const Isa _isa);
+
+  /// \brief Get the instruction set in use
+  /// \return Active instruction set
+public:
+  Isa ActiveIsa() const;
+
+  /// \brief Get the best instruction set supported by this CPU
+  /// \return Best instruction set
+public:
+  static Isa BestIsa();
+
+  /// \brief Get a printable name of an instruction set
+  /// \param[in] _isa Instruction set
+  /// \return Name of the instruction set
+public:
+  static std::string IsaName(const Isa _isa);
+
+  /// \brief Accumulate the samples of one beam. Each sample falls in bin
+  /// depth * (binCount - 1), clamped to the bin range. NaN depths fall in
+  /// bin 0 with every instruction set.
+  /// \param[in] _depth Normalized depth of each sample, contiguous
+  /// \param[in] _intensity Intensity of each sample, contiguous
+  /// \param[in] _samples Number of samples
+  /// \param[in] _binCount Number of bins
+  /// \param[in, out] _counts Hit count per bin, accumulated into
+  /// \param[in, out] _sums Intensity sum per bin, accumulated into
+public:
+  void Accumulate(const float *_depth, const float *_intensity,
+                  const size_t _samples, const int _binCount,
+                  float *_counts, float *_sums) const;
+
+  /// \brief Mean intensity per bin, zero for bins without hits.
+  /// _bins may alias _sums.
+  /// \param[in] _counts Hit count per bin
+  /// \param[in] _sums Intensity sum per bin
+  /// \param[in] _binCount Number of bins
+  /// \param[out] _bins Mean intensity per bin
+public:
+  void Normalize(const float *_counts, const float *_sums,
+                 const int _binCount, float *_bins) const;
+
+  /// \brief Signature of the accumulate implementations
+private:
+  typedef void (*AccumulateFn)(const float *, const float *, size_t, int,
+                               float *, float *);
+
+  /// \brief Signature of the normalize implementations
+private:
+  typedef void (*NormalizeFn)(const float *, const float *, int, float *);
+
+  /// \brief Select the implementations of an instruction set
+  /// \param[in] _isa Instruction set
+private:
+  void Select(const Isa _isa);
+
+  /// \brief Instruction set in use
+private:
+  Isa isa;
+
+  /// \brief Accumulate implementation
+private:
+  AccumulateFn accumulateFn;
+
+  /// \brief Normalize implementation
+private:
+  NormalizeFn normalizeFn;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
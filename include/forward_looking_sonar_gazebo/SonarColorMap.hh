@@ -0,0 +1,101 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_COLOR_MAP_HH_
+#define _GAZEBO_RENDERING_SONAR_COLOR_MAP_HH_
+
+#include <string>
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/opencv.hpp>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarColorMap SonarColorMap.hh
+/// \brief Converts the float sonar image to the published 8 bit image in a
+/// single pass. Gain, gamma, quantization and color map are folded into one
+/// lookup table indexed by the intensity, and only the columns of the fan
+/// are looked up, the rest of each row is cleared.
+class SonarColorMap
+{
+  /// \brief Constructor, winter color map with unit gain and gamma
+public:
+  SonarColorMap();
+
+  /// \brief Set the color map
+  /// \param[in] _name OpenCV color map name in lower case (autumn, bone,
+  /// jet, winter, rainbow, ocean, summer, spring, cool, hsv, pink, hot), or
+  /// gray
+  /// \return False if the name is unknown, the color map is then unchanged
+public:
+  bool SetColorMap(const std::string &_name);
+
+  /// \brief Set the gain applied to the intensities before the gamma
+  /// \param[in] _gain Gain
+public:
+  void SetGain(const double _gain);
+
+  /// \brief Set the gamma applied to the intensities, after the gain and
+  /// the clamp to [0, 1]
+  /// \param[in] _gamma Gamma
+public:
+  void SetGamma(const double _gamma);
+
+  /// \brief Color map an image
+  /// \param[in] _image CV_32FC1 sonar image, intensities in [0, 1]
+  /// \param[in] _mask CV_8UC1 mask of the fan
+  /// \param[in, out] _output Output of the image size, CV_8UC3 for BGR
+  /// colors or CV_8UC1 for gray levels. Can wrap a message buffer.
+public:
+  void Apply(const cv::Mat &_image, const cv::Mat &_mask, cv::Mat &_output);
+
+  /// \brief Rebuild the lookup tables
+private:
+  void UpdateTable();
+
+  /// \brief Find the column span of the fan on each row of the mask
+  /// \param[in] _mask Mask of the fan
+private:
+  void UpdateSpans(const cv::Mat &_mask);
+
+  /// \brief Number of entries of the lookup tables
+private:
+  static const int kTableSize = 4096;
+
+  /// \brief OpenCV color map, -1 for gray
+private:
+  int colorMap;
+
+  /// \brief Gain
+private:
+  double gain;
+
+  /// \brief Gamma
+private:
+  double gamma;
+
+  /// \brief BGR color of each table entry
+private:
+  std::vector<cv::Vec3b> colorTable;
+
+  /// \brief Gray level of each table entry
+private:
+  std::vector<uchar> grayTable;
+
+  /// \brief First fan column of each row
+private:
+  std::vector<int> spanBegin;
+
+  /// \brief One past the last fan column of each row
+private:
+  std::vector<int> spanEnd;
+
+  /// \brief Mask the spans were computed from
+private:
+  cv::Mat spanMask;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
@@ -0,0 +1,55 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_FRAME_ARENA_HH_
+#define _GAZEBO_RENDERING_SONAR_FRAME_ARENA_HH_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarFrameArena SonarFrameArena.hh
+/// \brief Keeps the per frame buffers of the sonar at their size. A buffer
+/// is only (re)allocated when its shape grows or changes, and every such
+/// allocation is counted, so buffers that keep growing show in the count.
+/// Allocations made outside the arena are not counted.
+class SonarFrameArena
+{
+  /// \brief Constructor
+public:
+  SonarFrameArena();
+
+  /// \brief Make a buffer hold exactly _size elements
+  /// \param[in, out] _buffer Buffer to fit
+  /// \param[in] _size Number of elements
+public:
+  void Fit(std::vector<float> &_buffer, const size_t _size);
+
+  /// \brief Make an image continuous with the given shape and type
+  /// \param[in, out] _image Image to fit, its content is kept if it already
+  /// has that shape
+  /// \param[in] _rows Number of rows
+  /// \param[in] _cols Number of columns
+  /// \param[in] _type OpenCV type
+public:
+  void Fit(cv::Mat &_image, const int _rows, const int _cols,
+           const int _type);
+
+  /// \brief Number of buffer allocations made through this arena
+  /// \return Allocation count
+public:
+  uint64_t AllocationCount() const;
+
+  /// \brief Number of allocations, made by the render thread and by the
+  /// processing worker
+private:
+  std::atomic<uint64_t> allocations;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
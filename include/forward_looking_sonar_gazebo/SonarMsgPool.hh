@@ -0,0 +1,58 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_SONAR_MSG_POOL_HH_
+#define _GAZEBO_SONAR_MSG_POOL_HH_
+
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace gazebo
+{
+/// \class SonarMsgPool SonarMsgPool.hh
+/// \brief Preallocated ROS messages published by shared pointer. Intra
+/// process subscribers get the pointer itself, so a message is only
+/// reused once the pool holds its last reference, and its buffers keep
+/// their capacity from one use to the next.
+template <typename T>
+class SonarMsgPool
+{
+  /// \brief Constructor
+  /// \param[in] _size Most messages kept for reuse
+public:
+  explicit SonarMsgPool(const size_t _size = 4)
+    : size(_size)
+  {
+    this->msgs.reserve(_size);
+  }
+
+  /// \brief Get a message no one else references. Not thread safe, the
+  /// messages of a publisher are acquired from one thread at a time.
+  /// \return Message, with the content of its previous use
+public:
+  boost::shared_ptr<T> Acquire()
+  {
+    for (auto &msg : this->msgs)
+    {
+      if (msg.use_count() == 1)
+        return msg;
+    }
+
+    // Every message is still held by a subscriber
+    boost::shared_ptr<T> msg = boost::make_shared<T>();
+    if (this->msgs.size() < this->size)
+      this->msgs.push_back(msg);
+    return msg;
+  }
+
+  /// \brief Most messages kept for reuse
+private:
+  size_t size;
+
+  /// \brief Messages kept for reuse
+private:
+  std::vector<boost::shared_ptr<T>> msgs;
+};
+}  // namespace gazebo
+#endif
@@ -0,0 +1,98 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_NOISE_HH_
+#define _GAZEBO_RENDERING_SONAR_NOISE_HH_
+
+#include <cstdint>
+#include <string>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarNoise SonarNoise.hh
+/// \brief Noise of the sonar bins from a counter based generator
+/// (Philox4x32-10). Each random number is a function of the seed, the frame,
+/// the beam and the bin only, so the beams can be drawn by any worker in any
+/// order and a seed always replays the same noise. There is no generator
+/// state shared between threads or sonars.
+class SonarNoise
+{
+  /// \brief Constructor, additive Gaussian noise of 0.25 standard deviation,
+  /// no speckle, seed 0
+public:
+  SonarNoise();
+
+  /// \brief Get the seed
+  /// \return Seed
+public:
+  uint64_t Seed() const;
+
+  /// \brief Set the seed
+  /// \param[in] _seed Seed
+public:
+  void SetSeed(const uint64_t _seed);
+
+  /// \brief Seed derived from a sensor name (64 bit FNV-1a), the same on
+  /// every platform and run, so sonars left without a seed draw different
+  /// noise and still replay it
+  /// \param[in] _name Scoped name of the sensor
+  /// \return Seed
+public:
+  static uint64_t NameSeed(const std::string &_name);
+
+  /// \brief Get the standard deviation of the additive Gaussian noise
+  /// \return Standard deviation, 0 when disabled
+public:
+  float StdDev() const;
+
+  /// \brief Set the standard deviation of the additive Gaussian noise
+  /// \param[in] _stdDev Standard deviation, 0 to disable
+public:
+  void SetStdDev(const float _stdDev);
+
+  /// \brief Get whether the echoes are multiplied by speckle
+  /// \return True if speckle is enabled
+public:
+  bool Speckle() const;
+
+  /// \brief Enable multiplicative speckle: each echo is scaled by a
+  /// Rayleigh variable of mean 1
+  /// \param[in] _speckle True to enable speckle
+public:
+  void SetSpeckle(const bool _speckle);
+
+  /// \brief Noisy echoes of a beam, in one pass with the range gain:
+  /// _output[i] = _means[i] * _gains[i] * speckle + stddev * gaussian
+  /// \param[in] _frame Frame index
+  /// \param[in] _beam Beam index
+  /// \param[in] _means Mean echo intensity of each bin
+  /// \param[in] _gains Range gain of each bin
+  /// \param[in] _count Bin count
+  /// \param[out] _output Noisy bins of the beam
+public:
+  void Apply(const uint64_t _frame, const int _beam, const float *_means,
+             const float *_gains, const int _count, float *_output) const;
+
+  /// \brief Random bits of a counter
+  /// \param[in] _counter Counter, 128 bits
+  /// \param[in] _key Key, 64 bits
+  /// \param[out] _output Random bits, 128 bits
+public:
+  static void Philox(const uint32_t _counter[4], const uint32_t _key[2], uint32_t _output[4]);
+
+  //// \brief Seed of the generator
+private:
+  uint64_t seed;
+
+  //// \brief Standard deviation of the additive Gaussian noise
+private:
+  float stdDev;
+
+  //// \brief True to multiply the echoes by speckle
+private:
+  bool bSpeckle;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
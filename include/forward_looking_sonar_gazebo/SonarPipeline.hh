@@ -0,0 +1,178 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_SONAR_PIPELINE_HH_
+#define _GAZEBO_SONAR_PIPELINE_HH_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gazebo/common/Time.hh"
+#include "ignition/math/Pose3.hh"
+
+// OpenCV includes
+#include <opencv2/opencv.hpp>
+
+namespace gazebo
+{
+/// \brief Frame handed from the render thread to the sonar worker
+struct SonarFrame
+{
+  /// \brief Texture data exactly as read back from the GPU
+  cv::Mat rawImage;
+
+  /// \brief Simulation time of the render that produced this frame
+  common::Time stamp;
+
+  /// \brief Index of the render the frame shows
+  uint64_t render = 0;
+
+  /// \brief True when the scene did not change since that render: nothing
+  /// was read back, and the render is binned again with new noise
+  bool unchanged = false;
+
+  /// \brief Sonar world pose, for the CPU backend which ray casts rawImage
+  /// on the worker
+  ignition::math::Pose3d pose;
+
+  /// \brief World poses of the ray cast instances, see
+  /// rendering::SonarRayCaster::WorldPoses
+  std::vector<ignition::math::Pose3d> instancePoses;
+
+  /// \brief Ray caster geometry the instance poses belong to
+  uint64_t worldLoads = 0;
+};
+
+/// \class SonarPipeline SonarPipeline.hh
+/// \brief Runs the CPU side of the sonar (binning, polar transform and
+/// publishing) on a dedicated worker thread, fed by the render thread
+/// through a bounded queue of preallocated frames. Slots are reused, so
+/// once every slot has been written once no more buffers are allocated.
+/// The frames are filled and processed outside of the lock, which only
+/// guards the slot bookkeeping.
+class SonarPipeline
+{
+  /// \brief What to do when the render thread produces frames faster than
+  /// the worker consumes them
+public:
+  enum DropPolicy
+  {
+    /// \brief Discard the frame being submitted when the queue is full
+    DROP_NEWEST,
+
+    /// \brief The newest frame always gets a slot: when the queue is full
+    /// it takes over the oldest frame the worker has not started, and the
+    /// worker only processes the latest queued frame
+    DROP_OLDEST,
+
+    /// \brief Stall the render thread until a slot is free
+    BLOCK
+  };
+
+  /// \brief Function called by the worker for each frame
+public:
+  typedef std::function<void(SonarFrame &)> ProcessCallback;
+
+  /// \brief Constructor
+  /// \param[in] _depth Number of frames that can be queued, besides the
+  /// one being processed
+  /// \param[in] _policy Drop policy when the queue is full
+  /// \param[in] _callback Function that processes a frame on the worker
+public:
+  SonarPipeline(const size_t _depth, const DropPolicy _policy,
+                const ProcessCallback &_callback);
+
+  /// \brief Destructor, stops the worker
+public:
+  virtual ~SonarPipeline();
+
+  /// \brief Start the worker thread
+public:
+  void Start();
+
+  /// \brief Stop the worker thread, queued frames are discarded
+public:
+  void Stop();
+
+  /// \brief Get a slot to fill from the render thread
+  /// \return Slot to fill, or nullptr if the frame must be dropped
+public:
+  SonarFrame *Acquire();
+
+  /// \brief Hand the slot returned by Acquire to the worker
+public:
+  void Commit();
+
+  /// \brief Number of frames dropped since the pipeline started
+public:
+  uint64_t DroppedFrames() const;
+
+  /// \brief Parse a drop policy name from SDF
+  /// \param[in] _name One of "drop_newest", "drop_oldest" or "block"
+  /// \param[out] _policy Parsed policy
+  /// \return False if the name is unknown
+public:
+  static bool ParseDropPolicy(const std::string &_name, DropPolicy &_policy);
+
+  /// \brief Worker loop
+private:
+  void Run();
+
+  /// \brief Frame storage, one slot more than the depth for the frame
+  /// being processed
+private:
+  std::vector<SonarFrame> slots;
+
+  /// \brief Maximum number of queued frames
+private:
+  size_t depth;
+
+  /// \brief Slots neither queued, filled nor processed
+private:
+  std::vector<size_t> freeSlots;
+
+  /// \brief Queued slots, oldest first
+private:
+  std::deque<size_t> queuedSlots;
+
+  /// \brief Slot returned by Acquire and not committed yet
+private:
+  size_t fillingSlot;
+
+  /// \brief Drop policy
+private:
+  DropPolicy policy;
+
+  /// \brief Frame processing function
+private:
+  ProcessCallback callback;
+
+  /// \brief Worker thread
+private:
+  std::thread worker;
+
+  /// \brief True while the worker must keep running
+private:
+  std::atomic<bool> running;
+
+  /// \brief Number of dropped frames
+private:
+  std::atomic<uint64_t> dropped;
+
+  /// \brief Protects the slot bookkeeping
+private:
+  std::mutex slotMutex;
+
+  /// \brief Wakes the worker when a frame is committed, and a blocked
+  /// render thread when a slot is released
+private:
+  std::condition_variable slotCondition;
+};
+}  // namespace gazebo
+#endif
@@ -0,0 +1,661 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_PROCESSOR_HH_
+#define _GAZEBO_RENDERING_SONAR_PROCESSOR_HH_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sdf/sdf.hh>
+
+#include "gazebo/common/Time.hh"
+#include "sonar_msgs/SonarStamped.h"
+#include "forward_looking_sonar_gazebo/SonarBinKernel.hh"
+#include "forward_looking_sonar_gazebo/SonarFrameArena.hh"
+#include "forward_looking_sonar_gazebo/SonarNoise.hh"
+#include "forward_looking_sonar_gazebo/SonarPsf.hh"
+#include "forward_looking_sonar_gazebo/SonarRangeGain.hh"
+#include "forward_looking_sonar_gazebo/SonarStats.hh"
+#include "forward_looking_sonar_gazebo/SonarThreadPool.hh"
+
+// OpenCV includes
+#include <opencv2/opencv.hpp>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarProcessor SonarProcessor.hh
+/// \brief CPU side of the sonar. Bins a shader image into beams and range
+/// bins, then scan converts the bins to the polar sonar image. The shader
+/// image can come from the GPU (FLSonar) or from the CPU ray caster, so
+/// nothing here depends on Ogre.
+///
+/// Shader image layout: 3 channels hold (0, depth, intensity) as the
+/// R32G32B32 texture, 2 channels hold (intensity, depth) as the compact
+/// textures. Depth is normalized by the far plane.
+class SonarProcessor
+{
+  /// \brief Cartesian to polar transfer of the pixels inside the fan, in
+  /// row major order. Pixels outside the fan are not listed.
+public:
+  struct TransferTable
+  {
+    /// \brief Offset of each pixel in the sonar image
+    std::vector<int> pixels;
+
+    /// \brief Index of the beam x bin data of each pixel. Bilinear tables
+    /// hold the first of the four (beam, bin) cells around the pixel.
+    std::vector<int> sources;
+
+    /// \brief Weight of the next beam of each pixel, empty for nearest
+    /// neighbour tables
+    std::vector<float> beamWeights;
+
+    /// \brief Weight of the next bin of each pixel, empty for nearest
+    /// neighbour tables
+    std::vector<float> binWeights;
+  };
+
+  /// \brief Shader image columns of a beam sample. Every row of the
+  /// columns is one sample of the beam.
+public:
+  struct BeamColumn
+  {
+    /// \brief Beam index
+    int beam;
+
+    /// \brief First column interpolated
+    int column0;
+
+    /// \brief Second column interpolated
+    int column1;
+
+    /// \brief Weight of the second column
+    float weight;
+  };
+
+  /// \brief Constructor
+public:
+  SonarProcessor();
+
+  /// \brief Destructor
+public:
+  virtual ~SonarProcessor();
+
+  /// \brief Load the sonar geometry and processing parameters
+  /// \param[in] _sdf Sonar plugin SDF
+  /// \param[in] _name Scoped name of the sonar, which seeds the noise
+  /// unless the SDF sets a seed
+public:
+  void Load(sdf::ElementPtr _sdf, const std::string &_name);
+
+  /// \brief Get the horizontal field-of-view.
+  /// \return The horizontal field of view of the sonar sensor.
+public:
+  double HorzFOV() const;
+
+  /// \brief Set the horizontal fov
+  /// \param[in] _hfov horizontal fov
+public:
+  void SetHorzFOV(const double _hfov);
+
+  /// \brief Get the vertical field-of-view.
+  /// \return The vertical field of view of the sonar sensor.
+public:
+  double VertFOV() const;
+
+  /// \brief Set the vertical fov
+  /// \param[in] _vfov vertical fov
+public:
+  void SetVertFOV(const double _vfov);
+
+  /// \brief Get the shader image width
+  /// \return Image width
+public:
+  int ImageWidth() const;
+
+  /// \brief Set the shader image width
+  /// \param[in] _value Image width
+public:
+  void SetImageWidth(const int _value);
+
+  /// \brief Get the shader image height
+  /// \return Image height
+public:
+  int ImageHeight() const;
+
+  /// \brief Set the shader image height
+  /// \param[in] _value Image height
+public:
+  void SetImageHeight(const int _value);
+
+  /// \brief Get the number of horizontal field of view tiles. The shader
+  /// image is then made of that many column blocks of equal width, each
+  /// rendered by a camera with the field of view of the tile, yawed to its
+  /// center.
+  /// \return Tile count, 1 for a single camera
+public:
+  int FovTileCount() const;
+
+  /// \brief Set the number of horizontal field of view tiles
+  /// \param[in] _value Tile count, must divide the shader image width
+public:
+  void SetFovTileCount(const int _value);
+
+  /// \brief Get the width of a field of view tile
+  /// \return Shader image columns of each tile
+public:
+  int FovTileWidth() const;
+
+  /// \brief Get the yaw of the camera rendering a tile
+  /// \param[in] _tile Tile index, from the first shader image columns
+  /// \return Angle of the tile center from the sonar axis, positive
+  /// towards the last columns
+public:
+  double FovTileYaw(const int _tile) const;
+
+  /// \brief Get the sonar image width
+  /// \return Sonar image width, the shader image width unless set
+public:
+  int OutputWidth() const;
+
+  /// \brief Set the sonar image width
+  /// \param[in] _value Sonar image width, 0 to follow the shader image
+public:
+  void SetOutputWidth(const int _value);
+
+  /// \brief Get the sonar image height
+  /// \return Sonar image height, the shader image height unless set
+public:
+  int OutputHeight() const;
+
+  /// \brief Set the sonar image height
+  /// \param[in] _value Sonar image height, 0 to follow the shader image
+public:
+  void SetOutputHeight(const int _value);
+
+  /// \brief Tell if the bins are scan converted to the sonar image
+  /// \return True if the sonar image is produced
+public:
+  bool SonarImageEnabled() const;
+
+  /// \brief Enable the scan conversion to the sonar image. When disabled
+  /// only the beams and bins are produced, and the sonar image and mask
+  /// are empty.
+  /// \param[in] _enabled True to produce the sonar image
+public:
+  void SetSonarImageEnabled(const bool _enabled);
+
+  /// \brief Get the number of range bins
+  /// \return Bin count
+public:
+  int BinCount() const;
+
+  /// \brief Set the number of range bins
+  /// \param[in] _value Bin count
+public:
+  void SetBinCount(const int _value);
+
+  /// \brief Get the range of the far edge of the last bin
+  /// \return Range in meters
+public:
+  double MaxRange() const;
+
+  /// \brief Set the range of the far edge of the last bin, for the range
+  /// gain models in meters
+  /// \param[in] _range Range in meters
+public:
+  void SetMaxRange(const double _range);
+
+  /// \brief Get the range gain model
+  /// \return Range gain model
+public:
+  const SonarRangeGain &RangeGain() const;
+
+  /// \brief Set the range gain model
+  /// \param[in] _rangeGain Range gain model
+public:
+  void SetRangeGain(const SonarRangeGain &_rangeGain);
+
+  /// \brief Get the number of beams
+  /// \return Beam count
+public:
+  int BeamCount() const;
+
+  /// \brief Set the number of beams
+  /// \param[in] _value Beam count
+public:
+  void SetBeamCount(const int _value);
+
+  /// \brief Get the number of channels of the shader image
+  /// \return 3 or 2, see the class description
+public:
+  int ShaderChannels() const;
+
+  /// \brief Set the number of channels of the shader image
+  /// \param[in] _channels 3 or 2, see the class description
+public:
+  void SetShaderChannels(const int _channels);
+
+  /// \brief Size an image for the shader output, without allocating if it
+  /// already has the right shape
+  /// \param[in, out] _image Image to size
+public:
+  void FitShaderImage(cv::Mat &_image);
+
+  /// \brief Get the internal shader image, sized for the current geometry.
+  /// Writing it then calling Bin() avoids a copy.
+  /// \return Shader image
+public:
+  cv::Mat &ShaderBuffer();
+
+  /// \brief Bin the internal shader image into beam x bin intensities
+public:
+  void Bin();
+
+  /// \brief Bin a shader image into beam x bin intensities. The image is
+  /// shared, not copied, and must not change until the next call or
+  /// DetachShaderImage().
+  /// \param[in] _image Shader image
+public:
+  void Bin(const cv::Mat &_image);
+
+  /// \brief Stop sharing the image given to Bin(const cv::Mat &), so its
+  /// owner can write it again
+  /// \param[in] _copy Keep a copy for ShaderImage(), otherwise it is empty
+  /// until the next frame. The copy reuses its buffer between frames.
+public:
+  void DetachShaderImage(const bool _copy);
+
+  /// \brief Size a bin count image for the current geometry
+  /// \param[in, out] _counts Bin count image, reallocated only if its
+  /// size or type differ
+public:
+  void FitBinCounts(cv::Mat &_counts);
+
+  /// \brief Size an image for one field of view tile of the shader output
+  /// \param[in, out] _image Image to size
+public:
+  void FitTileImage(cv::Mat &_image);
+
+  /// \brief Accumulate the beams of one field of view tile into bin counts,
+  /// as the GPU binning reads them back. A tiled render is then binned tile
+  /// by tile as each one is read back and processed by ProcessBinCounts(),
+  /// so the whole shader image is never held. Columns of a beam past the
+  /// edges of its tile are clamped to the tile. Has its own scratch
+  /// buffers, so it can run on the render thread while an earlier frame is
+  /// processed.
+  /// \param[in] _image Shader image of the tile, see FitTileImage()
+  /// \param[in] _tile Tile index
+  /// \param[in, out] _counts Bin counts sized by FitBinCounts(), only the
+  /// rows of the beams centered in the tile are written
+public:
+  void BinTile(const cv::Mat &_image, const int _tile, cv::Mat &_counts);
+
+  /// \brief Finish bins accumulated elsewhere, on the GPU, into beam x bin
+  /// intensities: the mean, noise and blur of Bin() without the sampling
+  /// of the shader image
+  /// \param[in] _counts CV_32FC3 image of beam count rows and bin count
+  /// columns, holding the (intensity sum, sample count, unused) of each bin
+public:
+  void BinCounts(const cv::Mat &_counts);
+
+  /// \brief Scan convert the last binned data to the polar sonar image
+public:
+  void ScanConvert();
+
+  /// \brief Bin and scan convert a shader image
+  /// \param[in] _image Shader image
+public:
+  void Process(const cv::Mat &_image);
+
+  /// \brief Finish bins accumulated elsewhere and scan convert them
+  /// \param[in] _counts Bin counts, see BinCounts()
+public:
+  void ProcessBinCounts(const cv::Mat &_counts);
+
+  /// \brief Bin the last frame again for an unchanged scene: only the noise
+  /// and the blur are redone over the kept mean intensities, the shader
+  /// image is neither needed nor sampled
+  /// \return False if no frame was binned with the current geometry
+public:
+  bool Rebin();
+
+  /// \brief Rebin the last frame and scan convert it
+  /// \return False if no frame was binned with the current geometry
+public:
+  bool Reprocess();
+
+  /// \brief Get the shader image columns sampled by each beam, one entry
+  /// per column blend in linear beam sampling and one per covered column in
+  /// area sampling
+  /// \param[out] _columns Beam columns, in beam order
+public:
+  void BeamColumns(std::vector<BeamColumn> &_columns) const;
+
+  /// \brief Get the shader image as (intensity, depth, 0) whatever the
+  /// channel layout, converted on each call
+  /// \return Shader image
+public:
+  cv::Mat ShaderImage() const;
+
+  /// \brief Get the sonar image on polar coordinates
+  /// \return Sonar image
+public:
+  cv::Mat SonarImage() const;
+
+  /// \brief Get the mask of the fan in the sonar image
+  /// \return Sonar mask
+public:
+  cv::Mat SonarMask() const;
+
+  /// \brief Get the beam x bin intensities of the last binned frame
+  /// \return Intensities, beam major
+public:
+  const std::vector<float> &AccumData() const;
+
+  /// \brief Get the Ros sonar msg of the last binned frame
+  /// \param[in] _stamp Simulation time of the data
+  /// \return Sonar message
+public:
+  sonar_msgs::SonarStamped SonarRosMsg(const common::Time &_stamp) const;
+
+  /// \brief Fill a Ros sonar msg with the last binned frame, without
+  /// copying the beams: the bin data is swapped with the msg data, whose
+  /// buffer is reused by the next frame. AccumData() is not valid until the
+  /// next Bin().
+  /// \param[in, out] _msg Message to fill, preferably a reused one
+  /// \param[in] _stamp Simulation time of the data
+public:
+  void FillSonarRosMsg(sonar_msgs::SonarStamped &_msg, const common::Time &_stamp);
+
+  /// \brief Get the number of per frame buffer allocations. Stays constant
+  /// once the buffers are sized.
+  /// \return Allocation count
+public:
+  uint64_t AllocationCount() const;
+
+  /// \brief Get the workers of the beam loops
+  /// \return Thread pool
+public:
+  SonarThreadPool &ThreadPool();
+
+  /// \brief Set the workers of the beam loops. The output does not depend
+  /// on their number.
+  /// \param[in] _threads Number of workers of a pool of this sonar only,
+  /// the calling thread counts as one, or 0 for the pool shared by all sonars
+public:
+  void SetThreadCount(const int _threads);
+
+  /// \brief Get the point spread of the bins
+  /// \return Point spread stage
+public:
+  SonarPsf &Psf();
+
+  /// \brief Get the noise of the bins
+  /// \return Noise generator
+public:
+  SonarNoise &Noise();
+
+  /// \brief Set the scan conversion interpolation
+  /// \param[in] _bilinear True to interpolate the pixels between the four
+  /// closest (beam, bin) cells, false for the nearest cell
+public:
+  void SetBilinearScanConversion(const bool _bilinear);
+
+  /// \brief Set the statistics the processing stages are timed into
+  /// \param[in] _stats Statistics, null to disable the timing
+public:
+  void SetStats(SonarStats *_stats);
+
+  /// \brief Rebuild the cached transfer table, beam gather table, sonar
+  /// mask and frame buffers if the geometry changed since the last call
+protected:
+  void UpdateTransferTable();
+
+  /// \brief Create transfer table from cartesian to polar
+  /// \param[out] _transfer Transfer table that will be generated, any
+  /// previous content is replaced
+protected:
+  void GenerateTransferTable(TransferTable &_transfer);
+
+  /// \brief Create the table of shader image columns sampled by each beam
+protected:
+  void GenerateBeamGatherTable();
+
+  /// \brief Size the per frame buffers for the current geometry, so that
+  /// frames do not allocate
+protected:
+  void AllocateFrameBuffers();
+
+  /// \brief Shader image to sonar bin data
+  /// \param[out] _accumData Beam x bin intensities
+protected:
+  void CvToSonarBin(std::vector<float> &_accumData);
+
+  /// \brief Noisy intensities of a beam from its mean intensities and the
+  /// range gain
+  /// \param[in] _beam Beam index
+  /// \param[in] _means Mean intensity of each bin of the beam
+protected:
+  void AddBeamIntensities(const int _beam, const float *_means);
+
+  /// \brief Blur the noisy beams straight into the sonar bin data
+  /// \param[out] _accumData Beam x bin intensities
+protected:
+  void BlurBins(std::vector<float> &_accumData);
+
+  /// \brief Transfer the sonar bin data to the sonar image using the
+  /// transfer table
+  /// \param[in] _accumData Vector with sonar bins data, of beam count x bin
+  /// count entries
+  /// \param[in] _transfer Transfer table cartesian to polar
+protected:
+  void TransferTableToSonar(const std::vector<float> &_accumData,
+                            const TransferTable &_transfer);
+
+  //// \brief Horizontal field-of-view
+protected:
+  double hfov;
+
+  //// \brief Vertical field-of-view
+protected:
+  double vfov;
+
+  //// \brief Image width for texture
+protected:
+  int imageWidth;
+
+  //// \brief Image height for texture
+protected:
+  int imageHeight;
+
+  //// \brief Number of horizontal field of view tiles
+protected:
+  int fovTileCount;
+
+  //// \brief Sonar image width, 0 to follow the shader image
+protected:
+  int outputWidth;
+
+  //// \brief Sonar image height, 0 to follow the shader image
+protected:
+  int outputHeight;
+
+  //// \brief Scan convert the bins to the sonar image
+protected:
+  bool bSonarImageEnabled;
+
+  //// \brief Number of bins
+protected:
+  int binCount;
+
+  //// \brief Number of beams
+protected:
+  int beamCount;
+
+  //// \brief Range of the far edge of the last bin, in meters
+protected:
+  double maxRange;
+
+  //// \brief Number of channels of the shader image
+protected:
+  int shaderChannels;
+
+  //// \brief Sonar beams depth data, hit count of each bin. One binCount
+  //// slice per worker thread.
+protected:
+  std::vector<float> sonarBinsDepth;
+
+  //// \brief Mean intensity of each bin before the gain and noise, beam
+  //// major, kept to rebin an unchanged scene
+protected:
+  std::vector<float> beamMeans;
+
+  //// \brief True when beamMeans holds a frame of the current geometry
+protected:
+  bool bBinned;
+
+  //// \brief Image mask for polar image output
+protected:
+  cv::Mat sonarImageMask;
+
+  //// \brief Image of the pure sonar image in cartesian coordinates
+protected:
+  cv::Mat sonarImage;
+
+  //// \brief Shader image, in the channel layout of the texture format
+protected:
+  cv::Mat rawImage;
+
+  //// \brief Copy of a shared shader image, see DetachShaderImage()
+protected:
+  cv::Mat shaderCopy;
+
+  //// \brief Data from sensor
+protected:
+  std::vector<float> accumData;
+
+  //// \brief Beam x bin intensities with noise, before the blur
+protected:
+  cv::Mat noisyImage;
+
+  //// \brief Noise of the bins
+protected:
+  SonarNoise noise;
+
+  //// \brief Index of the frame, for the noise
+protected:
+  uint64_t noiseFrame;
+
+  //// \brief Range gain model
+protected:
+  SonarRangeGain rangeGainModel;
+
+  //// \brief Gain of each bin, from the range gain model
+protected:
+  std::vector<float> rangeGain;
+
+  //// \brief Blur of the noisy beams into the sonar bin data
+protected:
+  SonarPsf psf;
+
+  //// \brief Sizes and counts the per frame buffers
+protected:
+  SonarFrameArena arena;
+
+  //// \brief Cached cartesian to polar transfer table
+protected:
+  TransferTable transferTable;
+
+  //// \brief True when the transfer table must be regenerated
+protected:
+  bool bTransferTableDirty;
+
+  //// \brief First shader image column of the linear sample of each beam
+protected:
+  std::vector<int> beamColumn0;
+
+  //// \brief Second shader image column of the linear sample of each beam
+protected:
+  std::vector<int> beamColumn1;
+
+  //// \brief Weight of beamColumn1 in the linear sample of each beam
+protected:
+  std::vector<float> beamWeight;
+
+  //// \brief First shader image column covered by each beam
+protected:
+  std::vector<int> beamColumnBegin;
+
+  //// \brief One past the last shader image column covered by each beam
+protected:
+  std::vector<int> beamColumnEnd;
+
+  //// \brief First beam of each field of view tile, the beams whose center
+  //// lies in the tile, and the beam count last
+protected:
+  std::vector<int> tileBeamBegin;
+
+  //// \brief Normalized depth of a beam of a tile, per worker
+protected:
+  std::vector<float> tileDepth;
+
+  //// \brief Intensity of a beam of a tile, per worker
+protected:
+  std::vector<float> tileIntensity;
+
+  //// \brief Depth histogram of a beam of a tile, per worker
+protected:
+  std::vector<float> tileBinCounts;
+
+  //// \brief Intensity sums of a beam of a tile, per worker
+protected:
+  std::vector<float> tileBinSums;
+
+  //// \brief Integrate all the columns of a beam instead of sampling it
+protected:
+  bool bAreaBeamSampling;
+
+  //// \brief Interpolate the scan conversion over beams and bins
+protected:
+  bool bBilinearScanConversion;
+
+  //// \brief Normalized depth sampled for each beam, beam major
+protected:
+  std::vector<float> beamDepth;
+
+  //// \brief Intensity sampled for each beam, beam major
+protected:
+  std::vector<float> beamIntensity;
+
+  //// \brief Depth histogram kernel, SIMD variant picked at runtime
+protected:
+  SonarBinKernel binKernel;
+
+  //// \brief Workers for the beam loops, possibly shared with other sonars
+protected:
+  std::shared_ptr<SonarThreadPool> threadPool;
+
+  //// \brief Stage timings, null when disabled
+protected:
+  SonarStats *stats;
+
+  //// \brief Beam sampling time of each worker in the last frame
+protected:
+  std::vector<float> workerRemapTime;
+
+  //// \brief Binning time of each worker in the last frame
+protected:
+  std::vector<float> workerBinTime;
+
+  //// \brief Focal length of camera in pixel
+protected:
+  double focal_length;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
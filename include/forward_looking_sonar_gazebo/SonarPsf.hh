@@ -0,0 +1,160 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_PSF_HH_
+#define _GAZEBO_RENDERING_SONAR_PSF_HH_
+
+#include <string>
+#include <vector>
+
+#include "forward_looking_sonar_gazebo/SonarThreadPool.hh"
+
+// OpenCV includes
+#include <opencv2/opencv.hpp>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarPsf SonarPsf.hh
+/// \brief Point spread function of the sonar over the beam x bin grid. The
+/// kernel is separable and computed once for its size: a pass along the
+/// bins of each beam, then a pass across the beams, both split over the
+/// beams between the workers. Borders are reflected like OpenCV's default.
+class SonarPsf
+{
+  /// \brief Kernel shapes
+public:
+  enum Mode
+  {
+    /// \brief Gaussian, cost grows with the kernel width
+    GAUSSIAN,
+
+    /// \brief Three box passes of the Gaussian variance, cost independent
+    /// of the kernel width, for very large grids
+    BOX
+  };
+
+  /// \brief Constructor, Gaussian of 11 beams by 9 bins
+public:
+  SonarPsf();
+
+  /// \brief Set the kernel size. The Gaussian sigma follows from the width
+  /// like OpenCV's getGaussianKernel with no sigma.
+  /// \param[in] _beamWidth Width across the beams, rounded up to odd
+  /// \param[in] _binWidth Width along the bins, rounded up to odd
+public:
+  void SetKernel(const int _beamWidth, const int _binWidth);
+
+  /// \brief Set the kernel shape
+  /// \param[in] _mode Kernel shape
+public:
+  void SetMode(const Mode _mode);
+
+  /// \brief Parse a kernel shape name
+  /// \param[in] _name "gaussian" or "box"
+  /// \param[out] _mode Kernel shape, unchanged if the name is unknown
+  /// \return False if the name is unknown
+public:
+  static bool ParseMode(const std::string &_name, Mode &_mode);
+
+  /// \brief Spread a beam x bin grid
+  /// \param[in] _input CV_32FC1 image of beam count rows and bin count
+  /// columns
+  /// \param[out] _output Beam major output of the input size, cannot alias
+  /// the input
+  /// \param[in] _threadPool Workers the beams are split between
+public:
+  void Apply(const cv::Mat &_input, float *_output, SonarThreadPool &_threadPool);
+
+  /// \brief Recompute the kernels from the widths and the mode
+private:
+  void UpdateKernels();
+
+  /// \brief Convolve each row with a kernel
+  /// \param[in] _input Input image
+  /// \param[out] _output Output image
+  /// \param[in] _kernel Odd sized kernel
+  /// \param[in] _threadPool Workers the rows are split between
+private:
+  void GaussianRows(const cv::Mat &_input, cv::Mat &_output,
+                    const std::vector<float> &_kernel, SonarThreadPool &_threadPool);
+
+  /// \brief Convolve each column with a kernel
+  /// \param[in] _input Input image
+  /// \param[out] _output Output image
+  /// \param[in] _kernel Odd sized kernel
+  /// \param[in] _threadPool Workers the rows are split between
+private:
+  void GaussianColumns(const cv::Mat &_input, cv::Mat &_output,
+                       const std::vector<float> &_kernel, SonarThreadPool &_threadPool);
+
+  /// \brief Box filter each row with a running sum
+  /// \param[in] _input Input image
+  /// \param[out] _output Output image
+  /// \param[in] _radius Box radius
+  /// \param[in] _threadPool Workers the rows are split between
+private:
+  void BoxRows(const cv::Mat &_input, cv::Mat &_output, const int _radius,
+               SonarThreadPool &_threadPool);
+
+  /// \brief Box filter each column with a running sum
+  /// \param[in] _input Input image
+  /// \param[out] _output Output image
+  /// \param[in] _radius Box radius
+  /// \param[in] _threadPool Workers the columns are split between
+private:
+  void BoxColumns(const cv::Mat &_input, cv::Mat &_output, const int _radius,
+                  SonarThreadPool &_threadPool);
+
+  /// \brief Reflected copy of a row, padded on both sides
+  /// \param[in] _row Row
+  /// \param[in] _cols Row length
+  /// \param[in] _radius Padding of each side
+  /// \param[in] _worker Worker owning the padded buffer
+  /// \return Padded row, _cols + 2 * _radius long
+private:
+  float *PadRow(const float *_row, const int _cols, const int _radius, const size_t _worker);
+
+  /// \brief Kernel shape
+private:
+  Mode mode;
+
+  /// \brief Kernel width across the beams
+private:
+  int beamWidth;
+
+  /// \brief Kernel width along the bins
+private:
+  int binWidth;
+
+  /// \brief Gaussian kernel across the beams
+private:
+  std::vector<float> beamKernel;
+
+  /// \brief Gaussian kernel along the bins
+private:
+  std::vector<float> binKernel;
+
+  /// \brief Radius of the box passes across the beams
+private:
+  int beamBoxRadius;
+
+  /// \brief Radius of the box passes along the bins
+private:
+  int binBoxRadius;
+
+  /// \brief Intermediate images of the passes
+private:
+  cv::Mat scratch[2];
+
+  /// \brief Padded rows, one slice per worker
+private:
+  std::vector<float> paddedRows;
+
+  /// \brief Running column sums of the box passes
+private:
+  std::vector<float> columnSums;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
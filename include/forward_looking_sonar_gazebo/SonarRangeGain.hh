@@ -0,0 +1,122 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_RANGE_GAIN_HH_
+#define _GAZEBO_RENDERING_SONAR_RANGE_GAIN_HH_
+
+#include <string>
+#include <vector>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarRangeGain SonarRangeGain.hh
+/// \brief Time varying gain of the sonar: the gain of each range bin, from
+/// a model evaluated once per bin count into a table the binning multiplies
+/// the echoes with.
+class SonarRangeGain
+{
+  /// \brief Gain models
+public:
+  enum Type
+  {
+    /// \brief Polynomial of the range normalized by the maximum range,
+    /// at the near edge of each bin
+    POLYNOMIAL,
+
+    /// \brief Compensation of the spreading and absorption losses,
+    /// scale * r^exponent * exp(2 * attenuation * r), at the center of each
+    /// bin in meters
+    SPREADING,
+
+    /// \brief Curve of (range in meters, gain) points, linearly interpolated
+    /// at the center of each bin and held past its ends
+    CURVE
+  };
+
+  /// \brief Constructor, 0.5 + 7 x^2 polynomial
+public:
+  SonarRangeGain();
+
+  /// \brief Get the gain model
+  /// \return Gain model
+public:
+  Type GetType() const;
+
+  /// \brief Use a polynomial gain
+  /// \param[in] _coefficients Coefficients, constant term first
+public:
+  void SetPolynomial(const std::vector<double> &_coefficients);
+
+  /// \brief Use a spreading and absorption gain
+  /// \param[in] _scale Gain at 1 m without absorption
+  /// \param[in] _exponent Spreading exponent
+  /// \param[in] _attenuation Attenuation coefficient, in 1/m like the
+  /// attenuationCoeff of the shader
+public:
+  void SetSpreading(const double _scale, const double _exponent, const double _attenuation);
+
+  /// \brief Use a gain curve
+  /// \param[in] _ranges Ranges of the points in meters, increasing
+  /// \param[in] _gains Gains of the points
+  /// \return False if the curve is empty, unsorted or of mismatched sizes,
+  /// and the gain model is unchanged
+public:
+  bool SetCurve(const std::vector<double> &_ranges, const std::vector<double> &_gains);
+
+  /// \brief Read a gain curve from a CSV file of "range,gain" lines. Lines
+  /// starting with '#' and lines that are not two numbers, like a header,
+  /// are skipped.
+  /// \param[in] _path CSV file
+  /// \param[out] _ranges Ranges of the points
+  /// \param[out] _gains Gains of the points
+  /// \return False if the file cannot be read or has no point
+public:
+  static bool ReadCsv(const std::string &_path, std::vector<double> &_ranges,
+                      std::vector<double> &_gains);
+
+  /// \brief Parse a gain model name
+  /// \param[in] _name "polynomial", "spreading" or "csv"
+  /// \param[out] _type Gain model, unchanged if the name is unknown
+  /// \return False if the name is unknown
+public:
+  static bool ParseType(const std::string &_name, Type &_type);
+
+  /// \brief Evaluate the gain of every bin
+  /// \param[in] _binCount Bin count
+  /// \param[in] _maxRange Range of the far edge of the last bin, in meters
+  /// \param[out] _table Gain of each bin, of bin count size
+public:
+  void Fill(const int _binCount, const double _maxRange, float *_table) const;
+
+  /// \brief Gain model
+private:
+  Type type;
+
+  /// \brief Polynomial coefficients, constant term first
+private:
+  std::vector<double> coefficients;
+
+  /// \brief Spreading gain at 1 m
+private:
+  double scale;
+
+  /// \brief Spreading exponent
+private:
+  double exponent;
+
+  /// \brief Attenuation coefficient
+private:
+  double attenuation;
+
+  /// \brief Ranges of the curve points
+private:
+  std::vector<double> ranges;
+
+  /// \brief Gains of the curve points
+private:
+  std::vector<double> gains;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
@@ -0,0 +1,315 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_RAY_CASTER_HH_
+#define _GAZEBO_RENDERING_SONAR_RAY_CASTER_HH_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sdf/sdf.hh>
+
+#include "gazebo/common/Mesh.hh"
+#include "gazebo/physics/physics.hh"
+#include "ignition/math/Pose3.hh"
+#include "ignition/math/Vector3.hh"
+#include "forward_looking_sonar_gazebo/SonarThreadPool.hh"
+
+// OpenCV includes
+#include <opencv2/opencv.hpp>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarRayCaster SonarRayCaster.hh
+/// \brief CPU replacement of the sonar shader, for machines without a GPU
+/// or with rendering disabled. Ray casts triangle meshes and writes the same
+/// shader image as normal_depth_map.frag: depth normalized by the far plane
+/// and |dot(view, normal)| scaled by the reflectance.
+///
+/// Every mesh is an instance with its own BVH in local space, placed in the
+/// world by a pose, so moving models do not rebuild anything. The BVH leaves
+/// hold packets of four triangles tested at once with SSE, and the image is
+/// rendered in tiles on a thread pool. The instances are culled against the
+/// sonar frustum once per render, so the rays only visit the visible ones.
+class SonarRayCaster
+{
+  /// \brief Constructor
+public:
+  SonarRayCaster();
+
+  /// \brief Destructor
+public:
+  virtual ~SonarRayCaster();
+
+  /// \brief Remove every instance
+public:
+  void Clear();
+
+  /// \brief Add an instance of a mesh
+  /// \param[in] _mesh Mesh, its triangle submeshes are used
+  /// \param[in] _scale Scale applied to the mesh vertices
+  /// \param[in] _reflectance Reflectance, as the laser_retro of a visual.
+  /// Values up to 0 leave the normals unscaled, like the shader.
+  /// \return Index of the instance
+public:
+  int AddMesh(const common::Mesh &_mesh,
+              const ignition::math::Vector3d &_scale,
+              const double _reflectance);
+
+  /// \brief Set the world pose of an instance
+  /// \param[in] _instance Index of the instance
+  /// \param[in] _pose World pose
+public:
+  void SetPose(const int _instance, const ignition::math::Pose3d &_pose);
+
+  /// \brief Add the visuals of every model of a world, replacing the
+  /// current instances. Boxes, spheres, cylinders, planes and meshes are
+  /// supported.
+  /// \param[in] _world World to load
+public:
+  void LoadWorld(const physics::WorldPtr &_world);
+
+  /// \brief Move the instances added by LoadWorld to the current poses of
+  /// their links
+public:
+  void UpdateWorldPoses();
+
+  /// \brief Read the world poses the instances added by LoadWorld would
+  /// get from their links. Only the physics is read, so another thread can
+  /// render meanwhile.
+  /// \param[out] _poses World pose of each instance added by LoadWorld
+  /// \return Number of LoadWorld calls so far, which the poses belong to
+public:
+  uint64_t WorldPoses(std::vector<ignition::math::Pose3d> &_poses) const;
+
+  /// \brief Move the instances added by LoadWorld
+  /// \param[in] _poses Poses read by WorldPoses
+  /// \param[in] _worldLoads Value returned by WorldPoses with them
+  /// \return False if the world was loaded again since they were read
+public:
+  bool SetWorldPoses(const std::vector<ignition::math::Pose3d> &_poses,
+                     const uint64_t _worldLoads);
+
+  /// \brief Get the number of instances
+  /// \return Instance count
+public:
+  size_t InstanceCount() const;
+
+  /// \brief Render the shader image seen from a sonar pose
+  /// \param[in] _pose Sonar world pose, looking along +X with +Z up
+  /// \param[in] _hfov Horizontal field of view
+  /// \param[in] _vfov Vertical field of view
+  /// \param[in] _near Near clip distance
+  /// \param[in] _far Far clip distance
+  /// \param[in, out] _image Shader image, already sized. 3 channels get
+  /// (0, depth, intensity), 2 channels get (intensity, depth).
+  /// \param[in] _threadPool Workers rendering the tiles
+  /// \param[in] _fovTiles Number of horizontal field of view tiles, see
+  /// SonarProcessor::FovTileCount. Must divide the image width.
+public:
+  void Render(const ignition::math::Pose3d &_pose,
+              const double _hfov, const double _vfov,
+              const double _near, const double _far,
+              cv::Mat &_image, SonarThreadPool &_threadPool,
+              const int _fovTiles = 1);
+
+  /// \brief Ray in the frame of an instance
+private:
+  struct Ray
+  {
+    /// \brief Origin
+    float origin[3];
+
+    /// \brief Unit direction
+    float dir[3];
+
+    /// \brief Inverse of the direction, for the box tests
+    float invDir[3];
+  };
+
+  /// \brief Closest hit of a ray
+private:
+  struct Hit
+  {
+    /// \brief Distance along the ray
+    float t;
+
+    /// \brief Barycentric coordinates of the hit
+    float u, v;
+
+    /// \brief Instance hit, -1 for none
+    int instance;
+
+    /// \brief Triangle hit, index in the instance
+    int triangle;
+  };
+
+  /// \brief BVH node. Inner nodes have their two children at first and
+  /// first + 1, leaves hold count packets from first.
+private:
+  struct Node
+  {
+    /// \brief Bounds of the node
+    float min[3], max[3];
+
+    /// \brief First child or first packet
+    int first;
+
+    /// \brief Number of packets, 0 for inner nodes
+    int count;
+  };
+
+  /// \brief Four triangles in structure of arrays layout. Missing
+  /// triangles are degenerate and never hit.
+private:
+  struct alignas(16) Packet
+  {
+    /// \brief First vertex, per axis
+    float v0[3][4];
+
+    /// \brief First edge, per axis
+    float e1[3][4];
+
+    /// \brief Second edge, per axis
+    float e2[3][4];
+
+    /// \brief Index of the triangles, -1 for padding
+    int triangle[4];
+  };
+
+  /// \brief Mesh placed in the world
+private:
+  struct Instance
+  {
+    /// \brief BVH nodes, the root is the first one
+    std::vector<Node> nodes;
+
+    /// \brief Triangle packets of the leaves
+    std::vector<Packet> packets;
+
+    /// \brief Vertex normals, three per triangle
+    std::vector<ignition::math::Vector3d> normals;
+
+    /// \brief Reflectance
+    double reflectance;
+
+    /// \brief World pose
+    ignition::math::Pose3d pose;
+
+    /// \brief Local bounds
+    ignition::math::Vector3d min, max;
+
+    /// \brief World bounds, updated with the pose
+    ignition::math::Vector3d worldMin, worldMax;
+  };
+
+  /// \brief Instance added by LoadWorld
+private:
+  struct WorldVisual
+  {
+    /// \brief Link of the visual
+    physics::LinkPtr link;
+
+    /// \brief Pose of the visual in the link frame
+    ignition::math::Pose3d pose;
+
+    /// \brief Instance of the visual
+    int instance;
+  };
+
+  /// \brief Instance in the frustum of a render, with what all of its rays
+  /// share
+private:
+  struct VisibleInstance
+  {
+    /// \brief Instance index
+    int instance;
+
+    /// \brief World bounds
+    float worldMin[3], worldMax[3];
+
+    /// \brief Sonar position in the instance frame
+    ignition::math::Vector3d localOrigin;
+  };
+
+  /// \brief Gather the instances whose bounds intersect the frustum of a
+  /// render into visibleInstances
+  /// \param[in] _pose Sonar world pose
+  /// \param[in] _hfov Horizontal field of view
+  /// \param[in] _vfov Vertical field of view
+  /// \param[in] _far Far clip distance
+  /// \param[in] _fovTiles Number of horizontal field of view tiles
+private:
+  void CullInstances(const ignition::math::Pose3d &_pose,
+                     const double _hfov, const double _vfov,
+                     const double _far, const int _fovTiles);
+
+  /// \brief Add the visuals of a model and its nested models
+  /// \param[in] _model Model to load
+private:
+  void LoadModel(const physics::ModelPtr &_model);
+
+  /// \brief Add a visual of a link
+  /// \param[in] _link Link of the visual
+  /// \param[in] _visual Visual SDF
+private:
+  void LoadVisual(const physics::LinkPtr &_link, sdf::ElementPtr _visual);
+
+  /// \brief Add an instance from its triangles
+  /// \param[in] _vertices Three vertices per triangle
+  /// \param[in] _normals One normal per vertex, zero for the face normal
+  /// \param[in] _reflectance Reflectance
+  /// \return Index of the instance
+private:
+  int AddTriangles(const std::vector<ignition::math::Vector3d> &_vertices,
+                   const std::vector<ignition::math::Vector3d> &_normals,
+                   const double _reflectance);
+
+  /// \brief Build the BVH of an instance
+  /// \param[in, out] _instance Instance with its triangles
+  /// \param[in] _vertices Three vertices per triangle
+private:
+  void Build(Instance &_instance,
+             const std::vector<ignition::math::Vector3d> &_vertices);
+
+  /// \brief Find the closest hit of a ray in an instance
+  /// \param[in] _instance Instance index
+  /// \param[in] _ray Ray in the instance frame
+  /// \param[in] _tMin Closest accepted distance
+  /// \param[in, out] _hit Closest hit so far
+private:
+  void Intersect(const int _instance, const Ray &_ray,
+                 const float _tMin, Hit &_hit) const;
+
+  /// \brief Test a ray against a triangle packet
+  /// \param[in] _packet Packet to test
+  /// \param[in] _ray Ray in the instance frame
+  /// \param[in] _tMin Closest accepted distance
+  /// \param[in] _instance Instance of the packet
+  /// \param[in, out] _hit Closest hit so far
+private:
+  static void IntersectPacket(const Packet &_packet, const Ray &_ray,
+                              const float _tMin, const int _instance,
+                              Hit &_hit);
+
+  /// \brief Placed meshes
+private:
+  std::vector<Instance> instances;
+
+  /// \brief Instances that follow a link
+private:
+  std::vector<WorldVisual> worldVisuals;
+
+  /// \brief Number of LoadWorld calls
+private:
+  uint64_t worldLoads;
+
+  /// \brief Instances of the current render, kept to reuse its storage
+private:
+  std::vector<VisibleInstance> visibleInstances;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
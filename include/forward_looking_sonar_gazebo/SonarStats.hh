@@ -0,0 +1,155 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_STATS_HH_
+#define _GAZEBO_RENDERING_SONAR_STATS_HH_
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarStats SonarStats.hh
+/// \brief Rolling timings of the sonar stages. Each stage keeps its last
+/// samples in a fixed ring, so recording never allocates, and the
+/// percentiles are only computed when a summary is asked for.
+class SonarStats
+{
+  /// \brief Timed stages of a sonar frame
+public:
+  enum Stage
+  {
+    /// \brief Shader image render, on the GPU or by the ray caster
+    RENDER,
+
+    /// \brief Texture read back to the shader image
+    READBACK,
+
+    /// \brief Sampling of the beams from the shader image
+    REMAP,
+
+    /// \brief Depth histogram and mean intensity of the bins
+    BINNING,
+
+    /// \brief Speckle noise and beam pattern blur
+    NOISE_BLUR,
+
+    /// \brief Scan conversion to the polar sonar image
+    POLAR,
+
+    /// \brief Color map of the sonar image
+    COLORMAP,
+
+    /// \brief Message conversion and publishing
+    PUBLISH,
+
+    /// \brief Number of stages
+    STAGE_COUNT
+  };
+
+  /// \brief Statistics of the samples of a stage, in seconds
+public:
+  struct Summary
+  {
+    /// \brief Samples recorded since the creation
+    uint64_t count;
+
+    /// \brief Median over the window
+    double p50;
+
+    /// \brief 95th percentile over the window
+    double p95;
+
+    /// \brief 99th percentile over the window
+    double p99;
+
+    /// \brief Maximum over the window
+    double max;
+  };
+
+  /// \brief Records the lifetime of a scope as a stage sample. Does
+  /// nothing when created without statistics.
+public:
+  class ScopedTimer
+  {
+    /// \brief Constructor, starts the timer
+    /// \param[in] _stats Statistics to record into, can be null
+    /// \param[in] _stage Stage timed
+  public:
+    ScopedTimer(SonarStats *_stats, const Stage _stage);
+
+    /// \brief Destructor, records the sample
+  public:
+    ~ScopedTimer();
+
+    /// \brief Statistics to record into
+  private:
+    SonarStats *stats;
+
+    /// \brief Stage timed
+  private:
+    Stage stage;
+
+    /// \brief Start of the scope
+  private:
+    std::chrono::steady_clock::time_point start;
+  };
+
+  /// \brief Constructor
+  /// \param[in] _window Number of samples kept per stage
+public:
+  explicit SonarStats(const size_t _window = 512);
+
+  /// \brief Record a sample of a stage. Thread safe.
+  /// \param[in] _stage Stage timed
+  /// \param[in] _seconds Duration
+public:
+  void Record(const Stage _stage, const double _seconds);
+
+  /// \brief Compute the statistics of a stage over its window. Can run
+  /// while stages are recorded, but not concurrently with itself.
+  /// \param[in] _stage Stage
+  /// \return Statistics, zero if the stage has no sample
+public:
+  Summary Summarize(const Stage _stage);
+
+  /// \brief Get the name of a stage
+  /// \param[in] _stage Stage
+  /// \return Lower case name
+public:
+  static const char *StageName(const Stage _stage);
+
+  /// \brief Seconds elapsed since a time point
+  /// \param[in] _start Time point
+  /// \return Elapsed seconds
+public:
+  static double Elapsed(const std::chrono::steady_clock::time_point &_start);
+
+  /// \brief Samples of a stage
+private:
+  struct Window
+  {
+    /// \brief Protects the ring, stages are recorded from several threads
+    std::mutex mutex;
+
+    /// \brief Ring of the last samples
+    std::vector<float> samples;
+
+    /// \brief Total number of samples recorded
+    uint64_t count;
+  };
+
+  /// \brief Sample windows, one per stage
+private:
+  Window windows[STAGE_COUNT];
+
+  /// \brief Sorting buffer of Summarize
+private:
+  std::vector<float> sorted;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
@@ -0,0 +1,125 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#ifndef _GAZEBO_RENDERING_SONAR_THREAD_POOL_HH_
+#define _GAZEBO_RENDERING_SONAR_THREAD_POOL_HH_
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gazebo
+{
+namespace rendering
+{
+/// \class SonarThreadPool SonarThreadPool.hh
+/// \brief Persistent pool of threads running parallel loops for the sonar.
+/// The range of a loop is split in one contiguous chunk per worker, and the
+/// calling thread works on the first chunk. Each chunk gets the index of its
+/// worker, so callers can keep per worker scratch buffers.
+class SonarThreadPool
+{
+  /// \brief Body of a parallel loop
+  /// \param[in] _begin First index of the chunk
+  /// \param[in] _end One past the last index of the chunk
+  /// \param[in] _worker Index of the worker, lower than Size()
+public:
+  typedef std::function<void(size_t _begin, size_t _end, size_t _worker)>
+    RangeFunction;
+
+  /// \brief Constructor
+  /// \param[in] _size Number of workers including the calling thread,
+  /// 0 for the hardware concurrency
+public:
+  explicit SonarThreadPool(const size_t _size = 0);
+
+  /// \brief Destructor, joins the threads
+public:
+  virtual ~SonarThreadPool();
+
+  /// \brief Number of workers, including the calling thread
+  /// \return Number of workers
+public:
+  size_t Size() const;
+
+  /// \brief Get the pool of the hardware concurrency shared by every sonar
+  /// of the process, created on first use. Loops of different sonars take
+  /// turns on it instead of each sonar starting a thread per core.
+  /// \return Shared pool
+public:
+  static std::shared_ptr<SonarThreadPool> Shared();
+
+  /// \brief Run a loop over [0, _count) on all workers and wait for it
+  /// \param[in] _count Number of iterations
+  /// \param[in] _function Loop body, called once per non empty chunk
+public:
+  void ParallelFor(const size_t _count, const RangeFunction &_function);
+
+  /// \brief Run a loop over [0, _count) on all workers and wait for it.
+  /// The loop body is passed by reference, so unlike wrapping a capturing
+  /// lambda in a RangeFunction this does not allocate.
+  /// \param[in] _count Number of iterations
+  /// \param[in] _function Loop body, called once per non empty chunk
+public:
+  template <typename Function>
+  void ParallelFor(const size_t _count, const Function &_function)
+  {
+    this->ParallelFor(_count, RangeFunction(std::cref(_function)));
+  }
+
+  /// \brief Thread main loop
+  /// \param[in] _worker Index of the worker
+private:
+  void Run(const size_t _worker);
+
+  /// \brief Run the chunk of a worker
+  /// \param[in] _worker Index of the worker
+private:
+  void RunChunk(const size_t _worker);
+
+  /// \brief Threads of the pool, worker 0 is the calling thread
+private:
+  std::vector<std::thread> threads;
+
+  /// \brief Serializes ParallelFor calls
+private:
+  std::mutex callMutex;
+
+  /// \brief Protects the job state below
+private:
+  std::mutex mutex;
+
+  /// \brief Wakes the threads when a job starts
+private:
+  std::condition_variable startCondition;
+
+  /// \brief Wakes the caller when all threads are done
+private:
+  std::condition_variable doneCondition;
+
+  /// \brief Current loop body
+private:
+  const RangeFunction *job;
+
+  /// \brief Number of iterations of the current job
+private:
+  size_t jobCount;
+
+  /// \brief Incremented for every job
+private:
+  uint64_t generation;
+
+  /// \brief Threads still working on the current job
+private:
+  size_t pending;
+
+  /// \brief True when the threads must exit
+private:
+  bool stop;
+};
+}  // namespace rendering
+}  // namespace gazebo
+#endif
@@ -0,0 +1,9 @@
+#version 130
+
+in vec2 binSample;
+
+out vec4 out_data;
+
+void main() {
+    out_data = vec4(binSample, 0, 0);
+}
@@ -0,0 +1,35 @@
+#version 130
+
+// One point per sample of a beam: gl_Vertex holds (beam, row, column0,
+// column1) and gl_MultiTexCoord0.x the weight of column1
+uniform sampler2D shaderTexture;
+uniform float beamCount;
+uniform float binCount;
+uniform int compactOutput;
+
+out vec2 binSample;
+
+void main() {
+    int row = int(gl_Vertex.y);
+    vec4 texel0 = texelFetch(shaderTexture, ivec2(int(gl_Vertex.z), row), 0);
+    vec4 texel1 = texelFetch(shaderTexture, ivec2(int(gl_Vertex.w), row), 0);
+    vec4 texel = mix(texel0, texel1, gl_MultiTexCoord0.x);
+
+    // (0, depth, intensity), or for the two channel targets (intensity,
+    // depth), sampled as (L, L, L, A) when backed by LUMINANCE_ALPHA (2)
+    float depth = compactOutput == 2 ? texel.a : texel.g;
+    float intensity = compactOutput == 0 ? texel.b : texel.r;
+
+    // Same bin as the CPU binning
+    float scale = binCount - 1.0;
+    float bin = floor(clamp(depth * scale, 0.0, scale));
+
+    // Bins along x and beams along y, on the pixel centers, so the target
+    // reads back beam major
+    gl_Position = vec4((bin + 0.5) / binCount * 2.0 - 1.0,
+                       (gl_Vertex.x + 0.5) / beamCount * 2.0 - 1.0, 0.0, 1.0);
+
+    // Added up by the blending: intensity sum in R and sample count in G
+    // of the RGB target
+    binSample = vec2(intensity, 1.0);
+}
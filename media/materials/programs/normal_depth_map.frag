@@ -10,6 +10,7 @@ uniform int drawDepth;
 uniform sampler2D normalTexture;
 uniform float reflectance;
 uniform float attenuationCoeff;
+uniform int compactOutput;
 
 out vec4 out_data;
 
@@ -55,6 +56,12 @@ void main() {
     {
         out_data = vec4(0,0,0,0);
     }
+
+    // Two channel targets: intensity in R and depth in G, which read back
+    // as (intensity, depth). Depth goes to A as well for the render systems
+    // backing them with LUMINANCE_ALPHA, where G is dropped.
+    if (compactOutput == 1)
+        out_data = vec4(out_data.z, out_data.y, 0, out_data.y);
     //out_data = vec4(255,0,0,0);
     //gl_FragDepth = linearDepth;
 }
@@ -1,6 +1,9 @@
 // Copyright 2018 Brazilian Intitute of Robotics"
 
+#include <algorithm>
+#include <cmath>
 #include <sstream>
+#include <string>
 
 #include <ignition/math/Helpers.hh>
 #include <ignition/math/Pose3.hh>
@@ -23,7 +26,6 @@
 #include "gazebo/common/Exception.hh"
 #include "gazebo/common/Mesh.hh"
 #include "gazebo/common/MeshManager.hh"
-#include "gazebo/common/Timer.hh"
 
 #include "gazebo/rendering/Visual.hh"
 #include "gazebo/rendering/Conversions.hh"
@@ -42,10 +44,28 @@ namespace rendering
 FLSonar::FLSonar(const std::string &_namePrefix, ScenePtr _scene,
                  const bool _autoRender)
   : Camera(_namePrefix, _scene, false),
-    imageWidth(0),
-    imageHeight(0),
-    binCount(0),
-    beamCount(0),
+    readbackBuffers(1),
+    renderCount(0),
+    textureFormat(Ogre::PF_FLOAT32_RGB),
+    camPass(nullptr),
+    farPlaneIndex(0),
+    drawNormalIndex(0),
+    drawDepthIndex(0),
+    reflectanceIndex(0),
+    attenuationCoeffIndex(0),
+    compactOutputIndex(0),
+    reflectanceClears(0),
+    bGpuBinning(false),
+    binTexture(nullptr),
+    binTarget(nullptr),
+    binPass(nullptr),
+    binVertexData(nullptr),
+    stats(nullptr),
+    bIncremental(false),
+    positionTolerance(1e-4),
+    angleTolerance(1e-4),
+    bSceneReference(false),
+    unchangedFrames(0),
     bUpdated(false)
 {
 }
@@ -53,8 +73,19 @@ FLSonar::FLSonar(const std::string &_namePrefix, ScenePtr _scene,
 //////////////////////////////////////////////////
 FLSonar::~FLSonar()
 {
-  Ogre::TextureManager::getSingleton().remove(
-    this->camTexture->getName());
+  for (auto texture : this->camTextures)
+    Ogre::TextureManager::getSingleton().remove(texture->getName());
+
+  if (!this->camMaterialPtr.isNull())
+    Ogre::MaterialManager::getSingleton().remove(this->camMaterialPtr->getName());
+
+  if (this->binTexture)
+    Ogre::TextureManager::getSingleton().remove(this->binTexture->getName());
+
+  if (!this->binMaterialPtr.isNull())
+    Ogre::MaterialManager::getSingleton().remove(this->binMaterialPtr->getName());
+
+  delete this->binVertexData;
 }
 
 //////////////////////////////////////////////////
@@ -62,52 +93,91 @@ void FLSonar::Load(sdf::ElementPtr _sdf)
 {
   Camera::Load(_sdf);
 
-  GZ_ASSERT(_sdf->Get<double>("vfov"), "Vertical FOV is not set");
-
-  this->SetVertFOV(_sdf->Get<double>("vfov"));
-
-  this->SetHorzFOV(_sdf->Get<double>("horizontal_fov"));
+  // Sonar geometry, binning and polar transform parameters
+  this->processor.Load(_sdf, this->Name());
 
   double aspectRatio = this->HorzFOV() / this->VertFOV();
 
-  Ogre::Radian fov_now(this->vfov);
+  // With several field of view tiles the camera only covers one of them
+  const int fovTiles = this->processor.FovTileCount();
+
+  Ogre::Radian fov_now(this->VertFOV());
   this->camera->setFOVy(fov_now);
-  this->camera->setAspectRatio(tan(this->HorzFOV() / 2) / tan(this->VertFOV() / 2));
+  this->camera->setAspectRatio(tan(this->HorzFOV() / fovTiles / 2) / tan(this->VertFOV() / 2));
   // Original: this causes a curve in the resulting sonar image
   // this->camera->setAspectRatio(aspectRatio);
   this->camera->setAutoAspectRatio(0);
+  this->cameraOrientation = this->camera->getOrientation();
 
 
   this->SetFarClip(gazebo::SDFTool::GetSDFElement<double>(_sdf, "far", "clip"));
   this->SetNearClip(gazebo::SDFTool::GetSDFElement<double>(_sdf, "near", "clip"));
 
-  this->SetImageWidth(gazebo::SDFTool::GetSDFElement<double>(_sdf, "width", "image"));
-  this->SetImageHeight(gazebo::SDFTool::GetSDFElement<double>(_sdf, "height", "image"));
+  // Number of render textures used round robin, the readback of a frame is
+  // delayed by readbackBuffers - 1 renders. The readback itself is still a
+  // synchronous blit, the delay only makes it likely that the GPU finished
+  // that render, so the blit waits on the copy instead of the whole render.
+  if (_sdf->HasElement("readback"))
+  {
+    sdf::ElementPtr readbackSdf = _sdf->GetElement("readback");
+    if (readbackSdf->HasElement("buffers"))
+      this->readbackBuffers = ignition::math::clamp(readbackSdf->Get<int>("buffers"), 1, 3);
+  }
 
-  this->SetBinCount(gazebo::SDFTool::GetSDFElement<double>(_sdf, "bin_count"));
-  this->SetBeamCount(gazebo::SDFTool::GetSDFElement<double>(_sdf, "beam_count"));
+  // "gpu" accumulates the beams and bins in a second pass over the render,
+  // so only the beam x bin counts are read back instead of the shader image
+  this->bGpuBinning = false;
+  if (_sdf->HasElement("binning"))
+  {
+    std::string binning = _sdf->Get<std::string>("binning");
+    if (binning == "gpu")
+      this->bGpuBinning = true;
+    else if (binning != "cpu")
+      gzerr << "Unknown sonar binning [" << binning << "], using cpu" << std::endl;
+  }
+  if (this->bGpuBinning && fovTiles > 1)
+  {
+    gzwarn << "Sonar gpu binning is not available with fov_tiles, using cpu" << std::endl;
+    this->bGpuBinning = false;
+  }
 
+  // The tiles are read back within the render, alternating between two
+  // textures, and the GPU binning reads the texture it just rendered
+  if ((fovTiles > 1 || this->bGpuBinning) && this->readbackBuffers > 1)
+  {
+    gzwarn << "Sonar readback buffers are not used with fov_tiles or gpu binning" << std::endl;
+    this->readbackBuffers = 1;
+  }
 
-  // Accurate pixels -> beams transformation
-  this->dest = cv::Mat(cv::Size(this->beamCount, this->imageHeight), CV_32FC3);
-  this->map_x = cv::Mat(this->dest.size(), CV_32FC1);
-  this->map_y = cv::Mat(this->dest.size(), CV_32FC1);
-  this->focal_length = this->imageWidth / (2 * tan(this->HorzFOV() / 2));
-  std::vector<int> beam_start_pixels;
-  beam_start_pixels.assign(this->beamCount + 1, 0);
-  for (int i_beam = 0; i_beam <= this->beamCount; i_beam++)
-    beam_start_pixels[i_beam] = floor(
-      focal_length * tan(this->HorzFOV() * (-1.0 / 2 + i_beam * 1.0 / this->beamCount))
-      + this->imageWidth / 2
-    );
+  // Skip the render while neither the sonar nor the visuals in its field of
+  // view move, the last frame is then binned again with new noise
+  this->bIncremental = false;
+  if (_sdf->HasElement("incremental"))
+  {
+    sdf::ElementPtr incrementalSdf = _sdf->GetElement("incremental");
+    this->bIncremental = true;
+    if (incrementalSdf->HasElement("position_tolerance"))
+      this->positionTolerance = incrementalSdf->Get<double>("position_tolerance");
+    if (incrementalSdf->HasElement("angle_tolerance"))
+      this->angleTolerance = incrementalSdf->Get<double>("angle_tolerance");
+  }
+  this->ResetScene();
 
-  // Create remapping for the whole rawImage: https://docs.opencv.org/3.4/d1/da0/tutorial_remap.html
-  for (int i = 0; i < this->map_x.rows; i++)
+  // Pixel format of the render textures. The shader only outputs depth and
+  // intensity, so the two channel formats read back a third (R32G32) or two
+  // thirds (R16G16) less than R32G32B32
+  if (_sdf->HasElement("image"))
   {
-    for (int j = 0; j < this->map_x.cols; j++)
+    sdf::ElementPtr imageSdf = _sdf->GetElement("image");
+    if (imageSdf->HasElement("format"))
     {
-      this->map_x.at<float>(i, j) = (beam_start_pixels[j + 1] + beam_start_pixels[j]) * 1.0 / 2; // Get approximate location of beam
-      this->map_y.at<float>(i, j) = i;
+      std::string format = imageSdf->Get<std::string>("format");
+      if (format == "R32G32")
+        this->textureFormat = Ogre::PF_FLOAT32_GR;
+      else if (format == "R16G16")
+        this->textureFormat = Ogre::PF_FLOAT16_GR;
+      else if (format != "R32G32B32")
+        gzerr << "Unknown sonar image format [" << format << "], using R32G32B32" << std::endl;
     }
   }
 }
@@ -122,37 +192,90 @@ void FLSonar::Load()
 void FLSonar::Init()
 {
   Camera::Init();
+
+  // Renderables of removed visuals may be reused at the same address, so
+  // the reflectance cache starts over when entities are added or removed.
+  // The scene creates and removes the visuals from messages sent after the
+  // events, the second clear covers a message that arrives a render late.
+  this->addEntityConnection = event::Events::ConnectAddEntity(
+    [this](const std::string &/*_name*/) { this->reflectanceClears = 2; });
+  this->deleteEntityConnection = event::Events::ConnectDeleteEntity(
+    [this](const std::string &/*_name*/) { this->reflectanceClears = 2; });
 }
 
 //////////////////////////////////////////////////
 void FLSonar::Fini()
 {
+  this->addEntityConnection.reset();
+  this->deleteEntityConnection.reset();
   Camera::Fini();
 }
 
 //////////////////////////////////////////////////
 void FLSonar::CreateTexture(const std::string &_textureName)
 {
-  camTexture = Ogre::TextureManager::getSingleton().createManual(
-                 "RttTex",
-                 Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME,
-                 Ogre::TEX_TYPE_2D,
-                 this->imageWidth, this->imageHeight,
-                 0,
-                 Ogre::PF_FLOAT32_RGB  ,
-                 Ogre::TU_RENDERTARGET).getPointer();
-  this->camTarget = camTexture->getBuffer()->getRenderTarget();
-  this->camTarget->addViewport(this->camera);
-  this->camTarget->getViewport(0)->setClearEveryFrame(true);
-  this->camTarget->getViewport(0)->setBackgroundColour(Ogre::ColourValue::Black);
-  this->camTarget->getViewport(0)->setOverlaysEnabled(false);
-  this->camTarget->getViewport(0)->setShadowsEnabled(false);
-  this->camTarget->getViewport(0)->setSkiesEnabled(false);
-  this->camTarget->getViewport(0)->setVisibilityMask(GZ_VISIBILITY_ALL
-    & ~(GZ_VISIBILITY_GUI | GZ_VISIBILITY_SELECTABLE));
-
-  this->camMaterial = (Ogre::Material*)(
-                        Ogre::MaterialManager::getSingleton().getByName("GazeboRosSonar/NormalDepthMap").get());
+  // Several sonars can share a scene, so every Ogre resource is scoped by
+  // the unique name of this camera
+  std::string uniqueName = this->ScopedUniqueName() + "::" + _textureName;
+
+  // Field of view tiles render into one texture while the previous tile is
+  // read back from the other
+  const int textureCount = this->processor.FovTileCount() > 1 ? 2 : this->readbackBuffers;
+  for (int i = 0; i < textureCount; ++i)
+  {
+    std::string textureName = uniqueName;
+    if (i > 0)
+      textureName += "_" + std::to_string(i);
+
+    Ogre::Texture *texture = Ogre::TextureManager::getSingleton().createManual(
+                   textureName,
+                   Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME,
+                   Ogre::TEX_TYPE_2D,
+                   this->processor.FovTileWidth(), this->ImageHeight(),
+                   0,
+                   this->textureFormat,
+                   Ogre::TU_RENDERTARGET).getPointer();
+
+    // The FBO manager substitutes the closest format it can render to when
+    // a two channel float format is not a render target, which no longer
+    // reads back as (intensity, depth), so fall back to three channels
+    if (this->TextureChannels() == 2 && !this->CompactFormatRenderable(texture))
+    {
+      gzwarn << "Sonar image format " << Ogre::PixelUtil::getFormatName(this->textureFormat)
+             << " can not be rendered to, using R32G32B32" << std::endl;
+      Ogre::TextureManager::getSingleton().remove(texture->getName());
+      this->textureFormat = Ogre::PF_FLOAT32_RGB;
+      this->processor.SetShaderChannels(3);
+      --i;
+      continue;
+    }
+
+    Ogre::RenderTarget *target = texture->getBuffer()->getRenderTarget();
+    // Only rendered explicitly by RenderImpl
+    target->setAutoUpdated(false);
+    target->addViewport(this->camera);
+    target->getViewport(0)->setClearEveryFrame(true);
+    target->getViewport(0)->setBackgroundColour(Ogre::ColourValue::Black);
+    target->getViewport(0)->setOverlaysEnabled(false);
+    target->getViewport(0)->setShadowsEnabled(false);
+    target->getViewport(0)->setSkiesEnabled(false);
+    target->getViewport(0)->setVisibilityMask(GZ_VISIBILITY_ALL
+      & ~(GZ_VISIBILITY_GUI | GZ_VISIBILITY_SELECTABLE));
+
+    this->camTextures.push_back(texture);
+    this->camTargets.push_back(target);
+  }
+  this->renderTimes.assign(this->camTextures.size(), common::Time());
+  this->camTexture = this->camTextures[0];
+  this->camTarget = this->camTargets[0];
+
+  // The fragment parameters are written for every renderable, each sonar
+  // needs its own copy of the material
+  Ogre::MaterialPtr baseMaterial =
+    Ogre::MaterialManager::getSingleton().getByName("GazeboRosSonar/NormalDepthMap");
+  GZ_ASSERT(!baseMaterial.isNull(), "Sonar material GazeboRosSonar/NormalDepthMap not found");
+  this->camMaterialPtr = baseMaterial->clone(uniqueName + "/NormalDepthMap");
+  this->camMaterial = this->camMaterialPtr.get();
   this->camMaterial->load();
 
   {
@@ -164,21 +287,125 @@ void FLSonar::CreateTexture(const std::string &_textureName)
     GZ_ASSERT(pass->hasVertexProgram(), "Must have vertex program");
     GZ_ASSERT(pass->hasFragmentProgram(), "Must have vertex program");
   }
+
+  // Resolve the constants once, the render only writes them by index
+  this->camPass = this->camMaterial->getBestTechnique()->getPass(0);
+  this->fragmentParams = this->camPass->getFragmentProgramParameters();
+  this->farPlaneIndex = this->fragmentParams->getConstantDefinition("farPlane").physicalIndex;
+  this->drawNormalIndex = this->fragmentParams->getConstantDefinition("drawNormal").physicalIndex;
+  this->drawDepthIndex = this->fragmentParams->getConstantDefinition("drawDepth").physicalIndex;
+  this->reflectanceIndex = this->fragmentParams->getConstantDefinition("reflectance").physicalIndex;
+  this->attenuationCoeffIndex =
+    this->fragmentParams->getConstantDefinition("attenuationCoeff").physicalIndex;
+  this->compactOutputIndex =
+    this->fragmentParams->getConstantDefinition("compactOutput").physicalIndex;
+  this->reflectanceCache.clear();
+
+  if (this->bGpuBinning)
+    this->CreateBinScatter(uniqueName);
 }
 
 //////////////////////////////////////////////////
-void FLSonar::ImageTextureToCV(float _width, int _height, Ogre::Texture* _inTex)
+bool FLSonar::CompactFormatRenderable(Ogre::Texture *_texture) const
 {
-  common::Timer firstPassTimer, secondPassTimer;
+  return _texture->getFormat() == this->textureFormat;
+}
 
-  firstPassTimer.Start();
-  this->rawImage = cv::Mat::zeros(this->imageWidth, this->imageHeight, CV_32FC3);
-  _inTex->convertToImage(this->imgSonar);
-  this->rawImage.data = this->imgSonar.getData();
-  double firstPassDur = firstPassTimer.GetElapsed().Double();
-  cv::cvtColor(this->rawImage, this->rawImage, cv::COLOR_RGB2BGR);
+//////////////////////////////////////////////////
+bool FLSonar::CompactLuminanceAlpha() const
+{
+  // The GL 3+ render system creates RG textures, the older one
+  // LUMINANCE_ALPHA ones
+  return this->TextureChannels() == 2 &&
+         Ogre::Root::getSingleton().getRenderSystem()->getName() == "OpenGL Rendering Subsystem";
+}
 
-  // gzwarn << "Time to blit: "<< firstPassDur << std::endl;
+//////////////////////////////////////////////////
+void FLSonar::CreateBinScatter(const std::string &_uniqueName)
+{
+  // Beams along the rows and bins along the columns, so the target reads
+  // back beam major like the CPU bins. Three channels, as the two channel
+  // float formats are not render targets everywhere, see CreateTexture
+  this->binTexture = Ogre::TextureManager::getSingleton().createManual(
+                   _uniqueName + "/BinCounts",
+                   Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME,
+                   Ogre::TEX_TYPE_2D,
+                   this->BinCount(), this->BeamCount(),
+                   0,
+                   Ogre::PF_FLOAT32_RGB,
+                   Ogre::TU_RENDERTARGET).getPointer();
+  this->binTarget = this->binTexture->getBuffer()->getRenderTarget();
+  this->binTarget->setAutoUpdated(false);
+  this->binTarget->addViewport(this->camera);
+  this->binTarget->getViewport(0)->setClearEveryFrame(false);
+  this->binTarget->getViewport(0)->setOverlaysEnabled(false);
+  this->binTarget->getViewport(0)->setShadowsEnabled(false);
+  this->binTarget->getViewport(0)->setSkiesEnabled(false);
+
+  Ogre::MaterialPtr baseMaterial =
+    Ogre::MaterialManager::getSingleton().getByName("GazeboRosSonar/BeamBinScatter");
+  GZ_ASSERT(!baseMaterial.isNull(), "Sonar material GazeboRosSonar/BeamBinScatter not found");
+  this->binMaterialPtr = baseMaterial->clone(_uniqueName + "/BeamBinScatter");
+  this->binMaterialPtr->load();
+  this->binPass = this->binMaterialPtr->getBestTechnique()->getPass(0);
+  GZ_ASSERT(this->binPass->hasVertexProgram(), "Must have vertex program");
+
+  // The readback ring is not used with GPU binning, the pass always samples
+  // the one render texture
+  this->binPass->getTextureUnitState(0)->setTextureName(this->camTexture->getName());
+
+  Ogre::GpuProgramParametersSharedPtr params = this->binPass->getVertexProgramParameters();
+  params->setNamedConstant("beamCount", static_cast<Ogre::Real>(this->BeamCount()));
+  params->setNamedConstant("binCount", static_cast<Ogre::Real>(this->BinCount()));
+  // The pass samples the render texture, where a LUMINANCE_ALPHA texture
+  // holds the depth in A
+  int compactOutput = this->TextureChannels() == 2 ? 1 : 0;
+  if (this->CompactLuminanceAlpha())
+    compactOutput = 2;
+  params->setNamedConstant("compactOutput", compactOutput);
+
+  // One point per row of each beam column: (beam, row, column0, column1)
+  // and the weight of column1
+  std::vector<SonarProcessor::BeamColumn> columns;
+  this->processor.BeamColumns(columns);
+  const int rows = this->ImageHeight();
+  std::vector<float> vertices;
+  vertices.reserve(columns.size() * rows * 5);
+  for (const auto &column : columns)
+  {
+    for (int row = 0; row < rows; ++row)
+    {
+      vertices.push_back(column.beam);
+      vertices.push_back(row);
+      vertices.push_back(column.column0);
+      vertices.push_back(column.column1);
+      vertices.push_back(column.weight);
+    }
+  }
+
+  this->binVertexData = new Ogre::VertexData();
+  Ogre::VertexDeclaration *declaration = this->binVertexData->vertexDeclaration;
+  declaration->addElement(0, 0, Ogre::VET_FLOAT4, Ogre::VES_POSITION);
+  declaration->addElement(0, 4 * sizeof(float), Ogre::VET_FLOAT1, Ogre::VES_TEXTURE_COORDINATES, 0);
+  Ogre::HardwareVertexBufferSharedPtr buffer =
+    Ogre::HardwareBufferManager::getSingleton().createVertexBuffer(
+      declaration->getVertexSize(0), columns.size() * rows,
+      Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY);
+  buffer->writeData(0, buffer->getSizeInBytes(), vertices.data(), true);
+  this->binVertexData->vertexBufferBinding->setBinding(0, buffer);
+  this->binVertexData->vertexStart = 0;
+  this->binVertexData->vertexCount = columns.size() * rows;
+
+  this->binOperation.vertexData = this->binVertexData;
+  this->binOperation.operationType = Ogre::RenderOperation::OT_POINT_LIST;
+  this->binOperation.useIndexes = false;
+}
+
+//////////////////////////////////////////////////
+void FLSonar::ImageTextureToCV(float _width, int _height, Ogre::Texture* _inTex)
+{
+  SonarStats::ScopedTimer timer(this->stats, SonarStats::READBACK);
+  this->PixelBoxTextureToCV(_inTex, this->processor.ShaderBuffer(), _width, _height);
 }
 
 //////////////////////////////////////////////////
@@ -232,6 +459,20 @@ void FLSonar::UpdateRenderTarget(Ogre::RenderTarget *_target,
   pass->_updateAutoParams(&autoParamDataSource, 1);
 #endif
 
+  // Constants shared by every renderable of the pass, only the
+  // reflectance changes per renderable
+  if (pass == this->camPass)
+  {
+    this->fragmentParams->_writeRawConstant(this->farPlaneIndex,
+                                            static_cast<Ogre::Real>(this->FarClip()));
+    this->fragmentParams->_writeRawConstant(this->drawNormalIndex, 1);
+    this->fragmentParams->_writeRawConstant(this->drawDepthIndex, 1);
+    this->fragmentParams->_writeRawConstant(this->reflectanceIndex, 1.0f);
+    this->fragmentParams->_writeRawConstant(this->attenuationCoeffIndex, 0.0f);
+    this->fragmentParams->_writeRawConstant(this->compactOutputIndex,
+                                            static_cast<int>(this->TextureChannels() == 2));
+  }
+
   // NOTE: We MUST bind parameters AFTER updating the autos
   if (pass->hasVertexProgram())
   {
@@ -267,81 +508,130 @@ void FLSonar::notifyRenderSingleObject(Ogre::Renderable *_rend,
                                        const Ogre::Pass* /*pass*/, const Ogre::AutoParamDataSource* /*source*/,
                                        const Ogre::LightList* /*lights*/, bool /*supp*/)
 {
-  Ogre::Vector4 retro = Ogre::Vector4(1.0f, 0, 0, 0);
-  try
-  {
-    retro = _rend->getCustomParameter(1);
-  }
-  catch (Ogre::ItemIdentityException& e)
+  // The programs and the per pass constants are bound by
+  // UpdateRenderTarget, and the shaders use no auto constants, so only the
+  // reflectance of the renderable is uploaded here
+  auto cached = this->reflectanceCache.find(_rend);
+  if (cached == this->reflectanceCache.end())
   {
-    _rend->setCustomParameter(1, Ogre::Vector4(1.0f, 0, 0, 0));
+    float reflectance = 1.0f;
+    if (_rend->hasCustomParameter(1))
+      reflectance = _rend->getCustomParameter(1)[0];
+    cached = this->reflectanceCache.emplace(_rend, reflectance).first;
   }
 
-  Ogre::Pass *pass = this->camMaterial->getBestTechnique()->getPass(0);
+  this->fragmentParams->_writeRawConstant(this->reflectanceIndex,
+                                          static_cast<Ogre::Real>(cached->second));
 
   Ogre::RenderSystem *renderSys =
     this->scene->OgreSceneManager()->getDestinationRenderSystem();
-
-  Ogre::AutoParamDataSource autoParamDataSource;
-
-  Ogre::Viewport *vp = this->camTarget->getViewport(0);
-
-  renderSys->_setViewport(0);
-  renderSys->_setViewport(vp);
-  autoParamDataSource.setCurrentRenderable(_rend);
-  autoParamDataSource.setCurrentPass(pass);
-  autoParamDataSource.setCurrentViewport(vp);
-  autoParamDataSource.setCurrentRenderTarget(this->camTarget);
-  autoParamDataSource.setCurrentSceneManager(this->scene->OgreSceneManager());
-  autoParamDataSource.setCurrentCamera(this->camera, true);
-
-  pass->_updateAutoParams(&autoParamDataSource,
-                          Ogre::GPV_GLOBAL || Ogre::GPV_PER_OBJECT);
-
-  pass->getFragmentProgramParameters()->setNamedConstant("farPlane", static_cast<float>(this->FarClip()));
-  pass->getFragmentProgramParameters()->setNamedConstant("drawNormal", static_cast<int>(1));
-  pass->getFragmentProgramParameters()->setNamedConstant("drawDepth", static_cast<int>(1));
-  pass->getFragmentProgramParameters()->setNamedConstant("reflectance", retro[0]);
-  pass->getFragmentProgramParameters()->setNamedConstant("attenuationCoeff", 0.0f);
-
-  renderSys->bindGpuProgram(
-    pass->getVertexProgram()->_getBindingDelegate());
-
-  renderSys->bindGpuProgramParameters(Ogre::GPT_VERTEX_PROGRAM,
-                                      pass->getVertexProgramParameters(),
-                                      Ogre::GPV_GLOBAL || Ogre::GPV_PER_OBJECT);
-
-  renderSys->bindGpuProgram(
-    pass->getFragmentProgram()->_getBindingDelegate());
-
   renderSys->bindGpuProgramParameters(Ogre::GPT_FRAGMENT_PROGRAM,
-                                      pass->getFragmentProgramParameters(),
-                                      Ogre::GPV_GLOBAL || Ogre::GPV_PER_OBJECT);
+                                      this->fragmentParams, Ogre::GPV_GLOBAL);
 }
 
 //////////////////////////////////////////////////
 void FLSonar::RenderImpl()
 {
-  common::Timer firstPassTimer, secondPassTimer;
-
-  firstPassTimer.Start();
+  SonarStats::ScopedTimer timer(this->stats, SonarStats::RENDER);
 
   Ogre::SceneManager *sceneMgr = this->scene->OgreSceneManager();
 
+  // Start over after entities were added or removed, see Init
+  if (this->reflectanceClears > 0)
+  {
+    this->reflectanceCache.clear();
+    this->reflectanceClears--;
+  }
+
+  // Render into the next texture of the ring while older ones are read back
+  size_t ringIndex = this->renderCount % this->camTargets.size();
+  this->camTexture = this->camTextures[ringIndex];
+  this->camTarget = this->camTargets[ringIndex];
+  this->renderTimes[ringIndex] = this->nextRenderTime;
 
   sceneMgr->_suppressRenderStateChanges(true);
   sceneMgr->addRenderObjectListener(this);
-  this->UpdateRenderTarget(this->camTarget,
-                           this->camMaterial, this->camera, false);
-  this->camTarget->update();
+  if (this->processor.FovTileCount() > 1)
+  {
+    this->RenderFovTiles();
+  }
+  else
+  {
+    this->UpdateRenderTarget(this->camTarget,
+                             this->camMaterial, this->camera, false);
+    this->camTarget->update();
+  }
   sceneMgr->removeRenderObjectListener(this);
   sceneMgr->_suppressRenderStateChanges(false);
 
-  double firstPassDur = firstPassTimer.GetElapsed().Double();
+  if (this->bGpuBinning)
+    this->RenderBinScatter();
+
+  this->renderCount++;
 
   this->bUpdated = false;
+}
 
-  // gzwarn << firstPassDur << std::endl;
+//////////////////////////////////////////////////
+void FLSonar::RenderBinScatter()
+{
+  // The vertex program places every point on its (beam, bin) pixel and the
+  // additive blending accumulates them, the matrices are not used
+  Ogre::Viewport *viewport = this->binTarget->getViewport(0);
+  viewport->clear(Ogre::FBT_COLOUR, Ogre::ColourValue::Black);
+  this->scene->OgreSceneManager()->manualRender(&this->binOperation, this->binPass, viewport,
+                                                Ogre::Matrix4::IDENTITY, Ogre::Matrix4::IDENTITY,
+                                                Ogre::Matrix4::IDENTITY, true);
+}
+
+//////////////////////////////////////////////////
+void FLSonar::ReadBinCounts(cv::Mat &_counts)
+{
+  SonarStats::ScopedTimer timer(this->stats, SonarStats::READBACK);
+  this->processor.FitBinCounts(_counts);
+
+  // The sum in R and the count in G, B is left clear
+  Ogre::PixelBox dstBox(this->BinCount(), this->BeamCount(), 1, Ogre::PF_FLOAT32_RGB, _counts.data);
+  this->binTexture->getBuffer()->blitToMemory(dstBox);
+}
+
+//////////////////////////////////////////////////
+void FLSonar::RenderFovTiles()
+{
+  this->processor.FitBinCounts(this->binCounts);
+
+  // The tiles alternate between two textures, each is read back and binned
+  // once the next one is rendered, so the readback of a tile only waits on
+  // the GPU when the next render is not queued behind it
+  const int tileCount = this->processor.FovTileCount();
+  for (int tile = 0; tile < tileCount; ++tile)
+  {
+    // The camera looks along -Z with +Y up, a negative turn about +Y yaws
+    // it towards the last columns
+    this->camera->setOrientation(this->cameraOrientation *
+      Ogre::Quaternion(Ogre::Radian(-this->processor.FovTileYaw(tile)), Ogre::Vector3::UNIT_Y));
+    Ogre::RenderTarget *target = this->camTargets[tile % this->camTargets.size()];
+    this->UpdateRenderTarget(target, this->camMaterial, this->camera, false);
+    target->update();
+
+    if (tile > 0)
+      this->BinFovTile(tile - 1);
+  }
+  this->BinFovTile(tileCount - 1);
+  this->camera->setOrientation(this->cameraOrientation);
+}
+
+//////////////////////////////////////////////////
+void FLSonar::BinFovTile(const int _tile)
+{
+  {
+    SonarStats::ScopedTimer timer(this->stats, SonarStats::READBACK);
+    this->processor.FitTileImage(this->tileImage);
+    this->PixelBoxTextureToCV(this->camTextures[_tile % this->camTextures.size()], this->tileImage,
+                              this->processor.FovTileWidth(), this->ImageHeight());
+  }
+  SonarStats::ScopedTimer timer(this->stats, SonarStats::BINNING);
+  this->processor.BinTile(this->tileImage, _tile, this->binCounts);
 }
 
 //////////////////////////////////////////////////
@@ -359,25 +649,25 @@ double FLSonar::GetHorzFOV() const
 //////////////////////////////////////////////////
 double FLSonar::VertFOV() const
 {
-  return this->vfov;
+  return this->processor.VertFOV();
 }
 
 //////////////////////////////////////////////////
 double FLSonar::HorzFOV() const
 {
-  return this->hfov;
+  return this->processor.HorzFOV();
 }
 
 //////////////////////////////////////////////////
 void FLSonar::SetVertFOV(const double _vfov)
 {
-  this->vfov = _vfov;
+  this->processor.SetVertFOV(_vfov);
 }
 
 //////////////////////////////////////////////////
 void FLSonar::SetHorzFOV(const double _hfov)
 {
-  this->hfov = _hfov;
+  this->processor.SetHorzFOV(_hfov);
 }
 
 
@@ -420,67 +710,73 @@ void FLSonar::SetFarClip(const double _far)
 //////////////////////////////////////////////////
 int FLSonar::ImageWidth()
 {
-  return this->imageWidth;
+  return this->processor.ImageWidth();
 }
 
 //////////////////////////////////////////////////
 int FLSonar::ImageHeight()
 {
-  return this->imageHeight;
+  return this->processor.ImageHeight();
 }
 
 //////////////////////////////////////////////////
 int FLSonar::BinCount()
 {
-  return this->binCount;
+  return this->processor.BinCount();
 }
 
 //////////////////////////////////////////////////
 int FLSonar::BeamCount()
 {
-  return this->beamCount;
+  return this->processor.BeamCount();
 }
 
 //////////////////////////////////////////////////
 cv::Mat FLSonar::ShaderImage() const
 {
-  return this->rawImage;
+  return this->processor.ShaderImage();
+}
+
+//////////////////////////////////////////////////
+int FLSonar::TextureChannels() const
+{
+  return this->textureFormat == Ogre::PF_FLOAT32_RGB ? 3 : 2;
 }
 
 //////////////////////////////////////////////////
 cv::Mat FLSonar::SonarImage() const
 {
-  return this->sonarImage;
+  return this->processor.SonarImage();
 }
 
 //////////////////////////////////////////////////
 cv::Mat FLSonar::SonarMask() const
 {
-  return this->sonarImageMask;
+  return this->processor.SonarMask();
 }
 
 //////////////////////////////////////////////////
 void FLSonar::SetImageWidth(const int &_value)
 {
-  this->imageWidth = _value;
+  this->processor.SetImageWidth(_value);
 }
 
 //////////////////////////////////////////////////
 void FLSonar::SetImageHeight(const int &_value)
 {
-  this->imageHeight = _value;
+  this->processor.SetImageHeight(_value);
 }
 
 //////////////////////////////////////////////////
 void FLSonar::SetBinCount(const int &_value)
 {
-  this->binCount = _value;
+  this->processor.SetBinCount(_value);
 }
 
 //////////////////////////////////////////////////
 void FLSonar::SetBeamCount(const int &_value)
 {
-  this->beamCount = _value;
+  this->processor.SetBeamCount(_value);
 }
 
 //////////////////////////////////////////////////
@@ -506,9 +802,18 @@ void FLSonar::UpdateData()
 {
   if (!this->bUpdated)
   {
-    this->ImageTextureToCV(this->imageWidth, this->imageHeight, this->camTexture);
-    this->accumData.assign(this->binCount * this->beamCount, 0.0);
-    this->CvToSonarBin(this->accumData);
+    if (this->ReadsBinCounts())
+    {
+      // The tiles were already binned by the render
+      if (this->bGpuBinning)
+        this->ReadBinCounts(this->binCounts);
+      this->processor.BinCounts(this->binCounts);
+    }
+    else
+    {
+      this->ImageTextureToCV(this->ImageWidth(), this->ImageHeight(), this->ReadbackTexture());
+      this->processor.Bin();
+    }
     this->bUpdated = true;
   }
 }
@@ -516,138 +821,191 @@ void FLSonar::UpdateData()
 //////////////////////////////////////////////////
 void FLSonar::GetSonarImage()
 {
-  int sonarImageWidth = this->imageWidth;
-  int sonarImageHeight = this->imageHeight;
-
-  this->sonarImage = cv::Mat::zeros(sonarImageWidth, sonarImageHeight, CV_32F);
-  this->sonarImageMask = cv::Mat::zeros(sonarImageWidth, sonarImageHeight, CV_8UC1);
-
-
-  // this->DebugPrintImageChannelToFile("TesteBlue.dat", this->rawImage,0);
-  // this->DebugPrintImageChannelToFile("TesteGreen.dat", this->rawImage,1);
+  // this->DebugPrintImageChannelToFile("TesteBlue.dat", this->ShaderImage(),0);
+  // this->DebugPrintImageChannelToFile("TesteGreen.dat", this->ShaderImage(),1);
 
   this->UpdateData();
 
-  // this->DebugPrintMatrixToFile<float>("Teste2.dat", this->accumData);
+  // this->DebugPrintMatrixToFile<float>("Teste2.dat", this->processor.AccumData());
 
+  this->processor.ScanConvert();
+}
 
-  std::vector<int> transferTable;
-  transferTable.clear();
-  this->sonarImage.setTo(0);
-  this->sonarImageMask.setTo(0);
-  this->GenerateTransferTable(transferTable);
-
-  // this->DebugPrintMatrixToFile<int>("Teste3.dat", transferTable);
+//////////////////////////////////////////////////
+void FLSonar::SetStats(SonarStats *_stats)
+{
+  this->stats = _stats;
+  this->processor.SetStats(_stats);
+}
 
-  this->TransferTableToSonar(this->accumData, transferTable);
+//////////////////////////////////////////////////
+SonarProcessor &FLSonar::Processor()
+{
+  return this->processor;
 }
 
 //////////////////////////////////////////////////
-void FLSonar::CvToSonarBin(std::vector<float> &_accumData)
+uint64_t FLSonar::AllocationCount() const
 {
-  // Accurate pixels -> beams transformation
-  remap(this->rawImage, this->dest, this->map_x, this->map_y, cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+  return this->processor.AllocationCount();
+}
 
-  // Add noise
-  cv::Mat noisy_image = cv::Mat::zeros(this->beamCount, this->binCount, CV_32FC1);
-  cv::randn(noisy_image, 0, 0.25);
+//////////////////////////////////////////////////
+void FLSonar::ReadTexture(cv::Mat &_image)
+{
+  if (this->bGpuBinning)
+  {
+    this->ReadBinCounts(_image);
+    return;
+  }
 
-  for (int i_beam = 0; i_beam < this->beamCount; i_beam++)
+  // The frame takes the counts the tiles were binned into and leaves its
+  // own buffer for the next render, so they are never copied
+  if (this->processor.FovTileCount() > 1)
   {
-    cv::Mat roi = this->dest(cv::Rect(i_beam, 0, 1, this->rawImage.rows));
-    // cv::Mat roi = this->rawImage(cv::Rect(beam_start_pixels[i_beam], 0,
-    //   beam_start_pixels[i_beam + 1] - beam_start_pixels[i_beam], this->rawImage.rows));
+    cv::swap(this->binCounts, _image);
+    return;
+  }
 
-    // Original: distorted (not taking in account sensor plane)
-    // cv::Mat roi = this->rawImage(cv::Rect(i_beam * ceil(this->imageWidth / this->beamCount), 0,
-    //   ceil(this->imageWidth / this->beamCount), this->rawImage.rows));
+  SonarStats::ScopedTimer timer(this->stats, SonarStats::READBACK);
+  this->processor.FitShaderImage(_image);
+  this->PixelBoxTextureToCV(this->ReadbackTexture(), _image, this->ImageWidth(), this->ImageHeight());
+}
 
+//////////////////////////////////////////////////
+Ogre::Texture *FLSonar::ReadbackTexture()
+{
+  return this->camTextures[this->ReadbackIndex()];
+}
 
-    this->sonarBinsDepth.assign(this->binCount, 0);
+//////////////////////////////////////////////////
+size_t FLSonar::ReadbackIndex() const
+{
+  // Until the ring is full read the latest render
+  if (this->renderCount == 0)
+    return 0;
+
+  unsigned int latest = this->renderCount - 1;
+  // The tiles alternate textures but are all read back by their render
+  unsigned int lag = std::min<unsigned int>(this->readbackBuffers - 1, latest);
+  return (latest - lag) % this->camTextures.size();
+}
+
+//////////////////////////////////////////////////
+void FLSonar::SetRenderTime(const common::Time &_time)
+{
+  this->nextRenderTime = _time;
+}
 
-    unsigned int width = roi.rows;
-    unsigned int height = roi.cols;
+//////////////////////////////////////////////////
+common::Time FLSonar::ReadbackTime() const
+{
+  return this->renderTimes[this->ReadbackIndex()];
+}
+
+//////////////////////////////////////////////////
+void FLSonar::ProcessTexture(const cv::Mat &_image)
+{
+  if (this->ReadsBinCounts())
+    this->processor.ProcessBinCounts(_image);
+  else
+    this->processor.Process(_image);
+}
 
+//////////////////////////////////////////////////
+bool FLSonar::GpuBinning() const
+{
+  return this->bGpuBinning;
+}
 
+//////////////////////////////////////////////////
+bool FLSonar::ReadsBinCounts() const
+{
+  return this->bGpuBinning || this->processor.FovTileCount() > 1;
+}
 
-    // calculate depth histogram
-    for (int i = 0; i < width * height; i++)
-    {
-      int xIndex = i / height;
-      int yIndex = (i % height) / height * width;
-      int bin_idx = roi.at<cv::Vec3f>(xIndex, yIndex)[1] * (this->binCount - 1);
-      this->sonarBinsDepth[bin_idx]++;
-    }
+//////////////////////////////////////////////////
+bool FLSonar::SceneUnchanged()
+{
+  if (!this->bIncremental)
+    return false;
 
-    // calculate bins intesity using normal values, depth histogram and sigmoid function
-    this->bins.assign(this->binCount, 0.0);
-    for (int i = 0; i < width * height; i++)
-    {
-      int xIndex = i / height;
-      int yIndex = (i % height) / height * width;
-      int bin_idx = roi.at<cv::Vec3f>(xIndex, yIndex)[1] * (this->binCount - 1);
-      float intensity = (1.0 / this->sonarBinsDepth[bin_idx]) * roi.at<cv::Vec3f>(xIndex, yIndex)[0]; // this->Sigmoid(roi.at<cv::Vec3f>(xIndex, yIndex)[0]);
-      this->bins[bin_idx] += intensity;
-    }
+  // Models out of the frustum cannot change the render. The frustum only
+  // covers the middle tile of a tiled render, so tiles test every model.
+  const bool cull = this->processor.FovTileCount() == 1;
+#if GAZEBO_MAJOR_VERSION >= 8
+  VisualPtr worldVisual = this->scene->WorldVisual();
+#else
+  VisualPtr worldVisual = this->scene->GetWorldVisual();
+#endif
+  this->frameVisuals.clear();
+  for (unsigned int i = 0; i < worldVisual->GetChildCount(); ++i)
+  {
+    VisualPtr model = worldVisual->GetChild(i);
+    if (model->GetVisible() && (!cull || this->IsVisible(model)))
+      this->CollectSceneVisuals(model);
+  }
 
-    // for (size_t i = 0; i < this->binCount; ++i)
-    //   _accumData[i_beam * this->binCount + i] = this->bins[i];
+  bool unchanged = this->bSceneReference && this->SamePose(this->WorldPose(), this->scenePose) &&
+                   this->frameVisuals.size() == this->sceneVisuals.size();
+  for (size_t i = 0; unchanged && i < this->frameVisuals.size(); ++i)
+  {
+    unchanged = this->frameVisuals[i].first == this->sceneVisuals[i].first &&
+                this->SamePose(this->frameVisuals[i].second, this->sceneVisuals[i].second);
+  }
 
-    for (int i = 0; i < this->binCount; ++i)
-      noisy_image.at<float>(i_beam, i) += this->bins[i] * (0.5 + 7.0 * i * i / binCount / binCount);
+  // Changes are measured from the reference, so slow drifts add up
+  if (!unchanged)
+  {
+    this->scenePose = this->WorldPose();
+    this->sceneVisuals.swap(this->frameVisuals);
+    this->bSceneReference = true;
+    this->unchangedFrames = 0;
+    return false;
   }
 
-  // Add blur
-  cv::GaussianBlur(noisy_image, noisy_image, cv::Size(9, 11), 0);
+  // With a readback ring the processed frame lags the renders, keep
+  // rendering until it shows the unchanged scene
+  if (this->unchangedFrames < this->readbackBuffers)
+    this->unchangedFrames++;
+  return this->unchangedFrames >= this->readbackBuffers;
+}
 
-  for (int i_beam = 0; i_beam < this->beamCount; i_beam++)
-    for (size_t i = 0; i < this->binCount; ++i)
-      _accumData[i_beam * this->binCount + i] = noisy_image.at<float>(i_beam, i);
+//////////////////////////////////////////////////
+void FLSonar::ResetScene()
+{
+  this->bSceneReference = false;
+  this->unchangedFrames = 0;
 }
 
 //////////////////////////////////////////////////
-void FLSonar::TransferTableToSonar(const std::vector<float> &_accumData, const std::vector<int> &_transfer)
+void FLSonar::CollectSceneVisuals(VisualPtr _visual)
 {
-  for (size_t i = 0; i < _transfer.size(); ++i)
+#if GAZEBO_MAJOR_VERSION >= 8
+  this->frameVisuals.emplace_back(_visual->GetId(), _visual->WorldPose());
+#else
+  this->frameVisuals.emplace_back(_visual->GetId(), _visual->GetWorldPose().Ign());
+#endif
+  for (unsigned int i = 0; i < _visual->GetChildCount(); ++i)
   {
-    if (_transfer[i] != -1)
-      if (_transfer[i] < _accumData.size())
-        this->sonarImage.at<float>(i / this->sonarImage.cols, i % this->sonarImage.cols) = _accumData.at(_transfer[i]);
+    VisualPtr child = _visual->GetChild(i);
+    if (child->GetVisible())
+      this->CollectSceneVisuals(child);
   }
 }
 
 //////////////////////////////////////////////////
-void FLSonar::GenerateTransferTable(std::vector<int> &_transfer)
+bool FLSonar::SamePose(const ignition::math::Pose3d &_pose1,
+                       const ignition::math::Pose3d &_pose2) const
 {
-  // set the origin
-  cv::Point2f origin(this->sonarImage.cols / 2, this->sonarImage.rows / 2);
-
-
-  for (size_t j = 0; j < this->sonarImage.rows; j++)
-  {
-    for (size_t i = 0; i < this->sonarImage.cols; i++)
-    {
-      // current point
-      cv::Point2f point(i - origin.x, j - origin.y);
-      point.x = point.x * static_cast<float>(this->binCount / (this->sonarImage.cols * 0.5));
-      point.y = point.y * static_cast<float>(this->binCount / (this->sonarImage.rows * 0.5));
-
-      double radius = sqrt(point.x * point.x + point.y * point.y);
-      double theta = atan2(point.x, -point.y);
-
-      // pixels out the sonar image
-      if (radius > this->binCount || !radius || theta < -this->HorzFOV() / 2 || theta > this->HorzFOV() / 2)
-        _transfer.push_back(-1);
-
-      // pixels in the sonar image
-      else
-      {
-        this->sonarImageMask.at<uchar>(j, i) = 255;
-        int idBeam = static_cast<int>(((theta + this->HorzFOV() / 2) / (this->HorzFOV())) * (this->beamCount));
-        _transfer.push_back(idBeam * this->binCount + static_cast<float>(radius));
-      }
-    }
-  }
+  if (_pose1.Pos().Distance(_pose2.Pos()) > this->positionTolerance)
+    return false;
+
+  // Angle of the rotation between the two orientations
+  const ignition::math::Quaterniond &q1 = _pose1.Rot();
+  const ignition::math::Quaterniond &q2 = _pose2.Rot();
+  double dot = q1.W() * q2.W() + q1.X() * q2.X() + q1.Y() * q2.Y() + q1.Z() * q2.Z();
+  return 2 * std::acos(std::min(std::abs(dot), 1.0)) <= this->angleTolerance;
 }
 
 //////////////////////////////////////////////////
@@ -655,22 +1013,18 @@ sonar_msgs::SonarStamped FLSonar::SonarRosMsg(const gazebo::physics::WorldPtr _w
 {
   this->UpdateData();
 
-  sonar_msgs::SonarStamped sonarOutput;
 #if GAZEBO_MAJOR_VERSION >= 8
   auto world_sim_time = _world->SimTime();
 #else
   auto world_sim_time = _world->GetSimTime();
 #endif
-  sonarOutput.header.stamp.sec = world_sim_time.sec;
-  sonarOutput.header.stamp.nsec = world_sim_time.nsec;
-  sonarOutput.num_bins = this->binCount;
-  sonarOutput.num_beams = this->beamCount;
-  sonarOutput.beams_width = this->HorzFOV();
-  sonarOutput.beam_height = this->VertFOV();
-  sonarOutput.bearings = 0;
-  sonarOutput.data = this->accumData;
+  return this->SonarRosMsg(world_sim_time);
+}
 
-  return sonarOutput;
+//////////////////////////////////////////////////
+sonar_msgs::SonarStamped FLSonar::SonarRosMsg(const common::Time &_stamp)
+{
+  return this->processor.SonarRosMsg(_stamp);
 }
 
 //////////////////////////////////////////////////
@@ -679,22 +1033,22 @@ void FLSonar::DebugPrintMatrixToFile(const std::string &_filename, const std::ve
 {
   FILE* imageFile;
   imageFile = fopen(_filename.c_str(), "w");
-  for (int i = 0 ; i < this->binCount + 1; i++)
+  for (int i = 0 ; i < this->BinCount() + 1; i++)
   {
     if (i == 0)
     {
-      for (int j = 0; j < this->beamCount; j++)
+      for (int j = 0; j < this->BeamCount(); j++)
         fprintf(imageFile, "%9u ", j);
     }
     else
     {
       fprintf(imageFile, "%u: ", i - 1);
-      for (int j = 0; j < this->beamCount; j++)
+      for (int j = 0; j < this->BeamCount(); j++)
       {
         if (std::is_same<T, float>::value)
-          fprintf(imageFile, "%1.7f ", static_cast<float>(_matrix[j * this->binCount + i - 1]));
+          fprintf(imageFile, "%1.7f ", static_cast<float>(_matrix[j * this->BinCount() + i - 1]));
         if (std::is_same<T, int>::value)
-          fprintf(imageFile, "%9d ", static_cast<int>(_matrix[j * this->binCount + i - 1]));
+          fprintf(imageFile, "%9d ", static_cast<int>(_matrix[j * this->BinCount() + i - 1]));
       }
     }
 
@@ -756,12 +1110,11 @@ void FLSonar::PixelBoxTextureToCV(Ogre::Texture *_texture, cv::Mat &_image, int
   Ogre::HardwarePixelBufferSharedPtr pixelBuffer;
 
   pixelBuffer = _texture->getBuffer();
-  size_t size = Ogre::PixelUtil::getMemorySize(
-                  _width, _height, 1, Ogre::PF_FLOAT32_RGB);
-
 
+  // Half float textures are widened to float by Ogre after the download
+  Ogre::PixelFormat format = _image.channels() == 3 ? Ogre::PF_FLOAT32_RGB : Ogre::PF_FLOAT32_GR;
   Ogre::PixelBox dstBox(_width, _height,
-                        1, Ogre::PF_FLOAT32_RGB , _image.data);
+                        1, format, _image.data);
 
   pixelBuffer->blitToMemory(dstBox);
 }
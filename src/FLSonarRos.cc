@@ -4,6 +4,9 @@
 
 #include "forward_looking_sonar_gazebo/SDFTool.hh"
 
+#include <algorithm>
+#include <map>
+
 #include <sensor_msgs/Range.h>
 
 #include <sonar_msgs/SonarStamped.h>
@@ -12,20 +15,120 @@
 namespace gazebo
 {
 
-void FLSonarRos::Load(sensors::SensorPtr _parent, sdf::ElementPtr _sdf)
+std::shared_ptr<FLSonarBatch> FLSonarBatch::Get(const std::string &_worldName)
 {
-  // Store the pointer to the model
-  this->sensor = _parent;
+  static std::mutex batchesMutex;
+  static std::map<std::string, std::weak_ptr<FLSonarBatch>> batches;
 
+  std::lock_guard<std::mutex> lock(batchesMutex);
+  std::shared_ptr<FLSonarBatch> batch = batches[_worldName].lock();
+  if (!batch)
+  {
+    batch.reset(new FLSonarBatch());
+    batches[_worldName] = batch;
+  }
+  return batch;
+}
+
+FLSonarBatch::FLSonarBatch()
+{
   this->updateConnection =  event::Events::ConnectRender(
-                              std::bind(&FLSonarRos::OnUpdate, this));
+                              std::bind(&FLSonarBatch::OnUpdate, this));
   this->updatePostRender =  event::Events::ConnectPostRender(
-                              std::bind(&FLSonarRos::OnPostRender, this));
+                              std::bind(&FLSonarBatch::OnPostRender, this));
   this->updatePreRender =  event::Events::ConnectPreRender(
-                             std::bind(&FLSonarRos::OnPreRender, this));
+                             std::bind(&FLSonarBatch::OnPreRender, this));
+}
+
+void FLSonarBatch::Add(FLSonarRos *_sonar)
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->sonars.push_back(_sonar);
+}
+
+void FLSonarBatch::Remove(FLSonarRos *_sonar)
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->sonars.erase(std::remove(this->sonars.begin(), this->sonars.end(), _sonar),
+                     this->sonars.end());
+}
+
+void FLSonarBatch::OnPreRender()
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  // Readbacks need the GL context, they are done in sequence on the render
+  // thread. Each sonar then processes its frame on its own pipeline worker,
+  // so the render thread does not wait for them.
+  for (auto sonar : this->sonars)
+    sonar->PrepareFrame();
+}
+
+void FLSonarBatch::OnUpdate()
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  for (auto sonar : this->sonars)
+    sonar->OnUpdate();
+}
 
+void FLSonarBatch::OnPostRender()
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  for (auto sonar : this->sonars)
+    sonar->OnPostRender();
+}
 
-  if (rendering::RenderEngine::Instance()->GetRenderPathType() ==
+FLSonarRos::~FLSonarRos()
+{
+  // No event may reach the pipeline once it is gone: the render callbacks
+  // check it and then use it, so disconnect them, then leave the batch,
+  // whose lock waits for a batched callback in flight
+  this->updateConnection.reset();
+  this->updatePostRender.reset();
+  this->updatePreRender.reset();
+  this->updateWorld.reset();
+  if (this->batch)
+    this->batch->Remove(this);
+
+  this->pipeline.reset();
+
+  // The statistics go away before the sonar
+  if (this->sonar)
+    this->sonar->SetStats(nullptr);
+  if (this->processor)
+    this->processor->SetStats(nullptr);
+}
+
+void FLSonarRos::Load(sensors::SensorPtr _parent, sdf::ElementPtr _sdf)
+{
+  // Store the pointer to the model
+  this->sensor = _parent;
+  this->bPendingReadback = false;
+  this->bReuseFrame = false;
+  this->bPendingReuse = false;
+  this->renderIndex = 0;
+  this->processedRender = 0;
+  this->bSceneLost = false;
+  this->bActiveFrame = false;
+  this->bUpdatedOnce = false;
+  this->bLazy = false;
+  this->updatePeriod = 0.0;
+  this->processor = nullptr;
+  this->statsPeriod = 1.0;
+
+  // "gpu" renders the shader image with Ogre, "cpu" ray casts the physics
+  // world so the sonar also runs on headless servers
+  std::string backend = "gpu";
+  if (_sdf->HasElement("backend"))
+    backend = _sdf->Get<std::string>("backend");
+  if (backend != "gpu" && backend != "cpu")
+  {
+    gzerr << "Unknown sonar backend [" << backend << "], using gpu" << std::endl;
+    backend = "gpu";
+  }
+
+  if (backend == "gpu" &&
+      rendering::RenderEngine::Instance()->GetRenderPathType() ==
       rendering::RenderEngine::NONE)
   {
     gzerr << "Unable to create CameraSensor. Rendering is disabled.\n";
@@ -48,25 +151,38 @@ void FLSonarRos::Load(sensors::SensorPtr _parent, sdf::ElementPtr _sdf)
   current = parent->GetChildLink(gazebo::SDFTool::GetSDFElement<std::string>(_sdf, "link_reference"));
   GZ_ASSERT(current, "It must have this link");
 
-  this->scene = rendering::get_scene(worldName);
-
-  // Get scene pointer
-  gzwarn << rendering::RenderEngine::Instance()->SceneCount() << " Num Scenes" << std::endl;
-
-  if (!this->scene)
+  if (backend == "cpu")
   {
-    this->scene = rendering::RenderEngine::Instance()->CreateScene(worldName, false, true);
+    this->cpuProcessor.reset(new rendering::SonarProcessor());
+    this->cpuProcessor->Load(_sdf, this->sensor->ScopedName());
+    this->processor = this->cpuProcessor.get();
+    this->rayCaster.reset(new rendering::SonarRayCaster());
+    this->farClip = gazebo::SDFTool::GetSDFElement<double>(_sdf, "far", "clip");
+    this->nearClip = gazebo::SDFTool::GetSDFElement<double>(_sdf, "near", "clip");
   }
-
-  if (scene != nullptr)
+  else
   {
-    gzwarn << "Got Scene" << std::endl;
-    double hfov = M_PI / 2;
-    this->sonar = std::shared_ptr<rendering::FLSonar>(new rendering::FLSonar(this->sensor->Name(), this->scene, false));
-    this->sonar->SetFarClip(100.0);
-    this->sonar->Init();
-    this->sonar->Load(_sdf);
-    this->sonar->CreateTexture("GPUTexture");
+    this->scene = rendering::get_scene(worldName);
+
+    // Get scene pointer
+    gzwarn << rendering::RenderEngine::Instance()->SceneCount() << " Num Scenes" << std::endl;
+
+    if (!this->scene)
+    {
+      this->scene = rendering::RenderEngine::Instance()->CreateScene(worldName, false, true);
+    }
+
+    if (scene != nullptr)
+    {
+      gzwarn << "Got Scene" << std::endl;
+      double hfov = M_PI / 2;
+      this->sonar = std::shared_ptr<rendering::FLSonar>(new rendering::FLSonar(this->sensor->ScopedName(), this->scene, false));
+      this->sonar->SetFarClip(100.0);
+      this->sonar->Init();
+      this->sonar->Load(_sdf);
+      this->sonar->CreateTexture("GPUTexture");
+      this->processor = &this->sonar->Processor();
+    }
   }
 
   if (!ros::isInitialized())
@@ -82,7 +198,9 @@ void FLSonarRos::Load(sensors::SensorPtr _parent, sdf::ElementPtr _sdf)
 
   GZ_ASSERT(std::strcmp(_sdf->Get<std::string>("topic").c_str(), ""), "Topic name is not set");
 
-  this->sonarImagePub = this->sonarImageTransport->advertise(_sdf->Get<std::string>("topic"), 1);
+  // The sonar image can be disabled to publish the beams only
+  if (this->processor && this->processor->SonarImageEnabled())
+    this->sonarImagePub = this->sonarImageTransport->advertise(_sdf->Get<std::string>("topic"), 1);
 
   this->sonarMsgPub = this->rosNode->advertise<sonar_msgs::SonarStamped>(
                                     _sdf->Get<std::string>("topic") + "/beams_fls", 0);
@@ -90,6 +208,18 @@ void FLSonarRos::Load(sensors::SensorPtr _parent, sdf::ElementPtr _sdf)
   // Determine if color scheme is disabled, default false
   this->disable_color = _sdf->Get<bool>("disable_color");
 
+  // Color map, gain and gamma of the published image
+  if (_sdf->HasElement("colormap") &&
+      !this->colorMap.SetColorMap(_sdf->Get<std::string>("colormap")))
+  {
+    gzerr << "Unknown sonar colormap [" << _sdf->Get<std::string>("colormap")
+          << "], using winter" << std::endl;
+  }
+  if (_sdf->HasElement("gain"))
+    this->colorMap.SetGain(_sdf->Get<double>("gain"));
+  if (_sdf->HasElement("gamma"))
+    this->colorMap.SetGamma(_sdf->Get<double>("gamma"));
+
   this->bDebug = false;
   if (_sdf->HasElement("debug"))
   {
@@ -100,73 +230,434 @@ void FLSonarRos::Load(sensors::SensorPtr _parent, sdf::ElementPtr _sdf)
       this->shaderImagePub = this->shaderImageTransport->advertise(_sdf->Get<std::string>("topic") + "/shader", 1);
     }
   }
+
+  // Only render, read back and publish when the sensor is due
+  if (this->sensor->UpdateRate() > 0.0)
+    this->updatePeriod = 1.0 / this->sensor->UpdateRate();
+
+  // Skip the whole sonar chain while nobody listens
+  if (_sdf->HasElement("lazy"))
+    this->bLazy = _sdf->Get<bool>("lazy");
+
+  bool batchRender = _sdf->HasElement("batch_render") && _sdf->Get<bool>("batch_render");
+
+  // Move binning, polar transform and publishing off the render thread.
+  // Batched GPU sonars always do, so the batch never waits on them, and so
+  // does the CPU backend, which casts on the worker instead of stalling the
+  // physics.
+  if (_sdf->HasElement("pipeline") || batchRender || this->rayCaster)
+  {
+    int depth = 2;
+    SonarPipeline::DropPolicy policy = SonarPipeline::DROP_OLDEST;
+    if (_sdf->HasElement("pipeline"))
+    {
+      sdf::ElementPtr pipelineSdf = _sdf->GetElement("pipeline");
+      if (pipelineSdf->HasElement("depth"))
+        depth = std::max(pipelineSdf->Get<int>("depth"), 1);
+
+      if (pipelineSdf->HasElement("drop_policy") &&
+          !SonarPipeline::ParseDropPolicy(pipelineSdf->Get<std::string>("drop_policy"), policy))
+      {
+        gzerr << "Unknown sonar pipeline drop_policy ["
+              << pipelineSdf->Get<std::string>("drop_policy")
+              << "], using drop_oldest" << std::endl;
+      }
+    }
+
+    this->pipeline.reset(new SonarPipeline(depth, policy,
+                           std::bind(&FLSonarRos::ProcessFrame, this, std::placeholders::_1)));
+    this->pipeline->Start();
+  }
+
+  // Time the sonar stages and publish their rolling percentiles
+  if (_sdf->HasElement("stats") && this->processor)
+  {
+    sdf::ElementPtr statsSdf = _sdf->GetElement("stats");
+    if (statsSdf->HasElement("period"))
+      this->statsPeriod = statsSdf->Get<double>("period");
+
+    this->stats.reset(new rendering::SonarStats());
+    this->statsPub = this->rosNode->advertise<diagnostic_msgs::DiagnosticArray>(
+                                   _sdf->Get<std::string>("topic") + "/stats", 1);
+
+    if (this->sonar)
+      this->sonar->SetStats(this->stats.get());
+    else
+      this->processor->SetStats(this->stats.get());
+  }
+
+  // The CPU backend follows the physics, there is no render to batch
+  if (this->rayCaster)
+  {
+    if (batchRender)
+      gzwarn << "batch_render is ignored by the cpu sonar backend" << std::endl;
+
+    this->updateWorld = event::Events::ConnectWorldUpdateBegin(
+                          std::bind(&FLSonarRos::OnWorldUpdate, this, std::placeholders::_1));
+  }
+  // Render all the batched sonars of the world together
+  else if (batchRender)
+  {
+    this->batch = FLSonarBatch::Get(worldName);
+    this->batch->Add(this);
+  }
+  else
+  {
+    this->updateConnection =  event::Events::ConnectRender(
+                                std::bind(&FLSonarRos::OnUpdate, this));
+    this->updatePostRender =  event::Events::ConnectPostRender(
+                                std::bind(&FLSonarRos::OnPostRender, this));
+    this->updatePreRender =  event::Events::ConnectPreRender(
+                               std::bind(&FLSonarRos::OnPreRender, this));
+  }
+}
+
+
+
+common::Time FLSonarRos::SimTime() const
+{
+#if GAZEBO_MAJOR_VERSION >= 8
+  return this->world->SimTime();
+#else
+  return this->world->GetSimTime();
+#endif
+}
+
+bool FLSonarRos::HasSubscribers() const
+{
+  uint32_t subscribers = this->sonarImagePub.getNumSubscribers() +
+                         this->sonarMsgPub.getNumSubscribers();
+  if (this->bDebug)
+    subscribers += this->shaderImagePub.getNumSubscribers();
+
+  return subscribers > 0;
 }
 
+bool FLSonarRos::IsDue()
+{
+  if (this->bLazy && !this->HasSubscribers())
+    return false;
+
+  common::Time simTime = this->SimTime();
 
+  // Sim time went backwards, the world was reset
+  if (simTime < this->lastUpdateTime)
+    this->bUpdatedOnce = false;
+
+  if (!this->bUpdatedOnce)
+  {
+    this->lastUpdateTime = simTime;
+    this->bUpdatedOnce = true;
+    return true;
+  }
+
+  double elapsed = (simTime - this->lastUpdateTime).Double();
+  if (elapsed < this->updatePeriod)
+    return false;
+
+  // Advance by whole periods so the rate does not drift with the render
+  // ticks, unless we fell more than a period behind
+  if (elapsed < 2 * this->updatePeriod)
+    this->lastUpdateTime += common::Time(this->updatePeriod);
+  else
+    this->lastUpdateTime = simTime;
+
+  return true;
+}
 
 void FLSonarRos::OnPreRender()
 {
+  this->PrepareFrame();
+}
+
+bool FLSonarRos::PrepareFrame()
+{
+  this->bActiveFrame = this->IsDue();
+  this->bReuseFrame = false;
+
+  // Hand the previous render to the worker, this only costs the readback.
+  // A skipped render is handed over without readback.
+  if (this->pipeline && (this->bPendingReadback || this->bPendingReuse))
+  {
+    SonarFrame *frame = this->pipeline->Acquire();
+    if (frame)
+    {
+      // A readback ring returns an older render, stamped with its own time
+      frame->unchanged = this->bPendingReuse;
+      frame->stamp = this->renderTime;
+      if (!frame->unchanged)
+      {
+        this->sonar->ReadTexture(frame->rawImage);
+        frame->stamp = this->sonar->ReadbackTime();
+      }
+      frame->render = this->renderIndex;
+      this->pipeline->Commit();
+    }
+    this->bPendingReadback = false;
+    this->bPendingReuse = false;
+  }
+
+  if (!this->bActiveFrame)
+    return false;
+
 #if GAZEBO_MAJOR_VERSION >= 8
   this->sonar->PreRender(current->WorldCoGPose());
 #else
   this->sonar->PreRender(current->GetWorldCoGPose().Ign());
 #endif
-  this->sonar->GetSonarImage();
+
+  if (this->bSceneLost.exchange(false))
+    this->sonar->ResetScene();
+  this->bReuseFrame = this->sonar->SceneUnchanged();
+
+  return true;
 }
 
 void FLSonarRos::OnUpdate()
 {
+  if (!this->bActiveFrame)
+    return;
+
   if (this->bDebug)
     gzwarn << this->sensor->ParentName() << std::endl;
 
-  this->sonar->RenderImpl();
+  // Pipelined sonars, batched ones included, read this render back on the
+  // next tick. An unchanged scene is not rendered, its last render is
+  // binned again.
+  if (this->bReuseFrame)
+  {
+    this->bPendingReuse = true;
+  }
+  else
+  {
+    this->sonar->SetRenderTime(this->SimTime());
+    this->sonar->RenderImpl();
+    this->renderIndex++;
+    this->bPendingReadback = true;
+  }
+  this->renderTime = this->SimTime();
 }
 
 
 void FLSonarRos::OnPostRender()
 {
+  if (!this->bActiveFrame)
+    return;
+
+  if (this->bReuseFrame)
+  {
+    // Binned again from the last render, no render to finish
+    if (!this->pipeline)
+    {
+      if (this->processor->Reprocess())
+        this->PublishSonar(this->SimTime());
+      else
+        this->sonar->ResetScene();
+    }
+    return;
+  }
+
   this->sonar->PostRender();
 
-  // Publish sonar image
+  // Bin and scan convert this render, the beams are then handed to the
+  // message so the image must be converted before
+  if (!this->pipeline)
   {
-    cv::Mat sonarImage = this->sonar->SonarImage();
-    cv::Mat sonarMask = this->sonar->SonarMask();
+    this->sonar->GetSonarImage();
+    this->PublishSonar(this->sonar->ReadbackTime());
+  }
+}
 
-    // Apply color map if disable_color false / not specified
-    sensor_msgs::ImagePtr msg;
-    if (!this->disable_color) {
-      cv::Mat B = cv::Mat::zeros(sonarImage.rows, sonarImage.cols, CV_8UC1);
-      sonarImage.convertTo(B, CV_8UC1, 255);
+void FLSonarRos::OnWorldUpdate(const common::UpdateInfo &/*_info*/)
+{
+  if (!this->IsDue())
+    return;
 
-      cv::applyColorMap(B, B, cv::COLORMAP_WINTER);
-      B.setTo(0, ~sonarMask);
+  // Models were inserted or deleted, rebuild the geometry. The ids tell a
+  // deletion and an insertion in the same update apart from no change.
+  this->modelIds.clear();
+#if GAZEBO_MAJOR_VERSION >= 8
+  for (auto &model : this->world->Models())
+#else
+  for (auto &model : this->world->GetModels())
+#endif
+    this->modelIds.push_back(model->GetId());
+  std::sort(this->modelIds.begin(), this->modelIds.end());
 
-      msg = cv_bridge::CvImage(std_msgs::Header(), "bgr8", B).toImageMsg();
-    }
-    else 
+  if (this->modelIds != this->cpuModelIds)
+  {
+    std::lock_guard<std::mutex> lock(this->rayCasterMutex);
+    this->rayCaster->LoadWorld(this->world);
+    this->cpuModelIds = this->modelIds;
+  }
+
+  SonarFrame *frame = this->pipeline->Acquire();
+  if (!frame)
+    return;
+
+  // Only the poses are read here, the worker casts the rays. Moving models
+  // is cheap, it only updates the instance poses.
+#if GAZEBO_MAJOR_VERSION >= 8
+  frame->pose = current->WorldCoGPose();
+#else
+  frame->pose = current->GetWorldCoGPose().Ign();
+#endif
+  frame->worldLoads = this->rayCaster->WorldPoses(frame->instancePoses);
+  frame->stamp = this->SimTime();
+  this->pipeline->Commit();
+}
+
+void FLSonarRos::ProcessFrame(SonarFrame &_frame)
+{
+  // An unchanged frame is binned again from its render, which the
+  // pipeline may have dropped. The render thread then renders again.
+  if (_frame.unchanged)
+  {
+    if (_frame.render != this->processedRender || !this->processor->Reprocess())
     {
-      cv::Mat B = cv::Mat::zeros(sonarImage.rows, sonarImage.cols, CV_8UC1);
-      sonarImage.convertTo(B, CV_8UC1, 255);
-      msg = cv_bridge::CvImage(std_msgs::Header(), "mono8", B).toImageMsg();
+      this->bSceneLost = true;
+      return;
     }
-    
-    // Set time stamp
-    msg->header.stamp = ros::Time::now();
+    this->PublishSonar(_frame.stamp);
+    return;
+  }
+
+  // The CPU backend casts the shader image from the poses of the frame. A
+  // frame read before the geometry was loaded again is dropped.
+  if (this->rayCaster)
+  {
+    std::lock_guard<std::mutex> lock(this->rayCasterMutex);
+    if (!this->rayCaster->SetWorldPoses(_frame.instancePoses, _frame.worldLoads))
+      return;
+
+    this->processor->FitShaderImage(_frame.rawImage);
+    rendering::SonarStats::ScopedTimer timer(this->stats.get(), rendering::SonarStats::RENDER);
+    this->rayCaster->Render(_frame.pose, this->processor->HorzFOV(), this->processor->VertFOV(),
+                            this->nearClip, this->farClip, _frame.rawImage,
+                            this->processor->ThreadPool(), this->processor->FovTileCount());
+  }
 
-    this->sonarImagePub.publish(msg);
+  // With GPU binning or field of view tiles the frames hold the bin counts,
+  // not the shader image
+  if (this->sonar && this->sonar->ReadsBinCounts())
+    this->processor->ProcessBinCounts(_frame.rawImage);
+  else
+    this->processor->Process(_frame.rawImage);
+  this->processedRender = _frame.render;
+  this->PublishSonar(_frame.stamp);
+
+  // The slot is written again once released, only the debug image of the
+  // unchanged frames still needs its content
+  this->processor->DetachShaderImage(this->bDebug);
+}
 
-    this->sonarMsgPub.publish(this->sonar->SonarRosMsg(this->world));
+void FLSonarRos::PublishSonar(const common::Time &_stamp)
+{
+  // Color map the sonar image, unless only the beams are published
+  sensor_msgs::ImagePtr msg;
+  if (this->processor->SonarImageEnabled())
+  {
+    cv::Mat sonarImage = this->processor->SonarImage();
+    cv::Mat sonarMask = this->processor->SonarMask();
+
+    // The image is written straight into the message buffer, which keeps
+    // its size between frames
+    msg = this->imageMsgPool.Acquire();
+    msg->header.stamp.sec = _stamp.sec;
+    msg->header.stamp.nsec = _stamp.nsec;
+    msg->height = sonarImage.rows;
+    msg->width = sonarImage.cols;
+    msg->encoding = this->disable_color ? "mono8" : "bgr8";
+    msg->is_bigendian = 0;
+    msg->step = sonarImage.cols * (this->disable_color ? 1 : 3);
+    msg->data.resize(msg->step * msg->height);
+    cv::Mat msgImage(msg->height, msg->width, this->disable_color ? CV_8UC1 : CV_8UC3,
+                     msg->data.data(), msg->step);
+
+    // Apply color map if disable_color false / not specified, gray levels
+    // otherwise
+    rendering::SonarStats::ScopedTimer timer(this->stats.get(), rendering::SonarStats::COLORMAP);
+    this->colorMap.Apply(sonarImage, sonarMask, msgImage);
   }
 
-  // Publish shader image
-  if (this->bDebug)
+  // Publish sonar image and beams
   {
-    cv::Mat shaderImage = this->sonar->ShaderImage();
+    rendering::SonarStats::ScopedTimer timer(this->stats.get(), rendering::SonarStats::PUBLISH);
+    if (msg)
+      this->sonarImagePub.publish(msg);
+
+    // The beams are swapped into the message, not copied
+    boost::shared_ptr<sonar_msgs::SonarStamped> sonarMsg = this->sonarMsgPool.Acquire();
+    this->processor->FillSonarRosMsg(*sonarMsg, _stamp);
+    this->sonarMsgPub.publish(sonarMsg);
+  }
+
+  // Publish shader image, which is not read back with GPU binning or
+  // field of view tiles
+  if (this->bDebug && !(this->sonar && this->sonar->ReadsBinCounts()))
+  {
+    cv::Mat shaderImage = this->processor->ShaderImage();
     cv::Mat B = cv::Mat::zeros(shaderImage.rows, shaderImage.cols, CV_8UC3);
     shaderImage.convertTo(B, CV_8UC3, 255);
 
     sensor_msgs::ImagePtr msg = cv_bridge::CvImage(std_msgs::Header(), "bgr8", B).toImageMsg();
     this->shaderImagePub.publish(msg);
   }
+
+  this->PublishStats();
+}
+
+void FLSonarRos::PublishStats()
+{
+  if (!this->stats)
+    return;
+
+  common::Time simTime = this->SimTime();
+  if (simTime >= this->lastStatsTime &&
+      (simTime - this->lastStatsTime).Double() < this->statsPeriod)
+    return;
+  this->lastStatsTime = simTime;
+
+  // One status for the sonar, with the percentiles of each stage in ms
+  diagnostic_msgs::DiagnosticArray msg;
+  msg.header.stamp = ros::Time::now();
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  status.name = this->sensor->Name() + " sonar stages";
+  status.hardware_id = this->sensor->Name();
+  status.message = "Stage durations in ms";
+
+  for (int stage = 0; stage < rendering::SonarStats::STAGE_COUNT; ++stage)
+  {
+    rendering::SonarStats::Summary summary =
+      this->stats->Summarize(static_cast<rendering::SonarStats::Stage>(stage));
+    if (summary.count == 0)
+      continue;
+
+    std::string name = rendering::SonarStats::StageName(
+                         static_cast<rendering::SonarStats::Stage>(stage));
+    const std::pair<const char *, double> values[] = {
+      {"p50", summary.p50}, {"p95", summary.p95}, {"p99", summary.p99}, {"max", summary.max}};
+    for (auto &value : values)
+    {
+      diagnostic_msgs::KeyValue keyValue;
+      keyValue.key = name + "/" + value.first;
+      keyValue.value = std::to_string(value.second * 1e3);
+      status.values.push_back(keyValue);
+    }
+  }
+
+  // Frames the worker pipeline could not keep up with
+  if (this->pipeline)
+  {
+    diagnostic_msgs::KeyValue keyValue;
+    keyValue.key = "pipeline/dropped_frames";
+    keyValue.value = std::to_string(this->pipeline->DroppedFrames());
+    status.values.push_back(keyValue);
+  }
+
+  msg.status.push_back(status);
+  this->statsPub.publish(msg);
 }
 }  // namespace gazebo
@@ -0,0 +1,224 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SONAR_BIN_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+#include "forward_looking_sonar_gazebo/SonarBinKernel.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+namespace
+{
+//////////////////////////////////////////////////
+void AccumulateScalar(const float *_depth, const float *_intensity,
+                      size_t _samples, int _binCount,
+                      float *_counts, float *_sums)
+{
+  const float scale = static_cast<float>(_binCount - 1);
+  for (size_t i = 0; i < _samples; ++i)
+  {
+    // NaN fails the comparison and falls in bin 0 like with the SIMD max
+    float d = _depth[i] * scale;
+    d = !(d > 0.0f) ? 0.0f : std::min(d, scale);
+    int bin = static_cast<int>(d);
+    _counts[bin] += 1.0f;
+    _sums[bin] += _intensity[i];
+  }
+}
+
+//////////////////////////////////////////////////
+void NormalizeScalar(const float *_counts, const float *_sums,
+                     int _binCount, float *_bins)
+{
+  for (int i = 0; i < _binCount; ++i)
+    _bins[i] = _counts[i] > 0.0f ? _sums[i] / _counts[i] : 0.0f;
+}
+
+#ifdef SONAR_BIN_KERNEL_X86
+//////////////////////////////////////////////////
+__attribute__((target("sse2")))
+void AccumulateSSE2(const float *_depth, const float *_intensity,
+                    size_t _samples, int _binCount,
+                    float *_counts, float *_sums)
+{
+  const float scale = static_cast<float>(_binCount - 1);
+  const __m128 vScale = _mm_set1_ps(scale);
+  const __m128 vZero = _mm_setzero_ps();
+  alignas(16) int idx[4];
+
+  size_t i = 0;
+  for (; i + 4 <= _samples; i += 4)
+  {
+    __m128 d = _mm_mul_ps(_mm_loadu_ps(_depth + i), vScale);
+    d = _mm_min_ps(_mm_max_ps(d, vZero), vScale);
+    _mm_store_si128(reinterpret_cast<__m128i *>(idx), _mm_cvttps_epi32(d));
+
+    for (int k = 0; k < 4; ++k)
+    {
+      _counts[idx[k]] += 1.0f;
+      _sums[idx[k]] += _intensity[i + k];
+    }
+  }
+
+  AccumulateScalar(_depth + i, _intensity + i, _samples - i, _binCount,
+                   _counts, _sums);
+}
+
+//////////////////////////////////////////////////
+__attribute__((target("sse2")))
+void NormalizeSSE2(const float *_counts, const float *_sums,
+                   int _binCount, float *_bins)
+{
+  const __m128 vZero = _mm_setzero_ps();
+
+  int i = 0;
+  for (; i + 4 <= _binCount; i += 4)
+  {
+    __m128 c = _mm_loadu_ps(_counts + i);
+    __m128 mean = _mm_div_ps(_mm_loadu_ps(_sums + i), c);
+    _mm_storeu_ps(_bins + i, _mm_and_ps(mean, _mm_cmpgt_ps(c, vZero)));
+  }
+
+  NormalizeScalar(_counts + i, _sums + i, _binCount - i, _bins + i);
+}
+
+//////////////////////////////////////////////////
+__attribute__((target("avx2")))
+void AccumulateAVX2(const float *_depth, const float *_intensity,
+                    size_t _samples, int _binCount,
+                    float *_counts, float *_sums)
+{
+  const float scale = static_cast<float>(_binCount - 1);
+  const __m256 vScale = _mm256_set1_ps(scale);
+  const __m256 vZero = _mm256_setzero_ps();
+  alignas(32) int idx[8];
+
+  size_t i = 0;
+  for (; i + 8 <= _samples; i += 8)
+  {
+    __m256 d = _mm256_mul_ps(_mm256_loadu_ps(_depth + i), vScale);
+    d = _mm256_min_ps(_mm256_max_ps(d, vZero), vScale);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(idx), _mm256_cvttps_epi32(d));
+
+    for (int k = 0; k < 8; ++k)
+    {
+      _counts[idx[k]] += 1.0f;
+      _sums[idx[k]] += _intensity[i + k];
+    }
+  }
+
+  AccumulateScalar(_depth + i, _intensity + i, _samples - i, _binCount,
+                   _counts, _sums);
+}
+
+//////////////////////////////////////////////////
+__attribute__((target("avx2")))
+void NormalizeAVX2(const float *_counts, const float *_sums,
+                   int _binCount, float *_bins)
+{
+  const __m256 vZero = _mm256_setzero_ps();
+
+  int i = 0;
+  for (; i + 8 <= _binCount; i += 8)
+  {
+    __m256 c = _mm256_loadu_ps(_counts + i);
+    __m256 mean = _mm256_div_ps(_mm256_loadu_ps(_sums + i), c);
+    __m256 hit = _mm256_cmp_ps(c, vZero, _CMP_GT_OQ);
+    _mm256_storeu_ps(_bins + i, _mm256_and_ps(mean, hit));
+  }
+
+  NormalizeScalar(_counts + i, _sums + i, _binCount - i, _bins + i);
+}
+#endif
+}  // namespace
+
+//////////////////////////////////////////////////
+SonarBinKernel::SonarBinKernel()
+{
+  this->Select(BestIsa());
+}
+
+//////////////////////////////////////////////////
+SonarBinKernel::SonarBinKernel(const Isa _isa)
+{
+  this->Select(std::min(_isa, BestIsa()));
+}
+
+//////////////////////////////////////////////////
+SonarBinKernel::Isa SonarBinKernel::ActiveIsa() const
+{
+  return this->isa;
+}
+
+//////////////////////////////////////////////////
+SonarBinKernel::Isa SonarBinKernel::BestIsa()
+{
+#ifdef SONAR_BIN_KERNEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return ISA_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return ISA_SSE2;
+#endif
+  return ISA_SCALAR;
+}
+
+//////////////////////////////////////////////////
+std::string SonarBinKernel::IsaName(const Isa _isa)
+{
+  switch (_isa)
+  {
+    case ISA_AVX2:
+      return "avx2";
+    case ISA_SSE2:
+      return "sse2";
+    default:
+      return "scalar";
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarBinKernel::Accumulate(const float *_depth, const float *_intensity,
+                                const size_t _samples, const int _binCount,
+                                float *_counts, float *_sums) const
+{
+  this->accumulateFn(_depth, _intensity, _samples, _binCount, _counts, _sums);
+}
+
+//////////////////////////////////////////////////
+void SonarBinKernel::Normalize(const float *_counts, const float *_sums,
+                               const int _binCount, float *_bins) const
+{
+  this->normalizeFn(_counts, _sums, _binCount, _bins);
+}
+
+//////////////////////////////////////////////////
+void SonarBinKernel::Select(const Isa _isa)
+{
+  this->isa = _isa;
+  this->accumulateFn = &AccumulateScalar;
+  this->normalizeFn = &NormalizeScalar;
+
+#ifdef SONAR_BIN_KERNEL_X86
+  if (_isa == ISA_AVX2)
+  {
+    this->accumulateFn = &AccumulateAVX2;
+    this->normalizeFn = &NormalizeAVX2;
+  }
+  else if (_isa == ISA_SSE2)
+  {
+    this->accumulateFn = &AccumulateSSE2;
+    this->normalizeFn = &NormalizeSSE2;
+  }
+#else
+  this->isa = ISA_SCALAR;
+#endif
+}
+}  // namespace rendering
+}  // namespace gazebo
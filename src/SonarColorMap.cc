@@ -0,0 +1,150 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+
+#include "gazebo/common/Assert.hh"
+#include "forward_looking_sonar_gazebo/SonarColorMap.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+
+//////////////////////////////////////////////////
+SonarColorMap::SonarColorMap()
+  : colorMap(cv::COLORMAP_WINTER),
+    gain(1.0),
+    gamma(1.0)
+{
+  this->UpdateTable();
+}
+
+//////////////////////////////////////////////////
+bool SonarColorMap::SetColorMap(const std::string &_name)
+{
+  static const std::map<std::string, int> colorMaps = {
+    {"autumn", cv::COLORMAP_AUTUMN}, {"bone", cv::COLORMAP_BONE},
+    {"jet", cv::COLORMAP_JET}, {"winter", cv::COLORMAP_WINTER},
+    {"rainbow", cv::COLORMAP_RAINBOW}, {"ocean", cv::COLORMAP_OCEAN},
+    {"summer", cv::COLORMAP_SUMMER}, {"spring", cv::COLORMAP_SPRING},
+    {"cool", cv::COLORMAP_COOL}, {"hsv", cv::COLORMAP_HSV},
+    {"pink", cv::COLORMAP_PINK}, {"hot", cv::COLORMAP_HOT},
+    {"gray", -1}};
+
+  auto colorMap = colorMaps.find(_name);
+  if (colorMap == colorMaps.end())
+    return false;
+
+  this->colorMap = colorMap->second;
+  this->UpdateTable();
+  return true;
+}
+
+//////////////////////////////////////////////////
+void SonarColorMap::SetGain(const double _gain)
+{
+  this->gain = _gain;
+  this->UpdateTable();
+}
+
+//////////////////////////////////////////////////
+void SonarColorMap::SetGamma(const double _gamma)
+{
+  this->gamma = _gamma;
+  this->UpdateTable();
+}
+
+//////////////////////////////////////////////////
+void SonarColorMap::UpdateTable()
+{
+  // Gray level of each entry, quantized like convertTo(CV_8U, 255)
+  cv::Mat levels(1, kTableSize, CV_8UC1);
+  for (int i = 0; i < kTableSize; ++i)
+  {
+    double value = std::min(std::max(this->gain * i / (kTableSize - 1), 0.0), 1.0);
+    levels.at<uchar>(i) = cv::saturate_cast<uchar>(std::pow(value, this->gamma) * 255);
+  }
+  this->grayTable.assign(levels.ptr<uchar>(), levels.ptr<uchar>() + kTableSize);
+
+  cv::Mat colors;
+  if (this->colorMap < 0)
+    cv::cvtColor(levels, colors, cv::COLOR_GRAY2BGR);
+  else
+    cv::applyColorMap(levels, colors, this->colorMap);
+  this->colorTable.assign(colors.ptr<cv::Vec3b>(), colors.ptr<cv::Vec3b>() + kTableSize);
+}
+
+//////////////////////////////////////////////////
+void SonarColorMap::UpdateSpans(const cv::Mat &_mask)
+{
+  // The fan is convex, so it covers a single span of each row
+  this->spanBegin.assign(_mask.rows, 0);
+  this->spanEnd.assign(_mask.rows, 0);
+  for (int row = 0; row < _mask.rows; ++row)
+  {
+    const uchar *mask = _mask.ptr<uchar>(row);
+    int begin = 0;
+    while (begin < _mask.cols && !mask[begin])
+      begin++;
+    int end = _mask.cols;
+    while (end > begin && !mask[end - 1])
+      end--;
+    this->spanBegin[row] = begin;
+    this->spanEnd[row] = end;
+  }
+  this->spanMask = _mask;
+}
+
+//////////////////////////////////////////////////
+void SonarColorMap::Apply(const cv::Mat &_image, const cv::Mat &_mask, cv::Mat &_output)
+{
+  GZ_ASSERT(_image.type() == CV_32FC1 && _mask.type() == CV_8UC1 &&
+            _image.size() == _mask.size(), "Sonar image and mask expected");
+  GZ_ASSERT(_output.size() == _image.size() &&
+            (_output.type() == CV_8UC3 || _output.type() == CV_8UC1),
+            "8 bit output of the sonar image size expected");
+
+  // The mask only changes with the sonar geometry
+  if (this->spanMask.data != _mask.data || this->spanMask.size() != _mask.size())
+    this->UpdateSpans(_mask);
+
+  const float scale = kTableSize - 1;
+  const int channels = _output.channels();
+  for (int row = 0; row < _image.rows; ++row)
+  {
+    const float *pixels = _image.ptr<float>(row);
+    const uchar *mask = _mask.ptr<uchar>(row);
+    uchar *output = _output.ptr<uchar>(row);
+    const int begin = this->spanBegin[row];
+    const int end = this->spanEnd[row];
+
+    std::memset(output, 0, begin * channels);
+    std::memset(output + end * channels, 0, (_image.cols - end) * channels);
+
+    for (int col = begin; col < end; ++col)
+    {
+      // Negative noise and NaNs go to the first entry
+      float value = pixels[col];
+      int index = value > 0 ? static_cast<int>(std::min(value, 1.0f) * scale + 0.5f) : 0;
+      if (!mask[col])
+        index = -1;
+
+      if (channels == 3)
+      {
+        cv::Vec3b color = index < 0 ? cv::Vec3b(0, 0, 0) : this->colorTable[index];
+        output[3 * col] = color[0];
+        output[3 * col + 1] = color[1];
+        output[3 * col + 2] = color[2];
+      }
+      else
+      {
+        output[col] = index < 0 ? 0 : this->grayTable[index];
+      }
+    }
+  }
+}
+}  // namespace rendering
+}  // namespace gazebo
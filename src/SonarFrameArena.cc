@@ -0,0 +1,43 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include "forward_looking_sonar_gazebo/SonarFrameArena.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+
+//////////////////////////////////////////////////
+SonarFrameArena::SonarFrameArena()
+  : allocations(0)
+{
+}
+
+//////////////////////////////////////////////////
+void SonarFrameArena::Fit(std::vector<float> &_buffer, const size_t _size)
+{
+  if (_size > _buffer.capacity())
+    this->allocations.fetch_add(1, std::memory_order_relaxed);
+  _buffer.resize(_size);
+}
+
+//////////////////////////////////////////////////
+void SonarFrameArena::Fit(cv::Mat &_image, const int _rows, const int _cols,
+                          const int _type)
+{
+  if (_image.rows == _rows && _image.cols == _cols &&
+      _image.type() == _type && _image.isContinuous())
+    return;
+
+  _image.release();
+  _image.create(_rows, _cols, _type);
+  this->allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////
+uint64_t SonarFrameArena::AllocationCount() const
+{
+  return this->allocations.load(std::memory_order_relaxed);
+}
+}  // namespace rendering
+}  // namespace gazebo
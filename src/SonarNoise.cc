@@ -0,0 +1,174 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+#include <cmath>
+
+#include "forward_looking_sonar_gazebo/SonarNoise.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+namespace
+{
+/// \brief Scale of the 24 bit uniform variables
+const float kUniformScale = 1.0f / 16777216.0f;
+
+/// \brief Flag of the speckle stream in the last counter word
+const uint32_t kSpeckleStream = 0x80000000u;
+
+//////////////////////////////////////////////////
+/// \brief Uniform variable in (0, 1]
+float UniformOpen(const uint32_t _bits)
+{
+  return ((_bits >> 8) + 1) * kUniformScale;
+}
+
+//////////////////////////////////////////////////
+/// \brief Uniform variable in [0, 1)
+float Uniform(const uint32_t _bits)
+{
+  return (_bits >> 8) * kUniformScale;
+}
+
+//////////////////////////////////////////////////
+/// \brief High and low words of a 32 x 32 bit product
+void MulHiLo(const uint32_t _a, const uint32_t _b, uint32_t &_hi, uint32_t &_lo)
+{
+  uint64_t product = static_cast<uint64_t>(_a) * _b;
+  _hi = static_cast<uint32_t>(product >> 32);
+  _lo = static_cast<uint32_t>(product);
+}
+}  // namespace
+
+//////////////////////////////////////////////////
+SonarNoise::SonarNoise()
+  : seed(0),
+    stdDev(0.25),
+    bSpeckle(false)
+{
+}
+
+//////////////////////////////////////////////////
+uint64_t SonarNoise::Seed() const
+{
+  return this->seed;
+}
+
+//////////////////////////////////////////////////
+void SonarNoise::SetSeed(const uint64_t _seed)
+{
+  this->seed = _seed;
+}
+
+//////////////////////////////////////////////////
+uint64_t SonarNoise::NameSeed(const std::string &_name)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : _name)
+  {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+//////////////////////////////////////////////////
+float SonarNoise::StdDev() const
+{
+  return this->stdDev;
+}
+
+//////////////////////////////////////////////////
+void SonarNoise::SetStdDev(const float _stdDev)
+{
+  this->stdDev = std::max(_stdDev, 0.0f);
+}
+
+//////////////////////////////////////////////////
+bool SonarNoise::Speckle() const
+{
+  return this->bSpeckle;
+}
+
+//////////////////////////////////////////////////
+void SonarNoise::SetSpeckle(const bool _speckle)
+{
+  this->bSpeckle = _speckle;
+}
+
+//////////////////////////////////////////////////
+void SonarNoise::Philox(const uint32_t _counter[4], const uint32_t _key[2], uint32_t _output[4])
+{
+  uint32_t c0 = _counter[0], c1 = _counter[1], c2 = _counter[2], c3 = _counter[3];
+  uint32_t k0 = _key[0], k1 = _key[1];
+  for (int round = 0; round < 10; ++round)
+  {
+    uint32_t hi0, lo0, hi1, lo1;
+    MulHiLo(0xD2511F53u, c0, hi0, lo0);
+    MulHiLo(0xCD9E8D57u, c2, hi1, lo1);
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  _output[0] = c0;
+  _output[1] = c1;
+  _output[2] = c2;
+  _output[3] = c3;
+}
+
+//////////////////////////////////////////////////
+void SonarNoise::Apply(const uint64_t _frame, const int _beam, const float *_means,
+                       const float *_gains, const int _count, float *_output) const
+{
+  const uint32_t key[2] = {static_cast<uint32_t>(this->seed),
+                           static_cast<uint32_t>(this->seed >> 32)};
+  const bool gaussian = this->stdDev > 0;
+  const float twoPi = 2 * M_PI;
+  const float speckleScale = -4 / M_PI;
+
+  // Four bins per counter, the speckle stream is told apart by the top bit
+  // of the frame word
+  uint32_t counter[4] = {0, static_cast<uint32_t>(_beam), static_cast<uint32_t>(_frame),
+                         static_cast<uint32_t>(_frame >> 32) & ~kSpeckleStream};
+  for (int block = 0; block < _count; block += 4)
+  {
+    counter[0] = block / 4;
+    const int size = std::min(_count - block, 4);
+
+    float noise[4] = {0, 0, 0, 0};
+    if (gaussian)
+    {
+      // Box-Muller, both outputs of each pair are used
+      uint32_t bits[4];
+      counter[3] &= ~kSpeckleStream;
+      Philox(counter, key, bits);
+      for (int k = 0; k < 4; k += 2)
+      {
+        float radius = this->stdDev * std::sqrt(-2 * std::log(UniformOpen(bits[k])));
+        float angle = twoPi * Uniform(bits[k + 1]);
+        noise[k] = radius * std::cos(angle);
+        noise[k + 1] = radius * std::sin(angle);
+      }
+    }
+
+    float speckle[4] = {1, 1, 1, 1};
+    if (this->bSpeckle)
+    {
+      // Rayleigh of sigma sqrt(2 / pi), so the mean echo is kept
+      uint32_t bits[4];
+      counter[3] |= kSpeckleStream;
+      Philox(counter, key, bits);
+      for (int k = 0; k < 4; ++k)
+        speckle[k] = std::sqrt(speckleScale * std::log(UniformOpen(bits[k])));
+    }
+
+    for (int k = 0; k < size; ++k)
+      _output[block + k] = _means[block + k] * _gains[block + k] * speckle[k] + noise[k];
+  }
+}
+}  // namespace rendering
+}  // namespace gazebo
@@ -0,0 +1,170 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include "gazebo/common/Assert.hh"
+#include "gazebo/common/Console.hh"
+#include "forward_looking_sonar_gazebo/SonarPipeline.hh"
+
+namespace gazebo
+{
+
+//////////////////////////////////////////////////
+SonarPipeline::SonarPipeline(const size_t _depth, const DropPolicy _policy,
+                             const ProcessCallback &_callback)
+  : slots(_depth + 1),
+    depth(_depth),
+    fillingSlot(0),
+    policy(_policy),
+    callback(_callback),
+    running(false),
+    dropped(0)
+{
+  GZ_ASSERT(_depth > 0, "Sonar pipeline depth must be positive");
+
+  for (size_t i = 0; i < this->slots.size(); ++i)
+    this->freeSlots.push_back(i);
+}
+
+//////////////////////////////////////////////////
+SonarPipeline::~SonarPipeline()
+{
+  this->Stop();
+}
+
+//////////////////////////////////////////////////
+void SonarPipeline::Start()
+{
+  if (this->running)
+    return;
+
+  this->running = true;
+  this->worker = std::thread(&SonarPipeline::Run, this);
+}
+
+//////////////////////////////////////////////////
+void SonarPipeline::Stop()
+{
+  if (!this->running)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(this->slotMutex);
+    this->running = false;
+  }
+  this->slotCondition.notify_all();
+
+  if (this->worker.joinable())
+    this->worker.join();
+}
+
+//////////////////////////////////////////////////
+SonarFrame *SonarPipeline::Acquire()
+{
+  std::unique_lock<std::mutex> lock(this->slotMutex);
+  auto full = [this]
+  {
+    return this->freeSlots.empty() || this->queuedSlots.size() >= this->depth;
+  };
+
+  if (this->policy == BLOCK)
+  {
+    this->slotCondition.wait(lock, [this, &full]
+    {
+      return !this->running || !full();
+    });
+  }
+
+  if (!full())
+  {
+    this->fillingSlot = this->freeSlots.back();
+    this->freeSlots.pop_back();
+  }
+  else if (this->policy == DROP_OLDEST && !this->queuedSlots.empty())
+  {
+    // The worker has not started the oldest queued frame, overwrite it
+    this->fillingSlot = this->queuedSlots.front();
+    this->queuedSlots.pop_front();
+    this->dropped++;
+  }
+  else
+  {
+    this->dropped++;
+    return nullptr;
+  }
+
+  return &this->slots[this->fillingSlot];
+}
+
+//////////////////////////////////////////////////
+void SonarPipeline::Commit()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->slotMutex);
+    this->queuedSlots.push_back(this->fillingSlot);
+  }
+  this->slotCondition.notify_all();
+}
+
+//////////////////////////////////////////////////
+uint64_t SonarPipeline::DroppedFrames() const
+{
+  return this->dropped;
+}
+
+//////////////////////////////////////////////////
+bool SonarPipeline::ParseDropPolicy(const std::string &_name,
+                                    DropPolicy &_policy)
+{
+  if (_name == "drop_newest")
+    _policy = DROP_NEWEST;
+  else if (_name == "drop_oldest")
+    _policy = DROP_OLDEST;
+  else if (_name == "block")
+    _policy = BLOCK;
+  else
+    return false;
+
+  return true;
+}
+
+//////////////////////////////////////////////////
+void SonarPipeline::Run()
+{
+  while (true)
+  {
+    size_t slot;
+    {
+      std::unique_lock<std::mutex> lock(this->slotMutex);
+      this->slotCondition.wait(lock, [this]
+      {
+        return !this->running || !this->queuedSlots.empty();
+      });
+
+      if (!this->running)
+        break;
+
+      if (this->policy == DROP_OLDEST)
+      {
+        while (this->queuedSlots.size() > 1)
+        {
+          this->freeSlots.push_back(this->queuedSlots.front());
+          this->queuedSlots.pop_front();
+          this->dropped++;
+        }
+      }
+
+      slot = this->queuedSlots.front();
+      this->queuedSlots.pop_front();
+    }
+
+    // The producer never touches a slot out of the queue, so the frame is
+    // processed without the lock
+    this->callback(this->slots[slot]);
+
+    {
+      std::lock_guard<std::mutex> lock(this->slotMutex);
+      this->freeSlots.push_back(slot);
+    }
+    this->slotCondition.notify_all();
+  }
+}
+}  // namespace gazebo
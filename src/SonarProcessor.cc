@@ -0,0 +1,1150 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include <ignition/math/Helpers.hh>
+
+#include "gazebo/common/Assert.hh"
+#include "gazebo/common/Console.hh"
+#include "gazebo/common/SystemPaths.hh"
+#include "forward_looking_sonar_gazebo/SDFTool.hh"
+#include "forward_looking_sonar_gazebo/SonarProcessor.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+
+//////////////////////////////////////////////////
+SonarProcessor::SonarProcessor()
+  : hfov(0),
+    vfov(0),
+    imageWidth(0),
+    imageHeight(0),
+    fovTileCount(1),
+    outputWidth(0),
+    outputHeight(0),
+    bSonarImageEnabled(true),
+    binCount(0),
+    beamCount(0),
+    maxRange(1),
+    shaderChannels(3),
+    bBinned(false),
+    noiseFrame(0),
+    bTransferTableDirty(true),
+    bAreaBeamSampling(false),
+    bBilinearScanConversion(false),
+    threadPool(new SonarThreadPool(1)),
+    stats(nullptr),
+    focal_length(0)
+{
+}
+
+//////////////////////////////////////////////////
+SonarProcessor::~SonarProcessor()
+{
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::Load(sdf::ElementPtr _sdf, const std::string &_name)
+{
+  GZ_ASSERT(_sdf->Get<double>("vfov"), "Vertical FOV is not set");
+
+  this->SetVertFOV(_sdf->Get<double>("vfov"));
+  this->SetHorzFOV(_sdf->Get<double>("horizontal_fov"));
+
+  this->SetImageWidth(gazebo::SDFTool::GetSDFElement<double>(_sdf, "width", "image"));
+  this->SetImageHeight(gazebo::SDFTool::GetSDFElement<double>(_sdf, "height", "image"));
+
+  // The published sonar image can be sized for the display independently
+  // of the render, or left out to publish the beams only
+  this->SetOutputWidth(0);
+  this->SetOutputHeight(0);
+  this->SetSonarImageEnabled(true);
+  if (_sdf->HasElement("sonar_image"))
+  {
+    sdf::ElementPtr sonarImageSdf = _sdf->GetElement("sonar_image");
+    if (sonarImageSdf->HasElement("width"))
+      this->SetOutputWidth(std::max(sonarImageSdf->Get<int>("width"), 0));
+    if (sonarImageSdf->HasElement("height"))
+      this->SetOutputHeight(std::max(sonarImageSdf->Get<int>("height"), 0));
+    if (sonarImageSdf->HasElement("publish"))
+      this->SetSonarImageEnabled(sonarImageSdf->Get<bool>("publish"));
+  }
+
+  this->SetBinCount(gazebo::SDFTool::GetSDFElement<double>(_sdf, "bin_count"));
+  this->SetBeamCount(gazebo::SDFTool::GetSDFElement<double>(_sdf, "beam_count"));
+
+  this->SetFovTileCount(1);
+
+  // The two channel image formats hold (intensity, depth)
+  if (_sdf->HasElement("image"))
+  {
+    sdf::ElementPtr imageSdf = _sdf->GetElement("image");
+    if (imageSdf->HasElement("format"))
+    {
+      std::string format = imageSdf->Get<std::string>("format");
+      if (format == "R32G32" || format == "R16G16")
+        this->SetShaderChannels(2);
+    }
+
+    // The horizontal field of view can be split between several narrower
+    // cameras, rendered one after the other into a texture of one tile
+    if (imageSdf->HasElement("fov_tiles"))
+    {
+      int tiles = imageSdf->Get<int>("fov_tiles");
+      if (tiles < 1 || this->imageWidth % tiles != 0)
+        gzerr << "Sonar fov_tiles [" << tiles << "] must divide the image width ["
+              << this->imageWidth << "], using 1" << std::endl;
+      else
+        this->SetFovTileCount(tiles);
+    }
+  }
+
+  // Workers for the beam loops. By default every sonar shares one pool of
+  // the hardware concurrency, so several sonars do not oversubscribe the
+  // cores with a pool each.
+  int threads = 0;
+  if (_sdf->HasElement("threads"))
+    threads = std::max(_sdf->Get<int>("threads"), 1);
+  this->SetThreadCount(threads);
+
+  gzmsg << "Sonar binning kernel: "
+        << SonarBinKernel::IsaName(this->binKernel.ActiveIsa())
+        << ", " << this->threadPool->Size() << " threads" << std::endl;
+
+  // Columns sampled for each beam: "linear" interpolates between the two
+  // columns around the beam center, "area" integrates every column the beam
+  // covers
+  this->bAreaBeamSampling = false;
+  if (_sdf->HasElement("beam_sampling"))
+  {
+    std::string beamSampling = _sdf->Get<std::string>("beam_sampling");
+    if (beamSampling == "area")
+      this->bAreaBeamSampling = true;
+    else if (beamSampling != "linear")
+      gzerr << "Unknown beam_sampling [" << beamSampling << "], using linear" << std::endl;
+  }
+
+  // Sonar image pixels take the "nearest" (beam, bin) cell, or "bilinear"
+  // interpolate the four cells around them, which stays smooth at long range
+  // with fewer beams and bins
+  this->bBilinearScanConversion = false;
+  if (_sdf->HasElement("scan_conversion"))
+  {
+    std::string scanConversion = _sdf->Get<std::string>("scan_conversion");
+    if (scanConversion == "bilinear")
+      this->bBilinearScanConversion = true;
+    else if (scanConversion != "nearest")
+      gzerr << "Unknown scan_conversion [" << scanConversion << "], using nearest" << std::endl;
+  }
+
+  // Time varying gain of the echoes: a "polynomial" of the normalized
+  // range, the "spreading" and absorption losses, or a "csv" curve of
+  // (range, gain) points, evaluated once into a table of the bins
+  this->SetMaxRange(1);
+  if (_sdf->HasElement("clip") && _sdf->GetElement("clip")->HasElement("far"))
+    this->SetMaxRange(_sdf->GetElement("clip")->Get<double>("far"));
+  SonarRangeGain rangeGain;
+  if (_sdf->HasElement("range_gain"))
+  {
+    sdf::ElementPtr gainSdf = _sdf->GetElement("range_gain");
+    SonarRangeGain::Type gainType = SonarRangeGain::POLYNOMIAL;
+    if (gainSdf->HasElement("type"))
+    {
+      std::string type = gainSdf->Get<std::string>("type");
+      if (!SonarRangeGain::ParseType(type, gainType))
+        gzerr << "Unknown range_gain type [" << type << "], using polynomial" << std::endl;
+    }
+
+    if (gainType == SonarRangeGain::POLYNOMIAL && gainSdf->HasElement("coefficients"))
+    {
+      std::istringstream stream(gainSdf->Get<std::string>("coefficients"));
+      std::vector<double> coefficients;
+      double coefficient;
+      while (stream >> coefficient)
+        coefficients.push_back(coefficient);
+      rangeGain.SetPolynomial(coefficients);
+    }
+    else if (gainType == SonarRangeGain::SPREADING)
+    {
+      double scale = 1, exponent = 2, attenuation = 0;
+      if (gainSdf->HasElement("scale"))
+        scale = gainSdf->Get<double>("scale");
+      if (gainSdf->HasElement("exponent"))
+        exponent = gainSdf->Get<double>("exponent");
+      if (gainSdf->HasElement("attenuation_coeff"))
+        attenuation = gainSdf->Get<double>("attenuation_coeff");
+      rangeGain.SetSpreading(scale, exponent, attenuation);
+    }
+    else if (gainType == SonarRangeGain::CURVE)
+    {
+      std::string file = gainSdf->HasElement("file") ? gainSdf->Get<std::string>("file") : "";
+      std::string path = common::SystemPaths::Instance()->FindFile(file);
+      std::vector<double> ranges, gains;
+      if (!SonarRangeGain::ReadCsv(path, ranges, gains) || !rangeGain.SetCurve(ranges, gains))
+        gzerr << "Cannot read the range_gain curve [" << file << "], using polynomial" << std::endl;
+    }
+  }
+  this->SetRangeGain(rangeGain);
+
+  // Additive Gaussian noise and multiplicative speckle, from a per sonar
+  // seed so runs can be replayed. The name keeps sonars without a seed
+  // from drawing the same noise.
+  this->noise = SonarNoise();
+  this->noise.SetSeed(SonarNoise::NameSeed(_name));
+  this->noiseFrame = 0;
+  if (_sdf->HasElement("noise"))
+  {
+    sdf::ElementPtr noiseSdf = _sdf->GetElement("noise");
+    if (noiseSdf->HasElement("stddev"))
+      this->noise.SetStdDev(noiseSdf->Get<double>("stddev"));
+    if (noiseSdf->HasElement("speckle"))
+      this->noise.SetSpeckle(noiseSdf->Get<bool>("speckle"));
+    if (noiseSdf->HasElement("seed"))
+      this->noise.SetSeed(noiseSdf->Get<uint64_t>("seed"));
+  }
+
+  // Point spread of the echoes over the bins, in beams and bins. The
+  // "box" kernel approximates the Gaussian at a cost independent of its
+  // size, for large grids and wide kernels.
+  this->psf = SonarPsf();
+  if (_sdf->HasElement("psf"))
+  {
+    sdf::ElementPtr psfSdf = _sdf->GetElement("psf");
+    int beamWidth = 11;
+    int binWidth = 9;
+    if (psfSdf->HasElement("beam_width"))
+      beamWidth = psfSdf->Get<int>("beam_width");
+    if (psfSdf->HasElement("bin_width"))
+      binWidth = psfSdf->Get<int>("bin_width");
+    if (beamWidth < 1 || binWidth < 1 || beamWidth % 2 == 0 || binWidth % 2 == 0)
+    {
+      gzerr << "Sonar psf widths [" << beamWidth << ", " << binWidth
+            << "] must be odd and positive, using [11, 9]" << std::endl;
+      beamWidth = 11;
+      binWidth = 9;
+    }
+    this->psf.SetKernel(beamWidth, binWidth);
+
+    if (psfSdf->HasElement("mode"))
+    {
+      std::string mode = psfSdf->Get<std::string>("mode");
+      SonarPsf::Mode psfMode = SonarPsf::GAUSSIAN;
+      if (!SonarPsf::ParseMode(mode, psfMode))
+        gzerr << "Unknown psf mode [" << mode << "], using gaussian" << std::endl;
+      this->psf.SetMode(psfMode);
+    }
+  }
+
+  // The transfer and beam gather tables only depend on the sonar geometry,
+  // build them once here
+  this->UpdateTransferTable();
+}
+
+//////////////////////////////////////////////////
+double SonarProcessor::HorzFOV() const
+{
+  return this->hfov;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetHorzFOV(const double _hfov)
+{
+  this->hfov = _hfov;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+double SonarProcessor::VertFOV() const
+{
+  return this->vfov;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetVertFOV(const double _vfov)
+{
+  this->vfov = _vfov;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::ImageWidth() const
+{
+  return this->imageWidth;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetImageWidth(const int _value)
+{
+  this->imageWidth = _value;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::ImageHeight() const
+{
+  return this->imageHeight;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetImageHeight(const int _value)
+{
+  this->imageHeight = _value;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::FovTileCount() const
+{
+  return this->fovTileCount;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetFovTileCount(const int _value)
+{
+  this->fovTileCount = std::max(_value, 1);
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::FovTileWidth() const
+{
+  return this->imageWidth / this->fovTileCount;
+}
+
+//////////////////////////////////////////////////
+double SonarProcessor::FovTileYaw(const int _tile) const
+{
+  return this->HorzFOV() * (-1.0 / 2 + (_tile + 0.5) / this->fovTileCount);
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::OutputWidth() const
+{
+  return this->outputWidth > 0 ? this->outputWidth : this->imageWidth;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetOutputWidth(const int _value)
+{
+  this->outputWidth = _value;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::OutputHeight() const
+{
+  return this->outputHeight > 0 ? this->outputHeight : this->imageHeight;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetOutputHeight(const int _value)
+{
+  this->outputHeight = _value;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+bool SonarProcessor::SonarImageEnabled() const
+{
+  return this->bSonarImageEnabled;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetSonarImageEnabled(const bool _enabled)
+{
+  this->bSonarImageEnabled = _enabled;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::BinCount() const
+{
+  return this->binCount;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetBinCount(const int _value)
+{
+  this->binCount = _value;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+double SonarProcessor::MaxRange() const
+{
+  return this->maxRange;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetMaxRange(const double _range)
+{
+  this->maxRange = _range;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+const SonarRangeGain &SonarProcessor::RangeGain() const
+{
+  return this->rangeGainModel;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetRangeGain(const SonarRangeGain &_rangeGain)
+{
+  this->rangeGainModel = _rangeGain;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::BeamCount() const
+{
+  return this->beamCount;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetBeamCount(const int _value)
+{
+  this->beamCount = _value;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+int SonarProcessor::ShaderChannels() const
+{
+  return this->shaderChannels;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetShaderChannels(const int _channels)
+{
+  GZ_ASSERT(_channels == 2 || _channels == 3, "Shader images have 2 or 3 channels");
+  this->shaderChannels = _channels;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::FitShaderImage(cv::Mat &_image)
+{
+  this->arena.Fit(_image, this->imageHeight, this->imageWidth, CV_32FC(this->shaderChannels));
+}
+
+//////////////////////////////////////////////////
+cv::Mat &SonarProcessor::ShaderBuffer()
+{
+  this->FitShaderImage(this->rawImage);
+  return this->rawImage;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::Bin()
+{
+  this->UpdateTransferTable();
+  this->arena.Fit(this->accumData, this->binCount * this->beamCount);
+  this->CvToSonarBin(this->accumData);
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::Bin(const cv::Mat &_image)
+{
+  // Shares the frame data instead of copying it, until the owner of the
+  // frame detaches it
+  this->rawImage = _image;
+  this->Bin();
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::DetachShaderImage(const bool _copy)
+{
+  if (this->rawImage.empty() || this->rawImage.data == this->shaderCopy.data)
+    return;
+
+  if (_copy)
+  {
+    this->rawImage.copyTo(this->shaderCopy);
+    this->rawImage = this->shaderCopy;
+  }
+  else
+  {
+    this->rawImage.release();
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::FitBinCounts(cv::Mat &_counts)
+{
+  this->arena.Fit(_counts, this->beamCount, this->binCount, CV_32FC3);
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::FitTileImage(cv::Mat &_image)
+{
+  this->arena.Fit(_image, this->imageHeight, this->FovTileWidth(), CV_32FC(this->shaderChannels));
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::BinTile(const cv::Mat &_image, const int _tile, cv::Mat &_counts)
+{
+  this->UpdateTransferTable();
+  GZ_ASSERT(_tile >= 0 && _tile < this->fovTileCount, "Field of view tile out of range");
+  GZ_ASSERT(_counts.type() == CV_32FC3 && _counts.rows == this->beamCount &&
+            _counts.cols == this->binCount, "Bin counts of the sonar geometry expected");
+
+  // Same channels as the whole shader image, see CvToSonarBin
+  const int samples = _image.rows;
+  const int binCount = this->binCount;
+  const int channels = _image.channels();
+  const int intensityChannel = channels == 3 ? 2 : 0;
+  const int depthChannel = 1;
+  const int lastColumn = _image.cols - 1;
+  const int firstColumn = _tile * this->FovTileWidth();
+  const int workers = this->threadPool->Size();
+  this->arena.Fit(this->tileDepth, workers * samples);
+  this->arena.Fit(this->tileIntensity, workers * samples);
+  this->arena.Fit(this->tileBinCounts, workers * binCount);
+  this->arena.Fit(this->tileBinSums, workers * binCount);
+
+  const int beamBegin = this->tileBeamBegin[_tile];
+  this->threadPool->ParallelFor(this->tileBeamBegin[_tile + 1] - beamBegin,
+    [&](size_t _begin, size_t _end, size_t _worker)
+  {
+    float *depth = &this->tileDepth[_worker * samples];
+    float *intensity = &this->tileIntensity[_worker * samples];
+    float *counts = &this->tileBinCounts[_worker * binCount];
+    float *sums = &this->tileBinSums[_worker * binCount];
+    for (size_t i = _begin; i < _end; i++)
+    {
+      const int i_beam = beamBegin + i;
+      std::fill(counts, counts + binCount, 0.0f);
+      std::fill(sums, sums + binCount, 0.0f);
+      if (this->bAreaBeamSampling)
+      {
+        int begin = ignition::math::clamp(this->beamColumnBegin[i_beam] - firstColumn, 0, lastColumn);
+        int end = ignition::math::clamp(this->beamColumnEnd[i_beam] - firstColumn,
+                                        begin + 1, lastColumn + 1);
+        for (int column = begin; column < end; column++)
+        {
+          for (int row = 0; row < samples; row++)
+          {
+            const float *pixel = _image.ptr<float>(row) + column * channels;
+            intensity[row] = pixel[intensityChannel];
+            depth[row] = pixel[depthChannel];
+          }
+          this->binKernel.Accumulate(depth, intensity, samples, binCount, counts, sums);
+        }
+      }
+      else
+      {
+        int column0 = ignition::math::clamp(this->beamColumn0[i_beam] - firstColumn, 0, lastColumn);
+        int column1 = ignition::math::clamp(this->beamColumn1[i_beam] - firstColumn, 0, lastColumn);
+        const float w = this->beamWeight[i_beam];
+        for (int row = 0; row < samples; row++)
+        {
+          const float *p0 = _image.ptr<float>(row) + column0 * channels;
+          const float *p1 = _image.ptr<float>(row) + column1 * channels;
+          intensity[row] = p0[intensityChannel] + (p1[intensityChannel] - p0[intensityChannel]) * w;
+          depth[row] = p0[depthChannel] + (p1[depthChannel] - p0[depthChannel]) * w;
+        }
+        this->binKernel.Accumulate(depth, intensity, samples, binCount, counts, sums);
+      }
+
+      cv::Vec3f *beamCounts = _counts.ptr<cv::Vec3f>(i_beam);
+      for (int bin = 0; bin < binCount; ++bin)
+        beamCounts[bin] = cv::Vec3f(sums[bin], counts[bin], 0.0f);
+    }
+  });
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::BinCounts(const cv::Mat &_counts)
+{
+  GZ_ASSERT(_counts.type() == CV_32FC3 && _counts.rows == this->beamCount &&
+            _counts.cols == this->binCount, "Bin counts of the sonar geometry expected");
+
+  this->UpdateTransferTable();
+  this->arena.Fit(this->accumData, this->binCount * this->beamCount);
+
+  std::chrono::steady_clock::time_point start;
+  if (this->stats)
+    start = std::chrono::steady_clock::now();
+
+  this->arena.Fit(this->noisyImage, this->beamCount, this->binCount, CV_32FC1);
+
+  // Only the means are left of the binning, the histogram was built on
+  // the GPU
+  this->arena.Fit(this->beamMeans, this->beamCount * this->binCount);
+  for (int i_beam = 0; i_beam < this->beamCount; i_beam++)
+  {
+    const cv::Vec3f *counts = _counts.ptr<cv::Vec3f>(i_beam);
+    float *means = &this->beamMeans[i_beam * this->binCount];
+    for (int i = 0; i < this->binCount; ++i)
+      means[i] = counts[i][1] > 0.0f ? counts[i][0] / counts[i][1] : 0.0f;
+    this->AddBeamIntensities(i_beam, means);
+  }
+  this->noiseFrame++;
+  this->bBinned = true;
+
+  this->BlurBins(this->accumData);
+
+  if (this->stats)
+    this->stats->Record(SonarStats::NOISE_BLUR, SonarStats::Elapsed(start));
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::ScanConvert()
+{
+  this->UpdateTransferTable();
+  if (!this->bSonarImageEnabled)
+    return;
+
+  SonarStats::ScopedTimer timer(this->stats, SonarStats::POLAR);
+  this->TransferTableToSonar(this->accumData, this->transferTable);
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::Process(const cv::Mat &_image)
+{
+  this->Bin(_image);
+  this->ScanConvert();
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::ProcessBinCounts(const cv::Mat &_counts)
+{
+  this->BinCounts(_counts);
+  this->ScanConvert();
+}
+
+//////////////////////////////////////////////////
+bool SonarProcessor::Rebin()
+{
+  // The means are only valid for the geometry they were binned with
+  this->UpdateTransferTable();
+  if (!this->bBinned)
+    return false;
+
+  this->arena.Fit(this->accumData, this->binCount * this->beamCount);
+
+  std::chrono::steady_clock::time_point start;
+  if (this->stats)
+    start = std::chrono::steady_clock::now();
+
+  this->threadPool->ParallelFor(this->beamCount,
+    [&](size_t _begin, size_t _end, size_t /*_worker*/)
+  {
+    for (size_t i_beam = _begin; i_beam < _end; i_beam++)
+      this->AddBeamIntensities(i_beam, &this->beamMeans[i_beam * this->binCount]);
+  });
+  this->noiseFrame++;
+
+  this->BlurBins(this->accumData);
+
+  if (this->stats)
+    this->stats->Record(SonarStats::NOISE_BLUR, SonarStats::Elapsed(start));
+  return true;
+}
+
+//////////////////////////////////////////////////
+bool SonarProcessor::Reprocess()
+{
+  if (!this->Rebin())
+    return false;
+  this->ScanConvert();
+  return true;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::BeamColumns(std::vector<BeamColumn> &_columns) const
+{
+  _columns.clear();
+  for (int i_beam = 0; i_beam < this->beamCount; i_beam++)
+  {
+    if (!this->bAreaBeamSampling)
+    {
+      _columns.push_back({i_beam, this->beamColumn0[i_beam], this->beamColumn1[i_beam],
+                          this->beamWeight[i_beam]});
+      continue;
+    }
+
+    for (int column = this->beamColumnBegin[i_beam]; column < this->beamColumnEnd[i_beam]; column++)
+      _columns.push_back({i_beam, column, column, 0.0f});
+  }
+}
+
+//////////////////////////////////////////////////
+cv::Mat SonarProcessor::ShaderImage() const
+{
+  // Always (intensity, depth, 0), whatever the texture format
+  cv::Mat shaderImage;
+  if (this->rawImage.empty())
+    return shaderImage;
+
+  if (this->rawImage.channels() == 3)
+  {
+    cv::cvtColor(this->rawImage, shaderImage, cv::COLOR_RGB2BGR);
+  }
+  else
+  {
+    shaderImage.create(this->rawImage.rows, this->rawImage.cols, CV_32FC3);
+    shaderImage.setTo(cv::Scalar::all(0));
+    int fromTo[] = {0, 0, 1, 1};
+    cv::mixChannels(&this->rawImage, 1, &shaderImage, 1, fromTo, 2);
+  }
+  return shaderImage;
+}
+
+//////////////////////////////////////////////////
+cv::Mat SonarProcessor::SonarImage() const
+{
+  return this->sonarImage;
+}
+
+//////////////////////////////////////////////////
+cv::Mat SonarProcessor::SonarMask() const
+{
+  return this->sonarImageMask;
+}
+
+//////////////////////////////////////////////////
+const std::vector<float> &SonarProcessor::AccumData() const
+{
+  return this->accumData;
+}
+
+//////////////////////////////////////////////////
+sonar_msgs::SonarStamped SonarProcessor::SonarRosMsg(const common::Time &_stamp) const
+{
+  sonar_msgs::SonarStamped sonarOutput;
+  sonarOutput.header.stamp.sec = _stamp.sec;
+  sonarOutput.header.stamp.nsec = _stamp.nsec;
+  sonarOutput.num_bins = this->binCount;
+  sonarOutput.num_beams = this->beamCount;
+  sonarOutput.beams_width = this->HorzFOV();
+  sonarOutput.beam_height = this->VertFOV();
+  sonarOutput.bearings = 0;
+  sonarOutput.data = this->accumData;
+
+  return sonarOutput;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::FillSonarRosMsg(sonar_msgs::SonarStamped &_msg,
+                                     const common::Time &_stamp)
+{
+  _msg.header.stamp.sec = _stamp.sec;
+  _msg.header.stamp.nsec = _stamp.nsec;
+  _msg.num_bins = this->binCount;
+  _msg.num_beams = this->beamCount;
+  _msg.beams_width = this->HorzFOV();
+  _msg.beam_height = this->VertFOV();
+  _msg.bearings = 0;
+
+  // The msg buffer of a reused message already has the frame size
+  std::swap(_msg.data, this->accumData);
+  this->arena.Fit(this->accumData, this->binCount * this->beamCount);
+}
+
+//////////////////////////////////////////////////
+uint64_t SonarProcessor::AllocationCount() const
+{
+  return this->arena.AllocationCount();
+}
+
+//////////////////////////////////////////////////
+SonarThreadPool &SonarProcessor::ThreadPool()
+{
+  return *this->threadPool;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetThreadCount(const int _threads)
+{
+  if (_threads > 0)
+    this->threadPool.reset(new SonarThreadPool(_threads));
+  else
+    this->threadPool = SonarThreadPool::Shared();
+
+  // The per worker buffers follow the pool size
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+SonarPsf &SonarProcessor::Psf()
+{
+  return this->psf;
+}
+
+//////////////////////////////////////////////////
+SonarNoise &SonarProcessor::Noise()
+{
+  return this->noise;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetBilinearScanConversion(const bool _bilinear)
+{
+  this->bBilinearScanConversion = _bilinear;
+  this->bTransferTableDirty = true;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::SetStats(SonarStats *_stats)
+{
+  this->stats = _stats;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::UpdateTransferTable()
+{
+  // Without the sonar image only the beam gather table is needed
+  int sonarImageWidth = this->bSonarImageEnabled ? this->OutputWidth() : 0;
+  int sonarImageHeight = this->bSonarImageEnabled ? this->OutputHeight() : 0;
+
+  if (!this->bTransferTableDirty &&
+      this->sonarImage.rows == sonarImageHeight &&
+      this->sonarImage.cols == sonarImageWidth)
+    return;
+
+  // Pixels outside the fan are never written by the transfer table, so they
+  // keep the zero set here for the lifetime of the table
+  this->sonarImage = cv::Mat::zeros(sonarImageHeight, sonarImageWidth, CV_32F);
+  this->sonarImageMask = cv::Mat::zeros(sonarImageHeight, sonarImageWidth, CV_8UC1);
+
+  this->GenerateTransferTable(this->transferTable);
+  this->GenerateBeamGatherTable();
+  this->AllocateFrameBuffers();
+  this->rangeGainModel.Fill(this->binCount, this->maxRange, this->rangeGain.data());
+
+  // The kept means belong to the former geometry
+  this->bBinned = false;
+
+  this->bTransferTableDirty = false;
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::AllocateFrameBuffers()
+{
+  // Sized with the geometry, so the frames themselves do not allocate
+  const int workers = this->threadPool->Size();
+  const int samples = this->imageHeight;
+
+  // A tiled render is binned tile by tile, the whole shader image is only
+  // sampled when given to Bin()
+  if (this->fovTileCount == 1)
+  {
+    this->FitShaderImage(this->rawImage);
+    this->arena.Fit(this->beamDepth, this->beamCount * samples);
+    this->arena.Fit(this->beamIntensity, this->beamCount * samples);
+  }
+  else
+  {
+    this->arena.Fit(this->tileDepth, workers * samples);
+    this->arena.Fit(this->tileIntensity, workers * samples);
+    this->arena.Fit(this->tileBinCounts, workers * this->binCount);
+    this->arena.Fit(this->tileBinSums, workers * this->binCount);
+  }
+  this->arena.Fit(this->sonarBinsDepth, workers * this->binCount);
+  this->arena.Fit(this->beamMeans, this->beamCount * this->binCount);
+  this->arena.Fit(this->workerRemapTime, workers);
+  this->arena.Fit(this->workerBinTime, workers);
+  this->arena.Fit(this->noisyImage, this->beamCount, this->binCount, CV_32FC1);
+  this->arena.Fit(this->rangeGain, this->binCount);
+  this->arena.Fit(this->accumData, this->binCount * this->beamCount);
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::GenerateBeamGatherTable()
+{
+  // Accurate pixels -> beams transformation, taking the sensor plane into
+  // account: beam i spans the columns between beam_start_pixels[i] and
+  // beam_start_pixels[i + 1]. With several field of view tiles each angle
+  // is projected by the camera of its tile.
+  const double tileFov = this->HorzFOV() / this->fovTileCount;
+  const int tileWidth = this->FovTileWidth();
+  this->focal_length = tileWidth / (2 * tan(tileFov / 2));
+  std::vector<int> beam_start_pixels;
+  beam_start_pixels.assign(this->beamCount + 1, 0);
+  for (int i_beam = 0; i_beam <= this->beamCount; i_beam++)
+  {
+    double angle = this->HorzFOV() * (-1.0 / 2 + i_beam * 1.0 / this->beamCount);
+    int tile = ignition::math::clamp(static_cast<int>(floor((angle + this->HorzFOV() / 2) / tileFov)),
+                                     0, this->fovTileCount - 1);
+    beam_start_pixels[i_beam] = floor(
+      focal_length * tan(angle - this->FovTileYaw(tile))
+      + tile * tileWidth + tileWidth / 2
+    );
+  }
+
+  // Each beam is binned from the tile its center lies in
+  this->tileBeamBegin.assign(this->fovTileCount + 1, this->beamCount);
+  int beam = 0;
+  for (int tile = 0; tile < this->fovTileCount; tile++)
+  {
+    while (beam < this->beamCount &&
+           static_cast<int>(floor((beam + 0.5) * this->fovTileCount / this->beamCount)) < tile)
+      beam++;
+    this->tileBeamBegin[tile] = beam;
+  }
+
+  const int lastColumn = std::max(this->imageWidth - 1, 0);
+  this->beamColumn0.resize(this->beamCount);
+  this->beamColumn1.resize(this->beamCount);
+  this->beamWeight.resize(this->beamCount);
+  this->beamColumnBegin.resize(this->beamCount);
+  this->beamColumnEnd.resize(this->beamCount);
+
+  for (int i_beam = 0; i_beam < this->beamCount; i_beam++)
+  {
+    // Same sample as the former cv::remap(INTER_LINEAR) at the approximate
+    // location of the beam, which only ever blended two columns of a row
+    double center = (beam_start_pixels[i_beam + 1] + beam_start_pixels[i_beam]) * 1.0 / 2;
+    int column = static_cast<int>(floor(center));
+    this->beamColumn0[i_beam] = ignition::math::clamp(column, 0, lastColumn);
+    this->beamColumn1[i_beam] = ignition::math::clamp(column + 1, 0, lastColumn);
+    this->beamWeight[i_beam] = static_cast<float>(center - column);
+
+    this->beamColumnBegin[i_beam] = ignition::math::clamp(beam_start_pixels[i_beam], 0, lastColumn);
+    this->beamColumnEnd[i_beam] = ignition::math::clamp(beam_start_pixels[i_beam + 1],
+                                    this->beamColumnBegin[i_beam] + 1, this->imageWidth);
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::CvToSonarBin(std::vector<float> &_accumData)
+{
+  const bool timed = this->stats != nullptr;
+  std::chrono::steady_clock::time_point start;
+
+  // Noise is drawn with the intensities of each beam
+  this->arena.Fit(this->noisyImage, this->beamCount, this->binCount, CV_32FC1);
+
+  // Beams are independent until the blur, so each worker bins its own range
+  // of beams with its own slice of the scratch histograms. Every beam goes
+  // through the same operations whatever the split, so the output does not
+  // depend on the number of threads.
+  // The texture is used as read back: R32G32B32 holds (0, depth, intensity)
+  // and the two channel formats hold (intensity, depth)
+  const int samples = this->rawImage.rows;
+  const int binCount = this->binCount;
+  const int channels = this->rawImage.channels();
+  const int intensityChannel = channels == 3 ? 2 : 0;
+  const int depthChannel = 1;
+  this->arena.Fit(this->beamDepth, this->beamCount * samples);
+  this->arena.Fit(this->beamIntensity, this->beamCount * samples);
+  this->arena.Fit(this->sonarBinsDepth, this->threadPool->Size() * binCount);
+  this->arena.Fit(this->beamMeans, this->beamCount * binCount);
+  this->arena.Fit(this->workerRemapTime, this->threadPool->Size());
+  this->arena.Fit(this->workerBinTime, this->threadPool->Size());
+  std::fill(this->workerRemapTime.begin(), this->workerRemapTime.end(), 0.0f);
+  std::fill(this->workerBinTime.begin(), this->workerBinTime.end(), 0.0f);
+
+  this->threadPool->ParallelFor(this->beamCount,
+    [&](size_t _begin, size_t _end, size_t _worker)
+  {
+    std::chrono::steady_clock::time_point workerStart;
+    if (timed)
+      workerStart = std::chrono::steady_clock::now();
+
+    // Sample the beams straight from the shader image into beam major
+    // planes, so the samples of each beam are contiguous for the kernel
+    if (!this->bAreaBeamSampling)
+    {
+      for (int row = 0; row < samples; row++)
+      {
+        const float *pixels = this->rawImage.ptr<float>(row);
+        for (size_t i_beam = _begin; i_beam < _end; i_beam++)
+        {
+          const float *p0 = pixels + this->beamColumn0[i_beam] * channels;
+          const float *p1 = pixels + this->beamColumn1[i_beam] * channels;
+          const float w = this->beamWeight[i_beam];
+          this->beamIntensity[i_beam * samples + row] = p0[intensityChannel] +
+            (p1[intensityChannel] - p0[intensityChannel]) * w;
+          this->beamDepth[i_beam * samples + row] = p0[depthChannel] +
+            (p1[depthChannel] - p0[depthChannel]) * w;
+        }
+      }
+    }
+
+    // Area sampling gathers the columns between the kernel calls, so it
+    // is all timed as binning
+    if (timed)
+    {
+      this->workerRemapTime[_worker] = SonarStats::Elapsed(workerStart);
+      workerStart = std::chrono::steady_clock::now();
+    }
+
+    float *counts = &this->sonarBinsDepth[_worker * binCount];
+    for (size_t i_beam = _begin; i_beam < _end; i_beam++)
+    {
+      float *means = &this->beamMeans[i_beam * binCount];
+      float *depth = &this->beamDepth[i_beam * samples];
+      float *intensity = &this->beamIntensity[i_beam * samples];
+
+      // depth histogram and mean intensity of each bin in a single pass
+      std::fill(counts, counts + binCount, 0.0f);
+      std::fill(means, means + binCount, 0.0f);
+      if (this->bAreaBeamSampling)
+      {
+        // Every pixel column the beam covers is a set of samples of the beam
+        for (int column = this->beamColumnBegin[i_beam];
+             column < this->beamColumnEnd[i_beam]; column++)
+        {
+          for (int row = 0; row < samples; row++)
+          {
+            const float *pixel = this->rawImage.ptr<float>(row) + column * channels;
+            intensity[row] = pixel[intensityChannel];
+            depth[row] = pixel[depthChannel];
+          }
+          this->binKernel.Accumulate(depth, intensity, samples, binCount, counts, means);
+        }
+      }
+      else
+      {
+        this->binKernel.Accumulate(depth, intensity, samples, binCount, counts, means);
+      }
+      this->binKernel.Normalize(counts, means, binCount, means);
+      this->AddBeamIntensities(i_beam, means);
+    }
+
+    if (timed)
+      this->workerBinTime[_worker] = SonarStats::Elapsed(workerStart);
+  });
+
+  // The slowest worker sets the time of the parallel stages
+  if (timed)
+  {
+    this->stats->Record(SonarStats::REMAP, *std::max_element(this->workerRemapTime.begin(),
+                                                             this->workerRemapTime.end()));
+    this->stats->Record(SonarStats::BINNING, *std::max_element(this->workerBinTime.begin(),
+                                                               this->workerBinTime.end()));
+    start = std::chrono::steady_clock::now();
+  }
+  this->noiseFrame++;
+  this->bBinned = true;
+
+  this->BlurBins(_accumData);
+
+  if (timed)
+    this->stats->Record(SonarStats::NOISE_BLUR, SonarStats::Elapsed(start));
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::AddBeamIntensities(const int _beam, const float *_means)
+{
+  this->noise.Apply(this->noiseFrame, _beam, _means, this->rangeGain.data(), this->binCount,
+                    this->noisyImage.ptr<float>(_beam));
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::BlurBins(std::vector<float> &_accumData)
+{
+  this->arena.Fit(_accumData, this->beamCount * this->binCount);
+  this->psf.Apply(this->noisyImage, _accumData.data(), *this->threadPool);
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::TransferTableToSonar(const std::vector<float> &_accumData,
+                                          const TransferTable &_transfer)
+{
+  GZ_ASSERT(_accumData.size() >= static_cast<size_t>(this->beamCount * this->binCount),
+            "Sonar bin data smaller than the transfer table sources");
+
+  // Only the pixels of the fan are listed, the rest keep their zero
+  const int *pixels = _transfer.pixels.data();
+  const int *sources = _transfer.sources.data();
+  const float *accum = _accumData.data();
+  float *image = this->sonarImage.ptr<float>();
+  const size_t count = _transfer.pixels.size();
+
+  if (_transfer.beamWeights.empty())
+  {
+    for (size_t i = 0; i < count; ++i)
+      image[pixels[i]] = accum[sources[i]];
+    return;
+  }
+
+  // Interpolate along the bins of the two beams, then between the beams
+  const float *beamWeights = _transfer.beamWeights.data();
+  const float *binWeights = _transfer.binWeights.data();
+  const int nextBeam = this->binCount;
+  for (size_t i = 0; i < count; ++i)
+  {
+    const float *cell = accum + sources[i];
+    float first = cell[0] + binWeights[i] * (cell[1] - cell[0]);
+    float second = cell[nextBeam] + binWeights[i] * (cell[nextBeam + 1] - cell[nextBeam]);
+    image[pixels[i]] = first + beamWeights[i] * (second - first);
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarProcessor::GenerateTransferTable(TransferTable &_transfer)
+{
+  // set the origin
+  cv::Point2f origin(this->sonarImage.cols / 2, this->sonarImage.rows / 2);
+
+  _transfer.pixels.clear();
+  _transfer.sources.clear();
+  _transfer.beamWeights.clear();
+  _transfer.binWeights.clear();
+
+  // The four cells need two beams and two bins
+  const bool bilinear = this->bBilinearScanConversion &&
+                        this->beamCount > 1 && this->binCount > 1;
+
+  for (size_t j = 0; j < this->sonarImage.rows; j++)
+  {
+    for (size_t i = 0; i < this->sonarImage.cols; i++)
+    {
+      // current point
+      cv::Point2f point(i - origin.x, j - origin.y);
+      point.x = point.x * static_cast<float>(this->binCount / (this->sonarImage.cols * 0.5));
+      point.y = point.y * static_cast<float>(this->binCount / (this->sonarImage.rows * 0.5));
+
+      double radius = sqrt(point.x * point.x + point.y * point.y);
+      double theta = atan2(point.x, -point.y);
+
+      // pixels out the sonar image
+      if (radius > this->binCount || !radius || theta < -this->HorzFOV() / 2 || theta > this->HorzFOV() / 2)
+        continue;
+
+      // pixels in the sonar image
+      double beam = ((theta + this->HorzFOV() / 2) / (this->HorzFOV())) * (this->beamCount);
+
+      if (bilinear)
+      {
+        // Beam and bin cells are sampled at their centers, the pixels past
+        // the first or last centers take the edge cell
+        beam = ignition::math::clamp(beam - 0.5, 0.0, this->beamCount - 1.0);
+        double bin = ignition::math::clamp(radius - 0.5, 0.0, this->binCount - 1.0);
+        int beam0 = std::min(static_cast<int>(beam), this->beamCount - 2);
+        int bin0 = std::min(static_cast<int>(bin), this->binCount - 2);
+
+        this->sonarImageMask.at<uchar>(j, i) = 255;
+        _transfer.pixels.push_back(j * this->sonarImage.cols + i);
+        _transfer.sources.push_back(beam0 * this->binCount + bin0);
+        _transfer.beamWeights.push_back(beam - beam0);
+        _transfer.binWeights.push_back(bin - bin0);
+        continue;
+      }
+
+      // The edges of the fan round past the last beam and the last bin,
+      // they take the edge cells
+      int idBeam = std::min(static_cast<int>(beam), this->beamCount - 1);
+      int idBin = std::min(static_cast<int>(radius), this->binCount - 1);
+
+      this->sonarImageMask.at<uchar>(j, i) = 255;
+      _transfer.pixels.push_back(j * this->sonarImage.cols + i);
+      _transfer.sources.push_back(idBeam * this->binCount + idBin);
+    }
+  }
+
+  // The table lives as long as the geometry, drop the slack of the growth
+  _transfer.pixels.shrink_to_fit();
+  _transfer.sources.shrink_to_fit();
+  _transfer.beamWeights.shrink_to_fit();
+  _transfer.binWeights.shrink_to_fit();
+}
+}  // namespace rendering
+}  // namespace gazebo
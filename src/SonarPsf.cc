@@ -0,0 +1,269 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "gazebo/common/Assert.hh"
+#include "forward_looking_sonar_gazebo/SonarPsf.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+namespace
+{
+//////////////////////////////////////////////////
+/// \brief Index of a sample past the border, reflected without repeating
+/// the edge like cv::BORDER_REFLECT_101
+int Reflect101(int _index, const int _size)
+{
+  if (_size == 1)
+    return 0;
+  while (_index < 0 || _index >= _size)
+    _index = _index < 0 ? -_index : 2 * _size - 2 - _index;
+  return _index;
+}
+
+//////////////////////////////////////////////////
+/// \brief _output += _weight * _input
+void Axpy(const float _weight, const float *_input, float *_output, const int _count)
+{
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 vWeight = _mm_set1_ps(_weight);
+  for (; i + 4 <= _count; i += 4)
+  {
+    __m128 product = _mm_mul_ps(vWeight, _mm_loadu_ps(_input + i));
+    _mm_storeu_ps(_output + i, _mm_add_ps(_mm_loadu_ps(_output + i), product));
+  }
+#endif
+  for (; i < _count; ++i)
+    _output[i] += _weight * _input[i];
+}
+
+//////////////////////////////////////////////////
+/// \brief Sigma of OpenCV's Gaussian kernel of a width with no sigma
+double KernelSigma(const int _width)
+{
+  return 0.3 * ((_width - 1) * 0.5 - 1) + 0.8;
+}
+
+//////////////////////////////////////////////////
+/// \brief Radius of the box whose three passes have the variance of a
+/// Gaussian kernel
+int BoxRadius(const int _width)
+{
+  const double sigma = KernelSigma(_width);
+  const int width = static_cast<int>(std::round(std::sqrt(4 * sigma * sigma + 1)));
+  return std::max((width - 1) / 2, 0);
+}
+}  // namespace
+
+//////////////////////////////////////////////////
+SonarPsf::SonarPsf()
+  : mode(GAUSSIAN),
+    beamWidth(11),
+    binWidth(9),
+    beamBoxRadius(0),
+    binBoxRadius(0)
+{
+  this->UpdateKernels();
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::SetKernel(const int _beamWidth, const int _binWidth)
+{
+  this->beamWidth = std::max(_beamWidth, 1) | 1;
+  this->binWidth = std::max(_binWidth, 1) | 1;
+  this->UpdateKernels();
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::SetMode(const Mode _mode)
+{
+  this->mode = _mode;
+}
+
+//////////////////////////////////////////////////
+bool SonarPsf::ParseMode(const std::string &_name, Mode &_mode)
+{
+  if (_name == "gaussian")
+    _mode = GAUSSIAN;
+  else if (_name == "box")
+    _mode = BOX;
+  else
+    return false;
+  return true;
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::UpdateKernels()
+{
+  // Same kernels as cv::GaussianBlur with no sigma
+  cv::Mat beamKernel = cv::getGaussianKernel(this->beamWidth, 0, CV_32F);
+  cv::Mat binKernel = cv::getGaussianKernel(this->binWidth, 0, CV_32F);
+  this->beamKernel.assign(beamKernel.ptr<float>(), beamKernel.ptr<float>() + this->beamWidth);
+  this->binKernel.assign(binKernel.ptr<float>(), binKernel.ptr<float>() + this->binWidth);
+
+  this->beamBoxRadius = BoxRadius(this->beamWidth);
+  this->binBoxRadius = BoxRadius(this->binWidth);
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::Apply(const cv::Mat &_input, float *_output, SonarThreadPool &_threadPool)
+{
+  GZ_ASSERT(_input.type() == CV_32FC1, "Single channel float bins expected");
+  GZ_ASSERT(_output != _input.ptr<float>(), "The spread bins cannot alias the input");
+
+  const int rows = _input.rows;
+  const int cols = _input.cols;
+  cv::Mat output(rows, cols, CV_32FC1, _output);
+  if (rows == 0 || cols == 0)
+    return;
+
+  // create() keeps the buffers while the grid size does not change
+  this->scratch[0].create(rows, cols, CV_32FC1);
+  this->scratch[1].create(rows, cols, CV_32FC1);
+  const int radius = this->mode == BOX ? this->binBoxRadius : this->binWidth / 2;
+  const size_t padded = _threadPool.Size() * (cols + 2 * radius);
+  if (this->paddedRows.size() < padded)
+    this->paddedRows.resize(padded);
+
+  if (this->mode == GAUSSIAN)
+  {
+    this->GaussianRows(_input, this->scratch[0], this->binKernel, _threadPool);
+    this->GaussianColumns(this->scratch[0], output, this->beamKernel, _threadPool);
+    return;
+  }
+
+  // Three box passes in each direction, ping-ponging between the scratch
+  // images and ending in the output
+  if (this->columnSums.size() < static_cast<size_t>(cols))
+    this->columnSums.resize(cols);
+
+  this->BoxRows(_input, this->scratch[0], this->binBoxRadius, _threadPool);
+  this->BoxRows(this->scratch[0], this->scratch[1], this->binBoxRadius, _threadPool);
+  this->BoxRows(this->scratch[1], this->scratch[0], this->binBoxRadius, _threadPool);
+  this->BoxColumns(this->scratch[0], this->scratch[1], this->beamBoxRadius, _threadPool);
+  this->BoxColumns(this->scratch[1], this->scratch[0], this->beamBoxRadius, _threadPool);
+  this->BoxColumns(this->scratch[0], output, this->beamBoxRadius, _threadPool);
+}
+
+//////////////////////////////////////////////////
+float *SonarPsf::PadRow(const float *_row, const int _cols, const int _radius,
+                        const size_t _worker)
+{
+  float *padded = &this->paddedRows[_worker * (_cols + 2 * _radius)];
+  for (int i = -_radius; i < 0; ++i)
+    padded[i + _radius] = _row[Reflect101(i, _cols)];
+  std::copy(_row, _row + _cols, padded + _radius);
+  for (int i = _cols; i < _cols + _radius; ++i)
+    padded[i + _radius] = _row[Reflect101(i, _cols)];
+  return padded;
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::GaussianRows(const cv::Mat &_input, cv::Mat &_output,
+                            const std::vector<float> &_kernel,
+                            SonarThreadPool &_threadPool)
+{
+  const int cols = _input.cols;
+  const int radius = _kernel.size() / 2;
+  _threadPool.ParallelFor(_input.rows,
+    [&](size_t _begin, size_t _end, size_t _worker)
+    {
+      for (size_t row = _begin; row < _end; ++row)
+      {
+        const float *padded = this->PadRow(_input.ptr<float>(row), cols, radius, _worker);
+        float *output = _output.ptr<float>(row);
+        std::fill(output, output + cols, 0.0f);
+        for (size_t k = 0; k < _kernel.size(); ++k)
+          Axpy(_kernel[k], padded + k, output, cols);
+      }
+    });
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::GaussianColumns(const cv::Mat &_input, cv::Mat &_output,
+                               const std::vector<float> &_kernel,
+                               SonarThreadPool &_threadPool)
+{
+  const int rows = _input.rows;
+  const int cols = _input.cols;
+  const int radius = _kernel.size() / 2;
+  _threadPool.ParallelFor(rows,
+    [&](size_t _begin, size_t _end, size_t /*_worker*/)
+    {
+      for (size_t row = _begin; row < _end; ++row)
+      {
+        float *output = _output.ptr<float>(row);
+        std::fill(output, output + cols, 0.0f);
+        for (int k = -radius; k <= radius; ++k)
+        {
+          const float *input = _input.ptr<float>(Reflect101(static_cast<int>(row) + k, rows));
+          Axpy(_kernel[k + radius], input, output, cols);
+        }
+      }
+    });
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::BoxRows(const cv::Mat &_input, cv::Mat &_output, const int _radius,
+                       SonarThreadPool &_threadPool)
+{
+  const int cols = _input.cols;
+  const float scale = 1.0f / (2 * _radius + 1);
+  _threadPool.ParallelFor(_input.rows,
+    [&](size_t _begin, size_t _end, size_t _worker)
+    {
+      for (size_t row = _begin; row < _end; ++row)
+      {
+        const float *padded = this->PadRow(_input.ptr<float>(row), cols, _radius, _worker);
+        float *output = _output.ptr<float>(row);
+        float sum = 0;
+        for (int i = 0; i < 2 * _radius + 1; ++i)
+          sum += padded[i];
+        for (int i = 0; i < cols; ++i)
+        {
+          output[i] = sum * scale;
+          if (i + 1 < cols)
+            sum += padded[i + 2 * _radius + 1] - padded[i];
+        }
+      }
+    });
+}
+
+//////////////////////////////////////////////////
+void SonarPsf::BoxColumns(const cv::Mat &_input, cv::Mat &_output, const int _radius,
+                          SonarThreadPool &_threadPool)
+{
+  const int rows = _input.rows;
+  const float scale = 1.0f / (2 * _radius + 1);
+  _threadPool.ParallelFor(_input.cols,
+    [&](size_t _begin, size_t _end, size_t /*_worker*/)
+    {
+      // Each chunk of columns keeps its own slice of running sums
+      float *sums = &this->columnSums[_begin];
+      const int count = _end - _begin;
+      std::fill(sums, sums + count, 0.0f);
+      for (int k = -_radius; k <= _radius; ++k)
+        Axpy(1.0f, _input.ptr<float>(Reflect101(k, rows)) + _begin, sums, count);
+
+      for (int row = 0; row < rows; ++row)
+      {
+        float *output = _output.ptr<float>(row) + _begin;
+        for (int i = 0; i < count; ++i)
+          output[i] = sums[i] * scale;
+        if (row + 1 == rows)
+          break;
+        Axpy(1.0f, _input.ptr<float>(Reflect101(row + _radius + 1, rows)) + _begin, sums, count);
+        Axpy(-1.0f, _input.ptr<float>(Reflect101(row - _radius, rows)) + _begin, sums, count);
+      }
+    });
+}
+}  // namespace rendering
+}  // namespace gazebo
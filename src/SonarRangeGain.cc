@@ -0,0 +1,148 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+#include "forward_looking_sonar_gazebo/SonarRangeGain.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+
+//////////////////////////////////////////////////
+SonarRangeGain::SonarRangeGain()
+  : type(POLYNOMIAL),
+    coefficients({0.5, 0.0, 7.0}),
+    scale(1.0),
+    exponent(0.0),
+    attenuation(0.0)
+{
+}
+
+//////////////////////////////////////////////////
+SonarRangeGain::Type SonarRangeGain::GetType() const
+{
+  return this->type;
+}
+
+//////////////////////////////////////////////////
+void SonarRangeGain::SetPolynomial(const std::vector<double> &_coefficients)
+{
+  this->type = POLYNOMIAL;
+  this->coefficients = _coefficients;
+}
+
+//////////////////////////////////////////////////
+void SonarRangeGain::SetSpreading(const double _scale, const double _exponent,
+                                  const double _attenuation)
+{
+  this->type = SPREADING;
+  this->scale = _scale;
+  this->exponent = _exponent;
+  this->attenuation = _attenuation;
+}
+
+//////////////////////////////////////////////////
+bool SonarRangeGain::SetCurve(const std::vector<double> &_ranges,
+                              const std::vector<double> &_gains)
+{
+  if (_ranges.empty() || _ranges.size() != _gains.size() ||
+      !std::is_sorted(_ranges.begin(), _ranges.end()))
+    return false;
+
+  this->type = CURVE;
+  this->ranges = _ranges;
+  this->gains = _gains;
+  return true;
+}
+
+//////////////////////////////////////////////////
+bool SonarRangeGain::ReadCsv(const std::string &_path, std::vector<double> &_ranges,
+                             std::vector<double> &_gains)
+{
+  std::ifstream file(_path);
+  if (!file)
+    return false;
+
+  _ranges.clear();
+  _gains.clear();
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream fields(line);
+    double range, gain;
+    if (fields >> range >> gain)
+    {
+      _ranges.push_back(range);
+      _gains.push_back(gain);
+    }
+  }
+  return !_ranges.empty();
+}
+
+//////////////////////////////////////////////////
+bool SonarRangeGain::ParseType(const std::string &_name, Type &_type)
+{
+  if (_name == "polynomial")
+    _type = POLYNOMIAL;
+  else if (_name == "spreading")
+    _type = SPREADING;
+  else if (_name == "csv")
+    _type = CURVE;
+  else
+    return false;
+  return true;
+}
+
+//////////////////////////////////////////////////
+void SonarRangeGain::Fill(const int _binCount, const double _maxRange, float *_table) const
+{
+  for (int i = 0; i < _binCount; ++i)
+  {
+    double gain = 0;
+    if (this->type == POLYNOMIAL)
+    {
+      // Horner, highest degree first
+      const double x = static_cast<double>(i) / _binCount;
+      for (auto c = this->coefficients.rbegin(); c != this->coefficients.rend(); ++c)
+        gain = gain * x + *c;
+    }
+    else
+    {
+      const double range = (i + 0.5) * _maxRange / _binCount;
+      if (this->type == SPREADING)
+      {
+        gain = this->scale * std::pow(range, this->exponent) *
+               std::exp(2 * this->attenuation * range);
+      }
+      else
+      {
+        auto upper = std::upper_bound(this->ranges.begin(), this->ranges.end(), range);
+        if (upper == this->ranges.begin())
+        {
+          gain = this->gains.front();
+        }
+        else if (upper == this->ranges.end())
+        {
+          gain = this->gains.back();
+        }
+        else
+        {
+          const size_t k = upper - this->ranges.begin();
+          const double t = (range - this->ranges[k - 1]) / (this->ranges[k] - this->ranges[k - 1]);
+          gain = this->gains[k - 1] + t * (this->gains[k] - this->gains[k - 1]);
+        }
+      }
+    }
+    _table[i] = gain;
+  }
+}
+}  // namespace rendering
+}  // namespace gazebo
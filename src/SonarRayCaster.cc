@@ -0,0 +1,807 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <ignition/math/Helpers.hh>
+#include <ignition/math/Quaternion.hh>
+#include <ignition/math/Vector2.hh>
+
+#include "gazebo/common/Assert.hh"
+#include "gazebo/common/CommonIface.hh"
+#include "gazebo/common/Console.hh"
+#include "gazebo/common/MeshManager.hh"
+#include "forward_looking_sonar_gazebo/SonarRayCaster.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+namespace
+{
+/// \brief Most triangles in a BVH leaf
+const size_t kLeafTriangles = 8;
+
+/// \brief Side of the square tiles the image is rendered in
+const int kTileSize = 16;
+
+/// \brief Deepest BVH traversal
+const int kStackSize = 64;
+
+//////////////////////////////////////////////////
+bool IntersectBox(const float *_min, const float *_max, const float *_origin,
+                  const float *_invDir, const float _tMax, float &_tEntry)
+{
+  float tNear = 0.0f;
+  float tFar = _tMax;
+  for (int axis = 0; axis < 3; ++axis)
+  {
+    float t0 = (_min[axis] - _origin[axis]) * _invDir[axis];
+    float t1 = (_max[axis] - _origin[axis]) * _invDir[axis];
+    tNear = std::max(tNear, std::min(t0, t1));
+    tFar = std::min(tFar, std::max(t0, t1));
+  }
+  _tEntry = tNear;
+  return tNear <= tFar;
+}
+}  // namespace
+
+//////////////////////////////////////////////////
+SonarRayCaster::SonarRayCaster()
+  : worldLoads(0)
+{
+}
+
+//////////////////////////////////////////////////
+SonarRayCaster::~SonarRayCaster()
+{
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::Clear()
+{
+  this->instances.clear();
+  this->worldVisuals.clear();
+}
+
+//////////////////////////////////////////////////
+int SonarRayCaster::AddMesh(const common::Mesh &_mesh,
+                            const ignition::math::Vector3d &_scale,
+                            const double _reflectance)
+{
+  std::vector<ignition::math::Vector3d> vertices;
+  std::vector<ignition::math::Vector3d> normals;
+
+  for (unsigned int i = 0; i < _mesh.GetSubMeshCount(); ++i)
+  {
+    const common::SubMesh *subMesh = _mesh.GetSubMesh(i);
+    if (subMesh->GetPrimitiveType() != common::SubMesh::TRIANGLES)
+      continue;
+
+    bool indexed = subMesh->GetIndexCount() > 0;
+    unsigned int count = indexed ? subMesh->GetIndexCount() : subMesh->GetVertexCount();
+    bool hasNormals = subMesh->GetNormalCount() == subMesh->GetVertexCount();
+
+    for (unsigned int j = 0; j + 2 < count; j += 3)
+    {
+      for (unsigned int k = 0; k < 3; ++k)
+      {
+        unsigned int index = indexed ? subMesh->GetIndex(j + k) : j + k;
+#if GAZEBO_MAJOR_VERSION >= 8
+        vertices.push_back(subMesh->Vertex(index) * _scale);
+        // Normals follow the inverse transpose of the scale
+        normals.push_back(hasNormals ? subMesh->Normal(index) / _scale
+                                     : ignition::math::Vector3d::Zero);
+#else
+        vertices.push_back(subMesh->GetVertex(index) * _scale);
+        normals.push_back(hasNormals ? subMesh->GetNormal(index) / _scale
+                                     : ignition::math::Vector3d::Zero);
+#endif
+      }
+    }
+  }
+
+  return this->AddTriangles(vertices, normals, _reflectance);
+}
+
+//////////////////////////////////////////////////
+int SonarRayCaster::AddTriangles(const std::vector<ignition::math::Vector3d> &_vertices,
+                                 const std::vector<ignition::math::Vector3d> &_normals,
+                                 const double _reflectance)
+{
+  GZ_ASSERT(_vertices.size() == _normals.size(), "One normal per vertex expected");
+
+  Instance instance;
+  instance.reflectance = _reflectance;
+  instance.normals.resize(_vertices.size());
+
+  for (size_t i = 0; i + 2 < _vertices.size(); i += 3)
+  {
+    ignition::math::Vector3d face = (_vertices[i + 1] - _vertices[i]).Cross(
+                                      _vertices[i + 2] - _vertices[i]);
+    face.Normalize();
+    for (size_t k = 0; k < 3; ++k)
+    {
+      ignition::math::Vector3d normal = _normals[i + k];
+      instance.normals[i + k] = normal == ignition::math::Vector3d::Zero ? face : normal.Normalize();
+    }
+  }
+
+  this->Build(instance, _vertices);
+  this->instances.push_back(instance);
+
+  int index = this->instances.size() - 1;
+  this->SetPose(index, ignition::math::Pose3d::Zero);
+  return index;
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::SetPose(const int _instance, const ignition::math::Pose3d &_pose)
+{
+  Instance &instance = this->instances[_instance];
+  instance.pose = _pose;
+
+  // Bounds of the rotated local box
+  instance.worldMin.Set(std::numeric_limits<double>::max(),
+                        std::numeric_limits<double>::max(),
+                        std::numeric_limits<double>::max());
+  instance.worldMax = -instance.worldMin;
+  for (int corner = 0; corner < 8; ++corner)
+  {
+    ignition::math::Vector3d local(
+      corner & 1 ? instance.max.X() : instance.min.X(),
+      corner & 2 ? instance.max.Y() : instance.min.Y(),
+      corner & 4 ? instance.max.Z() : instance.min.Z());
+    ignition::math::Vector3d world = _pose.Rot().RotateVector(local) + _pose.Pos();
+    instance.worldMin.Min(world);
+    instance.worldMax.Max(world);
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::LoadWorld(const physics::WorldPtr &_world)
+{
+  this->Clear();
+  this->worldLoads++;
+
+#if GAZEBO_MAJOR_VERSION >= 8
+  for (auto &model : _world->Models())
+#else
+  for (auto &model : _world->GetModels())
+#endif
+    this->LoadModel(model);
+
+  this->UpdateWorldPoses();
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::LoadModel(const physics::ModelPtr &_model)
+{
+  for (auto &link : _model->GetLinks())
+  {
+    sdf::ElementPtr linkSdf = link->GetSDF();
+    if (!linkSdf || !linkSdf->HasElement("visual"))
+      continue;
+
+    for (sdf::ElementPtr visual = linkSdf->GetElement("visual"); visual;
+         visual = visual->GetNextElement("visual"))
+      this->LoadVisual(link, visual);
+  }
+
+#if GAZEBO_MAJOR_VERSION >= 8
+  for (auto &nested : _model->NestedModels())
+    this->LoadModel(nested);
+#endif
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::LoadVisual(const physics::LinkPtr &_link, sdf::ElementPtr _visual)
+{
+  if (!_visual->HasElement("geometry"))
+    return;
+
+  sdf::ElementPtr geometry = _visual->GetElement("geometry");
+  common::MeshManager *meshManager = common::MeshManager::Instance();
+  const common::Mesh *mesh = nullptr;
+  ignition::math::Vector3d scale = ignition::math::Vector3d::One;
+
+  // Same reflectance as the retro the rendering gives the visual
+  double reflectance = 1.0;
+  if (_visual->HasElement("laser_retro"))
+    reflectance = _visual->Get<double>("laser_retro");
+
+  int instance = -1;
+  if (geometry->HasElement("box"))
+  {
+    mesh = meshManager->GetMesh("unit_box");
+    scale = geometry->GetElement("box")->Get<ignition::math::Vector3d>("size");
+  }
+  else if (geometry->HasElement("sphere"))
+  {
+    mesh = meshManager->GetMesh("unit_sphere");
+    scale *= 2 * geometry->GetElement("sphere")->Get<double>("radius");
+  }
+  else if (geometry->HasElement("cylinder"))
+  {
+    sdf::ElementPtr cylinder = geometry->GetElement("cylinder");
+    mesh = meshManager->GetMesh("unit_cylinder");
+    scale.Set(2 * cylinder->Get<double>("radius"), 2 * cylinder->Get<double>("radius"),
+              cylinder->Get<double>("length"));
+  }
+  else if (geometry->HasElement("mesh"))
+  {
+    sdf::ElementPtr meshSdf = geometry->GetElement("mesh");
+    std::string filename = common::find_file(meshSdf->Get<std::string>("uri"));
+    if (!filename.empty())
+      mesh = meshManager->Load(filename);
+    scale = meshSdf->Get<ignition::math::Vector3d>("scale");
+  }
+  else if (geometry->HasElement("plane"))
+  {
+    // Two triangles facing the plane normal
+    sdf::ElementPtr plane = geometry->GetElement("plane");
+    ignition::math::Vector3d normal = plane->Get<ignition::math::Vector3d>("normal").Normalize();
+    ignition::math::Vector2d size = plane->Get<ignition::math::Vector2d>("size") / 2;
+    ignition::math::Quaterniond rot;
+    rot.From2Axes(ignition::math::Vector3d::UnitZ, normal);
+
+    ignition::math::Vector3d corners[4] = {
+      rot.RotateVector(ignition::math::Vector3d(-size.X(), -size.Y(), 0)),
+      rot.RotateVector(ignition::math::Vector3d(size.X(), -size.Y(), 0)),
+      rot.RotateVector(ignition::math::Vector3d(size.X(), size.Y(), 0)),
+      rot.RotateVector(ignition::math::Vector3d(-size.X(), size.Y(), 0))};
+
+    std::vector<ignition::math::Vector3d> vertices = {
+      corners[0], corners[1], corners[2], corners[0], corners[2], corners[3]};
+    std::vector<ignition::math::Vector3d> normals(vertices.size(), normal);
+    instance = this->AddTriangles(vertices, normals, reflectance);
+  }
+  else
+  {
+    gzwarn << "Sonar ray caster ignores the geometry of visual ["
+           << _visual->Get<std::string>("name") << "]" << std::endl;
+    return;
+  }
+
+  if (instance < 0)
+  {
+    if (!mesh)
+    {
+      gzerr << "Sonar ray caster could not load the mesh of visual ["
+            << _visual->Get<std::string>("name") << "]" << std::endl;
+      return;
+    }
+    instance = this->AddMesh(*mesh, scale, reflectance);
+  }
+
+  WorldVisual worldVisual;
+  worldVisual.link = _link;
+  worldVisual.pose = _visual->Get<ignition::math::Pose3d>("pose");
+  worldVisual.instance = instance;
+  this->worldVisuals.push_back(worldVisual);
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::UpdateWorldPoses()
+{
+  for (auto &worldVisual : this->worldVisuals)
+  {
+#if GAZEBO_MAJOR_VERSION >= 8
+    ignition::math::Pose3d linkPose = worldVisual.link->WorldPose();
+#else
+    ignition::math::Pose3d linkPose = worldVisual.link->GetWorldPose().Ign();
+#endif
+    this->SetPose(worldVisual.instance, worldVisual.pose + linkPose);
+  }
+}
+
+//////////////////////////////////////////////////
+uint64_t SonarRayCaster::WorldPoses(std::vector<ignition::math::Pose3d> &_poses) const
+{
+  _poses.resize(this->worldVisuals.size());
+  for (size_t i = 0; i < this->worldVisuals.size(); ++i)
+  {
+#if GAZEBO_MAJOR_VERSION >= 8
+    ignition::math::Pose3d linkPose = this->worldVisuals[i].link->WorldPose();
+#else
+    ignition::math::Pose3d linkPose = this->worldVisuals[i].link->GetWorldPose().Ign();
+#endif
+    _poses[i] = this->worldVisuals[i].pose + linkPose;
+  }
+  return this->worldLoads;
+}
+
+//////////////////////////////////////////////////
+bool SonarRayCaster::SetWorldPoses(const std::vector<ignition::math::Pose3d> &_poses,
+                                   const uint64_t _worldLoads)
+{
+  if (_worldLoads != this->worldLoads || _poses.size() != this->worldVisuals.size())
+    return false;
+
+  for (size_t i = 0; i < _poses.size(); ++i)
+    this->SetPose(this->worldVisuals[i].instance, _poses[i]);
+  return true;
+}
+
+//////////////////////////////////////////////////
+size_t SonarRayCaster::InstanceCount() const
+{
+  return this->instances.size();
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::Build(Instance &_instance,
+                           const std::vector<ignition::math::Vector3d> &_vertices)
+{
+  const size_t triangleCount = _vertices.size() / 3;
+  _instance.nodes.clear();
+  _instance.packets.clear();
+  _instance.min = ignition::math::Vector3d::Zero;
+  _instance.max = ignition::math::Vector3d::Zero;
+  if (triangleCount == 0)
+    return;
+
+  std::vector<ignition::math::Vector3d> centroids(triangleCount);
+  std::vector<size_t> order(triangleCount);
+  for (size_t i = 0; i < triangleCount; ++i)
+  {
+    centroids[i] = (_vertices[3 * i] + _vertices[3 * i + 1] + _vertices[3 * i + 2]) / 3;
+    order[i] = i;
+  }
+
+  // Median split along the widest axis of the centroids, iteratively so
+  // large meshes do not overflow the stack
+  struct Range
+  {
+    int node;
+    size_t begin, end;
+  };
+  std::vector<Range> ranges;
+  _instance.nodes.push_back(Node());
+  ranges.push_back({0, 0, triangleCount});
+
+  while (!ranges.empty())
+  {
+    Range range = ranges.back();
+    ranges.pop_back();
+
+    ignition::math::Vector3d boundsMin(std::numeric_limits<double>::max(),
+                                       std::numeric_limits<double>::max(),
+                                       std::numeric_limits<double>::max());
+    ignition::math::Vector3d boundsMax = -boundsMin;
+    ignition::math::Vector3d centroidMin = boundsMin;
+    ignition::math::Vector3d centroidMax = boundsMax;
+    for (size_t i = range.begin; i < range.end; ++i)
+    {
+      for (size_t k = 0; k < 3; ++k)
+      {
+        boundsMin.Min(_vertices[3 * order[i] + k]);
+        boundsMax.Max(_vertices[3 * order[i] + k]);
+      }
+      centroidMin.Min(centroids[order[i]]);
+      centroidMax.Max(centroids[order[i]]);
+    }
+
+    Node &node = _instance.nodes[range.node];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      node.min[axis] = boundsMin[axis];
+      node.max[axis] = boundsMax[axis];
+    }
+
+    if (range.end - range.begin <= kLeafTriangles)
+    {
+      node.first = _instance.packets.size();
+      node.count = 0;
+      for (size_t i = range.begin; i < range.end; i += 4)
+      {
+        Packet packet;
+        std::fill(&packet.v0[0][0], &packet.v0[0][0] + 12, 0.0f);
+        std::fill(&packet.e1[0][0], &packet.e1[0][0] + 12, 0.0f);
+        std::fill(&packet.e2[0][0], &packet.e2[0][0] + 12, 0.0f);
+        for (size_t lane = 0; lane < 4; ++lane)
+        {
+          packet.triangle[lane] = -1;
+          if (i + lane >= range.end)
+            continue;
+
+          size_t triangle = order[i + lane];
+          const ignition::math::Vector3d &v0 = _vertices[3 * triangle];
+          ignition::math::Vector3d e1 = _vertices[3 * triangle + 1] - v0;
+          ignition::math::Vector3d e2 = _vertices[3 * triangle + 2] - v0;
+          for (int axis = 0; axis < 3; ++axis)
+          {
+            packet.v0[axis][lane] = v0[axis];
+            packet.e1[axis][lane] = e1[axis];
+            packet.e2[axis][lane] = e2[axis];
+          }
+          packet.triangle[lane] = triangle;
+        }
+        _instance.packets.push_back(packet);
+        node.count++;
+      }
+      continue;
+    }
+
+    ignition::math::Vector3d extent = centroidMax - centroidMin;
+    int axis = 0;
+    if (extent.Y() > extent[axis])
+      axis = 1;
+    if (extent.Z() > extent[axis])
+      axis = 2;
+
+    size_t middle = (range.begin + range.end) / 2;
+    std::nth_element(order.begin() + range.begin, order.begin() + middle,
+                     order.begin() + range.end, [&](size_t _a, size_t _b)
+    {
+      return centroids[_a][axis] < centroids[_b][axis];
+    });
+
+    int first = _instance.nodes.size();
+    node.first = first;
+    node.count = 0;
+    // node is invalidated by the push_back
+    _instance.nodes.push_back(Node());
+    _instance.nodes.push_back(Node());
+    ranges.push_back({first, range.begin, middle});
+    ranges.push_back({first + 1, middle, range.end});
+  }
+
+  const Node &root = _instance.nodes[0];
+  _instance.min.Set(root.min[0], root.min[1], root.min[2]);
+  _instance.max.Set(root.max[0], root.max[1], root.max[2]);
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::IntersectPacket(const Packet &_packet, const Ray &_ray,
+                                     const float _tMin, const int _instance,
+                                     Hit &_hit)
+{
+  // Moller-Trumbore on four triangles at once, back faces are culled like
+  // in the rendering
+  const float epsilon = 1e-12f;
+  alignas(16) float t[4], u[4], v[4];
+  int mask = 0;
+
+#ifdef __SSE2__
+  const __m128 dx = _mm_set1_ps(_ray.dir[0]);
+  const __m128 dy = _mm_set1_ps(_ray.dir[1]);
+  const __m128 dz = _mm_set1_ps(_ray.dir[2]);
+  const __m128 e1x = _mm_load_ps(_packet.e1[0]);
+  const __m128 e1y = _mm_load_ps(_packet.e1[1]);
+  const __m128 e1z = _mm_load_ps(_packet.e1[2]);
+  const __m128 e2x = _mm_load_ps(_packet.e2[0]);
+  const __m128 e2y = _mm_load_ps(_packet.e2[1]);
+  const __m128 e2z = _mm_load_ps(_packet.e2[2]);
+
+  // p = dir x e2
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+                          _mm_mul_ps(e1z, pz));
+  __m128 valid = _mm_cmpgt_ps(det, _mm_set1_ps(epsilon));
+  __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+  // s = origin - v0
+  __m128 sx = _mm_sub_ps(_mm_set1_ps(_ray.origin[0]), _mm_load_ps(_packet.v0[0]));
+  __m128 sy = _mm_sub_ps(_mm_set1_ps(_ray.origin[1]), _mm_load_ps(_packet.v0[1]));
+  __m128 sz = _mm_sub_ps(_mm_set1_ps(_ray.origin[2]), _mm_load_ps(_packet.v0[2]));
+  __m128 vu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)),
+                                    _mm_mul_ps(sz, pz)), invDet);
+
+  // q = s x e1
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+  __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                                    _mm_mul_ps(dz, qz)), invDet);
+  __m128 vt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                    _mm_mul_ps(e2z, qz)), invDet);
+
+  const __m128 zero = _mm_setzero_ps();
+  valid = _mm_and_ps(valid, _mm_cmpge_ps(vu, zero));
+  valid = _mm_and_ps(valid, _mm_cmpge_ps(vv, zero));
+  valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(vu, vv), _mm_set1_ps(1.0f)));
+  valid = _mm_and_ps(valid, _mm_cmpgt_ps(vt, _mm_set1_ps(_tMin)));
+  valid = _mm_and_ps(valid, _mm_cmplt_ps(vt, _mm_set1_ps(_hit.t)));
+  mask = _mm_movemask_ps(valid);
+  if (!mask)
+    return;
+
+  _mm_store_ps(t, vt);
+  _mm_store_ps(u, vu);
+  _mm_store_ps(v, vv);
+#else
+  for (int lane = 0; lane < 4; ++lane)
+  {
+    const float e1[3] = {_packet.e1[0][lane], _packet.e1[1][lane], _packet.e1[2][lane]};
+    const float e2[3] = {_packet.e2[0][lane], _packet.e2[1][lane], _packet.e2[2][lane]};
+    const float *d = _ray.dir;
+
+    float p[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2],
+                  d[0] * e2[1] - d[1] * e2[0]};
+    float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (!(det > epsilon))
+      continue;
+    float invDet = 1.0f / det;
+
+    float s[3] = {_ray.origin[0] - _packet.v0[0][lane], _ray.origin[1] - _packet.v0[1][lane],
+                  _ray.origin[2] - _packet.v0[2][lane]};
+    u[lane] = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+
+    float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+                  s[0] * e1[1] - s[1] * e1[0]};
+    v[lane] = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDet;
+    t[lane] = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+
+    if (u[lane] >= 0 && v[lane] >= 0 && u[lane] + v[lane] <= 1 &&
+        t[lane] > _tMin && t[lane] < _hit.t)
+      mask |= 1 << lane;
+  }
+#endif
+
+  for (int lane = 0; lane < 4; ++lane)
+  {
+    if ((mask & (1 << lane)) && t[lane] < _hit.t)
+    {
+      _hit.t = t[lane];
+      _hit.u = u[lane];
+      _hit.v = v[lane];
+      _hit.instance = _instance;
+      _hit.triangle = _packet.triangle[lane];
+    }
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::Intersect(const int _instance, const Ray &_ray,
+                               const float _tMin, Hit &_hit) const
+{
+  const Instance &instance = this->instances[_instance];
+  if (instance.nodes.empty())
+    return;
+
+  int stack[kStackSize];
+  int size = 0;
+  stack[size++] = 0;
+
+  while (size > 0)
+  {
+    const Node &node = instance.nodes[stack[--size]];
+    float tEntry;
+    if (!IntersectBox(node.min, node.max, _ray.origin, _ray.invDir, _hit.t, tEntry))
+      continue;
+
+    if (node.count > 0)
+    {
+      for (int i = 0; i < node.count; ++i)
+        IntersectPacket(instance.packets[node.first + i], _ray, _tMin, _instance, _hit);
+      continue;
+    }
+
+    // Visit the closest child first, it is pushed last
+    const Node &left = instance.nodes[node.first];
+    const Node &right = instance.nodes[node.first + 1];
+    float tLeft, tRight;
+    bool hitLeft = IntersectBox(left.min, left.max, _ray.origin, _ray.invDir, _hit.t, tLeft);
+    bool hitRight = IntersectBox(right.min, right.max, _ray.origin, _ray.invDir, _hit.t, tRight);
+
+    if (size + 2 > kStackSize)
+    {
+      gzerr << "Sonar ray caster BVH is too deep" << std::endl;
+      return;
+    }
+
+    if (hitLeft && hitRight)
+    {
+      bool leftFirst = tLeft <= tRight;
+      stack[size++] = node.first + (leftFirst ? 1 : 0);
+      stack[size++] = node.first + (leftFirst ? 0 : 1);
+    }
+    else if (hitLeft)
+    {
+      stack[size++] = node.first;
+    }
+    else if (hitRight)
+    {
+      stack[size++] = node.first + 1;
+    }
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::CullInstances(const ignition::math::Pose3d &_pose,
+                                   const double _hfov, const double _vfov,
+                                   const double _far, const int _fovTiles)
+{
+  const ignition::math::Vector3d forward = _pose.Rot().RotateVector(ignition::math::Vector3d::UnitX);
+  const ignition::math::Vector3d right = -_pose.Rot().RotateVector(ignition::math::Vector3d::UnitY);
+  const ignition::math::Vector3d up = _pose.Rot().RotateVector(ignition::math::Vector3d::UnitZ);
+
+  // Inward normals of the side planes through the sonar. The yawed field
+  // of view tiles stay within the horizontal field of view, but their outer
+  // edges reach higher above the sonar axis than the vertical one.
+  ignition::math::Vector3d planes[4];
+  int planeCount = 0;
+  if (_hfov < IGN_PI)
+  {
+    const double halfHorz = _hfov / 2;
+    const double tanVert = tan(_vfov / 2) * cos(halfHorz / std::max(_fovTiles, 1)) / cos(halfHorz);
+    planes[planeCount++] = forward * sin(halfHorz) - right * cos(halfHorz);
+    planes[planeCount++] = forward * sin(halfHorz) + right * cos(halfHorz);
+    planes[planeCount++] = forward * tanVert - up;
+    planes[planeCount++] = forward * tanVert + up;
+  }
+
+  this->visibleInstances.clear();
+  for (size_t i = 0; i < this->instances.size(); ++i)
+  {
+    const Instance &instance = this->instances[i];
+    const ignition::math::Vector3d min = instance.worldMin - _pose.Pos();
+    const ignition::math::Vector3d max = instance.worldMax - _pose.Pos();
+
+    // Beyond the far clip distance
+    double distance = 0;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      double gap = std::max(std::max(min[axis], -max[axis]), 0.0);
+      distance += gap * gap;
+    }
+    if (distance > _far * _far)
+      continue;
+
+    // Outside a side plane: even the farthest corner along its normal
+    bool outside = false;
+    for (int p = 0; p < planeCount && !outside; ++p)
+    {
+      double farthest = 0;
+      for (int axis = 0; axis < 3; ++axis)
+        farthest += planes[p][axis] * (planes[p][axis] > 0 ? max[axis] : min[axis]);
+      outside = farthest < 0;
+    }
+    if (outside)
+      continue;
+
+    VisibleInstance visible;
+    visible.instance = i;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      visible.worldMin[axis] = instance.worldMin[axis];
+      visible.worldMax[axis] = instance.worldMax[axis];
+    }
+    visible.localOrigin = instance.pose.Rot().RotateVectorReverse(_pose.Pos() - instance.pose.Pos());
+    this->visibleInstances.push_back(visible);
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarRayCaster::Render(const ignition::math::Pose3d &_pose,
+                            const double _hfov, const double _vfov,
+                            const double _near, const double _far,
+                            cv::Mat &_image, SonarThreadPool &_threadPool,
+                            const int _fovTiles)
+{
+  GZ_ASSERT(_image.depth() == CV_32F && (_image.channels() == 2 || _image.channels() == 3),
+            "Sonar shader images are 2 or 3 float channels");
+
+  const int rows = _image.rows;
+  const int cols = _image.cols;
+  const int channels = _image.channels();
+  const int intensityChannel = channels == 3 ? 2 : 0;
+  const int depthChannel = 1;
+
+  // Same projection as the sonar camera: the camera looks along +X, and
+  // the view space of the shader has x right, y up and z backwards
+  const ignition::math::Vector3d forward = _pose.Rot().RotateVector(ignition::math::Vector3d::UnitX);
+  const ignition::math::Vector3d right = -_pose.Rot().RotateVector(ignition::math::Vector3d::UnitY);
+  const ignition::math::Vector3d up = _pose.Rot().RotateVector(ignition::math::Vector3d::UnitZ);
+  const double tanVert = tan(_vfov / 2);
+
+  // Each field of view tile is a camera yawed to the center of its columns
+  const int fovTiles = std::max(_fovTiles, 1);
+  const int fovTileWidth = cols / fovTiles;
+  const double tanHorz = tan(_hfov / fovTiles / 2);
+
+  const int tilesX = (cols + kTileSize - 1) / kTileSize;
+  const int tilesY = (rows + kTileSize - 1) / kTileSize;
+
+  this->CullInstances(_pose, _hfov, _vfov, _far, fovTiles);
+
+  _threadPool.ParallelFor(tilesX * tilesY,
+    [&](size_t _begin, size_t _end, size_t /*_worker*/)
+  {
+    for (size_t tile = _begin; tile < _end; ++tile)
+    {
+      const int rowBegin = (tile / tilesX) * kTileSize;
+      const int colBegin = (tile % tilesX) * kTileSize;
+      const int rowEnd = std::min(rowBegin + kTileSize, rows);
+      const int colEnd = std::min(colBegin + kTileSize, cols);
+
+      for (int row = rowBegin; row < rowEnd; ++row)
+      {
+        float *pixels = _image.ptr<float>(row);
+        const double y = (1.0 - 2.0 * (row + 0.5) / rows) * tanVert;
+
+        for (int col = colBegin; col < colEnd; ++col)
+        {
+          const int fovTile = std::min(col / fovTileWidth, fovTiles - 1);
+          const double x = (2.0 * (col - fovTile * fovTileWidth + 0.5) / fovTileWidth - 1.0) * tanHorz;
+          const double yaw = _hfov * (-1.0 / 2 + (fovTile + 0.5) / fovTiles);
+
+          // Forward component of the unit direction along the axis of the
+          // tile is 1 / length, so the near plane is at near * length along
+          // the ray
+          ignition::math::Vector3d dir = forward * (cos(yaw) - x * sin(yaw)) +
+                                         right * (sin(yaw) + x * cos(yaw)) + up * y;
+          const double length = dir.Length();
+          dir /= length;
+          const float tMin = _near * length;
+
+          Hit hit;
+          hit.t = _far;
+          hit.instance = -1;
+
+          Ray worldRay;
+          for (int axis = 0; axis < 3; ++axis)
+          {
+            worldRay.origin[axis] = _pose.Pos()[axis];
+            worldRay.dir[axis] = dir[axis];
+            worldRay.invDir[axis] = 1.0f / (dir[axis] != 0 ? dir[axis] : 1e-30);
+          }
+
+          for (const VisibleInstance &visible : this->visibleInstances)
+          {
+            float tEntry;
+            if (!IntersectBox(visible.worldMin, visible.worldMax, worldRay.origin,
+                              worldRay.invDir, hit.t, tEntry))
+              continue;
+
+            // Rigid transform, distances along the ray are the same locally
+            const Instance &instance = this->instances[visible.instance];
+            ignition::math::Vector3d localDir = instance.pose.Rot().RotateVectorReverse(dir);
+
+            Ray localRay;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+              localRay.origin[axis] = visible.localOrigin[axis];
+              localRay.dir[axis] = localDir[axis];
+              localRay.invDir[axis] = 1.0f / (localDir[axis] != 0 ? localDir[axis] : 1e-30);
+            }
+            this->Intersect(visible.instance, localRay, tMin, hit);
+          }
+
+          float *pixel = pixels + col * channels;
+          std::fill(pixel, pixel + channels, 0.0f);
+          if (hit.instance < 0)
+            continue;
+
+          // Shade as normal_depth_map.frag, in view space
+          const Instance &instance = this->instances[hit.instance];
+          const ignition::math::Vector3d *normals = &instance.normals[3 * hit.triangle];
+          ignition::math::Vector3d normal = instance.pose.Rot().RotateVector(
+            normals[0] * (1.0 - hit.u - hit.v) + normals[1] * hit.u + normals[2] * hit.v);
+          normal.Normalize();
+
+          ignition::math::Vector3d viewNormal(normal.Dot(right), normal.Dot(up), -normal.Dot(forward));
+          ignition::math::Vector3d viewDir(dir.Dot(right), dir.Dot(up), -dir.Dot(forward));
+          if (instance.reflectance > 0)
+          {
+            viewNormal *= instance.reflectance;
+            viewNormal.Min(ignition::math::Vector3d::One);
+          }
+
+          pixel[intensityChannel] = std::abs(viewDir.Dot(viewNormal));
+          pixel[depthChannel] = hit.t / _far;
+        }
+      }
+    }
+  });
+}
+}  // namespace rendering
+}  // namespace gazebo
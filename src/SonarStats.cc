@@ -0,0 +1,114 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+
+#include "forward_looking_sonar_gazebo/SonarStats.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+
+//////////////////////////////////////////////////
+SonarStats::ScopedTimer::ScopedTimer(SonarStats *_stats, const Stage _stage)
+  : stats(_stats),
+    stage(_stage)
+{
+  if (this->stats)
+    this->start = std::chrono::steady_clock::now();
+}
+
+//////////////////////////////////////////////////
+SonarStats::ScopedTimer::~ScopedTimer()
+{
+  if (this->stats)
+    this->stats->Record(this->stage, SonarStats::Elapsed(this->start));
+}
+
+//////////////////////////////////////////////////
+SonarStats::SonarStats(const size_t _window)
+{
+  for (auto &window : this->windows)
+  {
+    window.samples.reserve(std::max<size_t>(_window, 1));
+    window.count = 0;
+  }
+  this->sorted.reserve(std::max<size_t>(_window, 1));
+}
+
+//////////////////////////////////////////////////
+void SonarStats::Record(const Stage _stage, const double _seconds)
+{
+  Window &window = this->windows[_stage];
+  std::lock_guard<std::mutex> lock(window.mutex);
+
+  // Fill the ring up to its capacity, then overwrite the oldest sample
+  if (window.samples.size() < window.samples.capacity())
+    window.samples.push_back(_seconds);
+  else
+    window.samples[window.count % window.samples.size()] = _seconds;
+  window.count++;
+}
+
+//////////////////////////////////////////////////
+SonarStats::Summary SonarStats::Summarize(const Stage _stage)
+{
+  Summary summary = {0, 0, 0, 0, 0};
+
+  Window &window = this->windows[_stage];
+  {
+    std::lock_guard<std::mutex> lock(window.mutex);
+    summary.count = window.count;
+    this->sorted.assign(window.samples.begin(), window.samples.end());
+  }
+
+  if (this->sorted.empty())
+    return summary;
+
+  std::sort(this->sorted.begin(), this->sorted.end());
+  auto percentile = [this](const double _p)
+  {
+    size_t index = static_cast<size_t>(_p * (this->sorted.size() - 1) + 0.5);
+    return static_cast<double>(this->sorted[index]);
+  };
+
+  summary.p50 = percentile(0.50);
+  summary.p95 = percentile(0.95);
+  summary.p99 = percentile(0.99);
+  summary.max = this->sorted.back();
+  return summary;
+}
+
+//////////////////////////////////////////////////
+const char *SonarStats::StageName(const Stage _stage)
+{
+  switch (_stage)
+  {
+    case RENDER:
+      return "render";
+    case READBACK:
+      return "readback";
+    case REMAP:
+      return "remap";
+    case BINNING:
+      return "binning";
+    case NOISE_BLUR:
+      return "noise_blur";
+    case POLAR:
+      return "polar";
+    case COLORMAP:
+      return "colormap";
+    case PUBLISH:
+      return "publish";
+    default:
+      return "unknown";
+  }
+}
+
+//////////////////////////////////////////////////
+double SonarStats::Elapsed(const std::chrono::steady_clock::time_point &_start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+}
+}  // namespace rendering
+}  // namespace gazebo
@@ -0,0 +1,132 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <algorithm>
+
+#include "forward_looking_sonar_gazebo/SonarThreadPool.hh"
+
+namespace gazebo
+{
+namespace rendering
+{
+
+//////////////////////////////////////////////////
+SonarThreadPool::SonarThreadPool(const size_t _size)
+  : job(nullptr),
+    jobCount(0),
+    generation(0),
+    pending(0),
+    stop(false)
+{
+  size_t size = _size;
+  if (size == 0)
+    size = std::max(std::thread::hardware_concurrency(), 1u);
+
+  for (size_t i = 1; i < size; ++i)
+    this->threads.push_back(std::thread(&SonarThreadPool::Run, this, i));
+}
+
+//////////////////////////////////////////////////
+SonarThreadPool::~SonarThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stop = true;
+  }
+  this->startCondition.notify_all();
+
+  for (auto &thread : this->threads)
+    thread.join();
+}
+
+//////////////////////////////////////////////////
+size_t SonarThreadPool::Size() const
+{
+  return this->threads.size() + 1;
+}
+
+//////////////////////////////////////////////////
+std::shared_ptr<SonarThreadPool> SonarThreadPool::Shared()
+{
+  static std::mutex sharedMutex;
+  static std::weak_ptr<SonarThreadPool> shared;
+
+  std::lock_guard<std::mutex> lock(sharedMutex);
+  std::shared_ptr<SonarThreadPool> pool = shared.lock();
+  if (!pool)
+  {
+    pool.reset(new SonarThreadPool());
+    shared = pool;
+  }
+  return pool;
+}
+
+//////////////////////////////////////////////////
+void SonarThreadPool::ParallelFor(const size_t _count,
+                                  const RangeFunction &_function)
+{
+  if (_count == 0)
+    return;
+
+  if (this->threads.empty() || _count == 1)
+  {
+    _function(0, _count, 0);
+    return;
+  }
+
+  std::lock_guard<std::mutex> callLock(this->callMutex);
+
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->job = &_function;
+    this->jobCount = _count;
+    this->pending = this->threads.size();
+    this->generation++;
+  }
+  this->startCondition.notify_all();
+
+  this->RunChunk(0);
+
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->doneCondition.wait(lock, [this] { return this->pending == 0; });
+  this->job = nullptr;
+}
+
+//////////////////////////////////////////////////
+void SonarThreadPool::Run(const size_t _worker)
+{
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> lock(this->mutex);
+
+  while (true)
+  {
+    this->startCondition.wait(lock, [this, &seen]
+    {
+      return this->stop || this->generation != seen;
+    });
+
+    if (this->stop)
+      return;
+
+    seen = this->generation;
+
+    lock.unlock();
+    this->RunChunk(_worker);
+    lock.lock();
+
+    if (--this->pending == 0)
+      this->doneCondition.notify_one();
+  }
+}
+
+//////////////////////////////////////////////////
+void SonarThreadPool::RunChunk(const size_t _worker)
+{
+  size_t size = this->Size();
+  size_t begin = this->jobCount * _worker / size;
+  size_t end = this->jobCount * (_worker + 1) / size;
+
+  if (begin < end)
+    (*this->job)(begin, end, _worker);
+}
+}  // namespace rendering
+}  // namespace gazebo
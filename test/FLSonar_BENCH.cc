@@ -0,0 +1,292 @@
+// Copyright 2018 Brazilian Intitute of Robotics"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <sensor_msgs/Image.h>
+#include <forward_looking_sonar_gazebo/SonarColorMap.hh>
+#include <forward_looking_sonar_gazebo/SonarProcessor.hh>
+#include <forward_looking_sonar_gazebo/SonarPsf.hh>
+
+// OpenCV includes
+#include <opencv2/opencv.hpp>
+
+using namespace gazebo;
+
+/////////////////////////////////////////////////
+// Heap traffic of the benchmarked code. OpenCV allocates with malloc, not
+// operator new, so malloc itself is wrapped.
+static std::atomic<uint64_t> allocatedBytes(0);
+static std::atomic<uint64_t> allocationCount(0);
+
+#ifdef __GLIBC__
+extern "C"
+{
+void *__libc_malloc(size_t _size);
+void *__libc_calloc(size_t _count, size_t _size);
+void *__libc_realloc(void *_ptr, size_t _size);
+void *__libc_memalign(size_t _alignment, size_t _size);
+
+void *malloc(size_t _size)
+{
+  allocatedBytes.fetch_add(_size, std::memory_order_relaxed);
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(_size);
+}
+
+void *calloc(size_t _count, size_t _size)
+{
+  allocatedBytes.fetch_add(_count * _size, std::memory_order_relaxed);
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(_count, _size);
+}
+
+void *realloc(void *_ptr, size_t _size)
+{
+  allocatedBytes.fetch_add(_size, std::memory_order_relaxed);
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(_ptr, _size);
+}
+
+int posix_memalign(void **_ptr, size_t _alignment, size_t _size)
+{
+  allocatedBytes.fetch_add(_size, std::memory_order_relaxed);
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  *_ptr = __libc_memalign(_alignment, _size);
+  return *_ptr ? 0 : ENOMEM;
+}
+}
+#endif
+
+/////////////////////////////////////////////////
+/// \brief Sonar processor with its stages callable one by one
+class BenchProcessor : public rendering::SonarProcessor
+{
+public:
+  using rendering::SonarProcessor::CvToSonarBin;
+  using rendering::SonarProcessor::GenerateTransferTable;
+  using rendering::SonarProcessor::TransferTableToSonar;
+  using rendering::SonarProcessor::UpdateTransferTable;
+};
+
+/////////////////////////////////////////////////
+/// \brief Benchmark arguments: shader image width and height, beam count
+/// and bin count
+static void SonarSizes(benchmark::internal::Benchmark *_bench)
+{
+  const int images[][2] = {{512, 256}, {720, 720}, {1024, 512}, {2048, 1024}};
+  const int counts[][2] = {{256, 256}, {720, 720}};
+  for (auto &image : images)
+    for (auto &count : counts)
+      _bench->Args({image[0], image[1], count[0], count[1]});
+}
+
+/////////////////////////////////////////////////
+/// \brief Configure a processor for the benchmark arguments and fill a
+/// synthetic R32G32B32 shader image: (0, depth, intensity)
+static void SetUpProcessor(benchmark::State &_state, BenchProcessor &_processor,
+                           cv::Mat &_image)
+{
+  _processor.SetHorzFOV(1.1);
+  _processor.SetVertFOV(0.78539816339);
+  _processor.SetImageWidth(_state.range(0));
+  _processor.SetImageHeight(_state.range(1));
+  _processor.SetBeamCount(_state.range(2));
+  _processor.SetBinCount(_state.range(3));
+  _processor.UpdateTransferTable();
+
+  _processor.FitShaderImage(_image);
+  cv::RNG rng(42);
+  std::vector<cv::Mat> planes(3);
+  planes[0] = cv::Mat::zeros(_image.rows, _image.cols, CV_32FC1);
+  planes[1].create(_image.rows, _image.cols, CV_32FC1);
+  planes[2].create(_image.rows, _image.cols, CV_32FC1);
+  rng.fill(planes[1], cv::RNG::UNIFORM, 0, 1);
+  rng.fill(planes[2], cv::RNG::UNIFORM, 0, 1);
+  cv::merge(planes, _image);
+
+  // Warm up, so the buffers are sized before measuring
+  _processor.Process(_image);
+}
+
+/////////////////////////////////////////////////
+/// \brief Start counting the heap traffic of the measured loop
+static void StartAllocationCount()
+{
+  allocatedBytes = 0;
+  allocationCount = 0;
+}
+
+/////////////////////////////////////////////////
+/// \brief Report the heap traffic per frame
+static void ReportAllocations(benchmark::State &_state)
+{
+  _state.counters["bytes_alloc"] = benchmark::Counter(
+    allocatedBytes.load(), benchmark::Counter::kAvgIterations);
+  _state.counters["allocs"] = benchmark::Counter(
+    allocationCount.load(), benchmark::Counter::kAvgIterations);
+}
+
+/////////////////////////////////////////////////
+static void BM_CvToSonarBin(benchmark::State &_state)
+{
+  BenchProcessor processor;
+  cv::Mat image;
+  SetUpProcessor(_state, processor, image);
+  std::vector<float> accumData(processor.AccumData());
+
+  StartAllocationCount();
+  for (auto _ : _state)
+  {
+    processor.CvToSonarBin(accumData);
+    benchmark::DoNotOptimize(accumData.data());
+  }
+  ReportAllocations(_state);
+}
+BENCHMARK(BM_CvToSonarBin)->Apply(SonarSizes)->Unit(benchmark::kMicrosecond);
+
+/////////////////////////////////////////////////
+static void BM_GenerateTransferTable(benchmark::State &_state)
+{
+  BenchProcessor processor;
+  cv::Mat image;
+  SetUpProcessor(_state, processor, image);
+  rendering::SonarProcessor::TransferTable transfer;
+
+  StartAllocationCount();
+  for (auto _ : _state)
+  {
+    processor.GenerateTransferTable(transfer);
+    benchmark::DoNotOptimize(transfer.pixels.data());
+  }
+  ReportAllocations(_state);
+}
+BENCHMARK(BM_GenerateTransferTable)->Apply(SonarSizes)->Unit(benchmark::kMicrosecond);
+
+/////////////////////////////////////////////////
+static void BM_TransferTableToSonar(benchmark::State &_state)
+{
+  BenchProcessor processor;
+  cv::Mat image;
+  SetUpProcessor(_state, processor, image);
+  rendering::SonarProcessor::TransferTable transfer;
+  processor.GenerateTransferTable(transfer);
+  std::vector<float> accumData(processor.AccumData());
+
+  StartAllocationCount();
+  for (auto _ : _state)
+  {
+    processor.TransferTableToSonar(accumData, transfer);
+    benchmark::ClobberMemory();
+  }
+  ReportAllocations(_state);
+}
+BENCHMARK(BM_TransferTableToSonar)->Apply(SonarSizes)->Unit(benchmark::kMicrosecond);
+
+/////////////////////////////////////////////////
+static void BM_TransferTableToSonarBilinear(benchmark::State &_state)
+{
+  BenchProcessor processor;
+  cv::Mat image;
+  processor.SetBilinearScanConversion(true);
+  SetUpProcessor(_state, processor, image);
+  rendering::SonarProcessor::TransferTable transfer;
+  processor.GenerateTransferTable(transfer);
+  std::vector<float> accumData(processor.AccumData());
+
+  StartAllocationCount();
+  for (auto _ : _state)
+  {
+    processor.TransferTableToSonar(accumData, transfer);
+    benchmark::ClobberMemory();
+  }
+  ReportAllocations(_state);
+}
+BENCHMARK(BM_TransferTableToSonarBilinear)->Apply(SonarSizes)->Unit(benchmark::kMicrosecond);
+
+/////////////////////////////////////////////////
+/// \brief Point spread arguments: beam count, bin count and box mode
+static void PsfSizes(benchmark::internal::Benchmark *_bench)
+{
+  const int counts[][2] = {{256, 256}, {720, 720}, {1024, 2048}};
+  for (auto &count : counts)
+    for (int box = 0; box < 2; ++box)
+      _bench->Args({count[0], count[1], box});
+}
+
+/////////////////////////////////////////////////
+static void BM_Psf(benchmark::State &_state)
+{
+  cv::Mat bins(_state.range(0), _state.range(1), CV_32FC1);
+  cv::RNG rng(42);
+  rng.fill(bins, cv::RNG::UNIFORM, 0, 1);
+  std::vector<float> accumData(bins.total());
+
+  rendering::SonarThreadPool threadPool;
+  rendering::SonarPsf psf;
+  psf.SetMode(_state.range(2) ? rendering::SonarPsf::BOX : rendering::SonarPsf::GAUSSIAN);
+  psf.Apply(bins, accumData.data(), threadPool);
+
+  StartAllocationCount();
+  for (auto _ : _state)
+  {
+    psf.Apply(bins, accumData.data(), threadPool);
+    benchmark::DoNotOptimize(accumData.data());
+  }
+  ReportAllocations(_state);
+}
+BENCHMARK(BM_Psf)->Apply(PsfSizes)->Unit(benchmark::kMicrosecond);
+
+/////////////////////////////////////////////////
+// Same conversions as FLSonarRos::PublishSonar, up to the image message
+static void BM_ColorMapPublish(benchmark::State &_state)
+{
+  BenchProcessor processor;
+  cv::Mat image;
+  SetUpProcessor(_state, processor, image);
+  cv::Mat sonarImage = processor.SonarImage();
+  cv::Mat sonarMask = processor.SonarMask();
+  rendering::SonarColorMap colorMap;
+  sensor_msgs::ImagePtr msg(new sensor_msgs::Image());
+
+  StartAllocationCount();
+  for (auto _ : _state)
+  {
+    msg->height = sonarImage.rows;
+    msg->width = sonarImage.cols;
+    msg->encoding = "bgr8";
+    msg->step = sonarImage.cols * 3;
+    msg->data.resize(msg->step * msg->height);
+    cv::Mat msgImage(msg->height, msg->width, CV_8UC3, msg->data.data(), msg->step);
+
+    colorMap.Apply(sonarImage, sonarMask, msgImage);
+    benchmark::DoNotOptimize(msg->data.data());
+  }
+  ReportAllocations(_state);
+}
+BENCHMARK(BM_ColorMapPublish)->Apply(SonarSizes)->Unit(benchmark::kMicrosecond);
+
+/////////////////////////////////////////////////
+static void BM_ProcessFrame(benchmark::State &_state)
+{
+  BenchProcessor processor;
+  cv::Mat image;
+  SetUpProcessor(_state, processor, image);
+  sonar_msgs::SonarStamped msg;
+
+  StartAllocationCount();
+  for (auto _ : _state)
+  {
+    processor.Process(image);
+    processor.FillSonarRosMsg(msg, common::Time());
+    benchmark::DoNotOptimize(msg.data.data());
+  }
+  ReportAllocations(_state);
+}
+BENCHMARK(BM_ProcessFrame)->Apply(SonarSizes)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
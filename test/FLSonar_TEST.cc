@@ -1,5 +1,13 @@
 // Copyright 2018 Brazilian Intitute of Robotics"
 
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <numeric>
+
 #include <gtest/gtest.h>
 #include "gazebo/rendering/Camera.hh"
 #include "gazebo/rendering/RenderingIface.hh"
@@ -8,14 +16,74 @@
 #include "gazebo/rendering/ogre_gazebo.h"
 #include "gazebo/test/ServerFixture.hh"
 #include "gazebo/common/MeshManager.hh"
+#include "ignition/math/Helpers.hh"
 #include "ignition/math/Vector3.hh"
 
 #include <forward_looking_sonar_gazebo/FLSonar.hh>
+#include <forward_looking_sonar_gazebo/SonarBinKernel.hh>
+#include <forward_looking_sonar_gazebo/SonarColorMap.hh>
+#include <forward_looking_sonar_gazebo/SonarNoise.hh>
+#include <forward_looking_sonar_gazebo/SonarPipeline.hh>
+#include <forward_looking_sonar_gazebo/SonarPsf.hh>
+#include <forward_looking_sonar_gazebo/SonarRangeGain.hh>
+#include <forward_looking_sonar_gazebo/SonarRayCaster.hh>
+#include <forward_looking_sonar_gazebo/SonarStats.hh>
 
 // OpenCV includes
 #include <opencv2/opencv.hpp>
 
 using namespace gazebo;
+
+/////////////////////////////////////////////////
+// Heap allocations of the process, as in FLSonar_BENCH. OpenCV allocates
+// with malloc, not operator new, so malloc itself is wrapped.
+static std::atomic<uint64_t> allocationCount(0);
+
+#ifdef __GLIBC__
+extern "C"
+{
+void *__libc_malloc(size_t _size);
+void *__libc_calloc(size_t _count, size_t _size);
+void *__libc_realloc(void *_ptr, size_t _size);
+void *__libc_memalign(size_t _alignment, size_t _size);
+
+void *malloc(size_t _size)
+{
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(_size);
+}
+
+void *calloc(size_t _count, size_t _size)
+{
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(_count, _size);
+}
+
+void *realloc(void *_ptr, size_t _size)
+{
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(_ptr, _size);
+}
+
+int posix_memalign(void **_ptr, size_t _alignment, size_t _size)
+{
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  *_ptr = __libc_memalign(_alignment, _size);
+  return *_ptr ? 0 : ENOMEM;
+}
+}
+#endif
+
+/////////////////////////////////////////////////
+/// \brief Sonar processor scan converting bins given by the test
+class ScanConvertProcessor : public rendering::SonarProcessor
+{
+public:
+  using rendering::SonarProcessor::TransferTableToSonar;
+  using rendering::SonarProcessor::UpdateTransferTable;
+  using rendering::SonarProcessor::transferTable;
+};
+
 class Sonar_TEST: public RenderingFixture
 {
 protected:
@@ -424,6 +492,1124 @@ TEST_F(Sonar_TEST, ConeDraw)
   ASSERT_TRUE(CompareImages(shaderOutput,shaderRef,5e-3));
 }
 
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, SphereDrawReadbackRing)
+{
+  std::string programsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/programs";
+  gazebo::common::SystemPaths::Instance()->AddGazeboPaths(programsFolder.c_str());
+
+  std::string materialsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/scripts";
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          materialsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          programsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().initialiseResourceGroup(
+          "General");
+
+
+  Load("worlds/heightmap.world",false);
+
+  gazebo::rendering::ScenePtr scene = gazebo::rendering::get_scene("default");
+
+  if (!scene)
+      scene = gazebo::rendering::create_scene("default", true);
+
+  SetUp();
+  ASSERT_TRUE(scene != nullptr);
+
+
+  std::stringstream newSonarSS;
+  newSonarSS <<"<sdf version='1.6'>"
+      << "<plugin name='SonarVisual' filename='libfl_sonar_ros.so' >"
+      << "<horizontal_fov>1.1</horizontal_fov>"
+      << "<vfov>0.78539816339</vfov>"
+      << "<bin_count>720</bin_count>"
+      << "<beam_count>720</beam_count>"
+      << "<image>"
+      << "  <width>720</width>"
+      << "  <height>720</height>"
+      << "  <format>R32G32B32</format>"
+      << "</image>"
+      << "<clip>"
+      << "  <near>0.1</near>"
+      << "  <far>3</far>"
+      << "</clip>"
+      << "<readback>"
+      << "  <buffers>3</buffers>"
+      << "</readback>"
+      << "</plugin>"
+      << "</sdf>";
+
+  sdf::ElementPtr FLSonarSDF(new sdf::Element);
+  sdf::initFile("plugin.sdf", FLSonarSDF);
+  sdf::readString(newSonarSS.str(), FLSonarSDF);
+
+  rendering::FLSonar *flSonar = new rendering::FLSonar("test_sonar",scene,false);
+  flSonar->Init();
+  flSonar->Load(FLSonarSDF);
+  flSonar->CreateTexture("GPUTexture");
+
+  ignition::math::Pose3d sonarPose(0,0,3,0,M_PI/2,M_PI/2);
+
+  SpawnOgreSphere(scene,ignition::math::Vector3d(0,0,1));
+
+  // The readback lags two renders behind, fill the whole ring first
+  for (int i = 0; i < 3; i++)
+  {
+    flSonar->PreRender(sonarPose);
+    flSonar->RenderImpl();
+  }
+  flSonar->GetSonarImage();
+  flSonar->PostRender();
+
+  cv::Mat shaderOutput = flSonar->ShaderImage();
+  cv::Mat shaderMask = cv::Mat::zeros(shaderOutput.rows,shaderOutput.cols, CV_8UC1);
+  cv::Mat shaderRef = cv::Mat::zeros(shaderOutput.rows,shaderOutput.cols, CV_32FC3);
+
+  GetCVValuesSphere(shaderRef,shaderMask);
+
+  ApplyMask(shaderOutput,shaderMask);
+
+  ASSERT_TRUE(CompareImages(shaderOutput,shaderRef,5e-3));
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, SphereDrawCompactTexture)
+{
+  std::string programsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/programs";
+  gazebo::common::SystemPaths::Instance()->AddGazeboPaths(programsFolder.c_str());
+
+  std::string materialsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/scripts";
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          materialsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          programsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().initialiseResourceGroup(
+          "General");
+
+
+  Load("worlds/heightmap.world",false);
+
+  gazebo::rendering::ScenePtr scene = gazebo::rendering::get_scene("default");
+
+  if (!scene)
+      scene = gazebo::rendering::create_scene("default", true);
+
+  SetUp();
+  ASSERT_TRUE(scene != nullptr);
+
+
+  // The compact sonar against a three channel one of the same scene
+  const char *formats[2] = {"R32G32", "R32G32B32"};
+  rendering::FLSonar *sonars[2];
+  for (int i = 0; i < 2; i++)
+  {
+    std::stringstream newSonarSS;
+    newSonarSS <<"<sdf version='1.6'>"
+        << "<plugin name='SonarVisual' filename='libfl_sonar_ros.so' >"
+        << "<horizontal_fov>1.1</horizontal_fov>"
+        << "<vfov>0.78539816339</vfov>"
+        << "<bin_count>720</bin_count>"
+        << "<beam_count>720</beam_count>"
+        << "<image>"
+        << "  <width>720</width>"
+        << "  <height>720</height>"
+        << "  <format>" << formats[i] << "</format>"
+        << "</image>"
+        << "<clip>"
+        << "  <near>0.1</near>"
+        << "  <far>3</far>"
+        << "</clip>"
+        << "</plugin>"
+        << "</sdf>";
+
+    sdf::ElementPtr FLSonarSDF(new sdf::Element);
+    sdf::initFile("plugin.sdf", FLSonarSDF);
+    sdf::readString(newSonarSS.str(), FLSonarSDF);
+
+    sonars[i] = new rendering::FLSonar(i ? "test_sonar_rgb" : "test_sonar", scene, false);
+    sonars[i]->Init();
+    sonars[i]->Load(FLSonarSDF);
+    sonars[i]->CreateTexture("GPUTexture");
+    sonars[i]->Processor().Noise().SetStdDev(0);
+  }
+
+  // Three channels where the render system can not render R32G32, the
+  // processor has to follow either way
+  ASSERT_EQ(sonars[0]->TextureChannels(), sonars[0]->Processor().ShaderChannels());
+  ASSERT_EQ(sonars[1]->TextureChannels(), 3);
+
+  ignition::math::Pose3d sonarPose(0,0,3,0,M_PI/2,M_PI/2);
+
+  SpawnOgreSphere(scene,ignition::math::Vector3d(0,0,1));
+
+  std::vector<float> accumData[2];
+  for (int i = 0; i < 2; i++)
+  {
+    sonars[i]->PreRender(sonarPose);
+    sonars[i]->RenderImpl();
+    sonars[i]->GetSonarImage();
+    sonars[i]->PostRender();
+    accumData[i] = sonars[i]->Processor().AccumData();
+  }
+
+  // Swapped channels bin the intensity by the depth, far from the three
+  // channel beams
+  ASSERT_EQ(accumData[0].size(), accumData[1].size());
+  double difference = 0;
+  double total = 0;
+  for (size_t i = 0; i < accumData[0].size(); i++)
+  {
+    difference += std::abs(accumData[0][i] - accumData[1][i]);
+    total += std::abs(accumData[1][i]);
+  }
+  ASSERT_GT(total, 0);
+  ASSERT_LT(difference / total, 1e-3);
+
+  // Same shader image as the R32G32B32 texture of SphereDraw
+  cv::Mat shaderOutput = sonars[1]->ShaderImage();
+  cv::Mat shaderMask = cv::Mat::zeros(shaderOutput.rows,shaderOutput.cols, CV_8UC1);
+  cv::Mat shaderRef = cv::Mat::zeros(shaderOutput.rows,shaderOutput.cols, CV_32FC3);
+
+  GetCVValuesSphere(shaderRef,shaderMask);
+
+  ApplyMask(shaderOutput,shaderMask);
+
+  ASSERT_TRUE(CompareImages(shaderOutput,shaderRef,5e-3));
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, SteadyStateAllocations)
+{
+  std::string programsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/programs";
+  gazebo::common::SystemPaths::Instance()->AddGazeboPaths(programsFolder.c_str());
+
+  std::string materialsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/scripts";
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          materialsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          programsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().initialiseResourceGroup(
+          "General");
+
+
+  Load("worlds/heightmap.world",false);
+
+  gazebo::rendering::ScenePtr scene = gazebo::rendering::get_scene("default");
+
+  if (!scene)
+      scene = gazebo::rendering::create_scene("default", true);
+
+  SetUp();
+  ASSERT_TRUE(scene != nullptr);
+
+
+  std::stringstream newSonarSS;
+  newSonarSS <<"<sdf version='1.6'>"
+      << "<plugin name='SonarVisual' filename='libfl_sonar_ros.so' >"
+      << "<horizontal_fov>1.1</horizontal_fov>"
+      << "<vfov>0.78539816339</vfov>"
+      << "<bin_count>720</bin_count>"
+      << "<beam_count>720</beam_count>"
+      << "<image>"
+      << "  <width>720</width>"
+      << "  <height>720</height>"
+      << "  <format>R32G32B32</format>"
+      << "</image>"
+      << "<clip>"
+      << "  <near>0.1</near>"
+      << "  <far>3</far>"
+      << "</clip>"
+      << "</plugin>"
+      << "</sdf>";
+
+  sdf::ElementPtr FLSonarSDF(new sdf::Element);
+  sdf::initFile("plugin.sdf", FLSonarSDF);
+  sdf::readString(newSonarSS.str(), FLSonarSDF);
+
+  rendering::FLSonar *flSonar = new rendering::FLSonar("test_sonar",scene,false);
+  flSonar->Init();
+  flSonar->Load(FLSonarSDF);
+  flSonar->CreateTexture("GPUTexture");
+
+  ignition::math::Pose3d sonarPose(0,0,3,0,M_PI/2,M_PI/2);
+
+  SpawnOgreSphere(scene,ignition::math::Vector3d(0,0,1));
+
+  // Warm up, then no frame should grow a buffer any more. Ogre allocates
+  // on its own, the heap itself is checked by SteadyStateHeap
+  flSonar->PreRender(sonarPose);
+  flSonar->RenderImpl();
+  flSonar->GetSonarImage();
+  flSonar->PostRender();
+
+  uint64_t allocations = flSonar->AllocationCount();
+  for (int i = 0; i < 3; i++)
+  {
+    flSonar->PreRender(sonarPose);
+    flSonar->RenderImpl();
+    flSonar->GetSonarImage();
+    flSonar->PostRender();
+  }
+
+  ASSERT_EQ(flSonar->AllocationCount(), allocations);
+}
+
+/////////////////////////////////////////////////
+#ifdef __GLIBC__
+TEST_F(Sonar_TEST, SteadyStateHeap)
+{
+  // No world is loaded, so no other thread of the process allocates while
+  // the frames are counted
+  rendering::SonarProcessor processor;
+  processor.SetHorzFOV(1.1);
+  processor.SetVertFOV(0.78539816339);
+  processor.SetImageWidth(256);
+  processor.SetImageHeight(256);
+  processor.SetBeamCount(64);
+  processor.SetBinCount(128);
+  processor.SetThreadCount(4);
+
+  cv::Mat rawImage;
+  processor.FitShaderImage(rawImage);
+  cv::RNG rng(42);
+  rng.fill(rawImage, cv::RNG::UNIFORM, 0, 1);
+
+  // Warm up, then no frame should touch the heap any more
+  processor.Process(rawImage);
+  processor.Reprocess();
+
+  uint64_t allocations = allocationCount.load();
+  for (int i = 0; i < 3; i++)
+  {
+    processor.Process(rawImage);
+    processor.Reprocess();
+  }
+
+  ASSERT_EQ(allocationCount.load(), allocations);
+}
+#endif
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, SphereDrawGpuBinning)
+{
+  std::string programsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/programs";
+  gazebo::common::SystemPaths::Instance()->AddGazeboPaths(programsFolder.c_str());
+
+  std::string materialsFolder = std::string(OGRE_MEDIA_PATH) + "/materials/scripts";
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          materialsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().addResourceLocation(
+          programsFolder.c_str(), "FileSystem", "General", true);
+
+  Ogre::ResourceGroupManager::getSingleton().initialiseResourceGroup(
+          "General");
+
+
+  Load("worlds/heightmap.world",false);
+
+  gazebo::rendering::ScenePtr scene = gazebo::rendering::get_scene("default");
+
+  if (!scene)
+      scene = gazebo::rendering::create_scene("default", true);
+
+  SetUp();
+  ASSERT_TRUE(scene != nullptr);
+
+  // Same sonar binned on the CPU and on the GPU
+  rendering::FLSonar *sonars[2];
+  for (int i = 0; i < 2; i++)
+  {
+    std::stringstream newSonarSS;
+    newSonarSS <<"<sdf version='1.6'>"
+        << "<plugin name='SonarVisual' filename='libfl_sonar_ros.so' >"
+        << "<horizontal_fov>1.1</horizontal_fov>"
+        << "<vfov>0.78539816339</vfov>"
+        << "<bin_count>256</bin_count>"
+        << "<beam_count>256</beam_count>"
+        << "<binning>" << (i ? "gpu" : "cpu") << "</binning>"
+        << "<image>"
+        << "  <width>512</width>"
+        << "  <height>512</height>"
+        << "  <format>R32G32B32</format>"
+        << "</image>"
+        << "<clip>"
+        << "  <near>0.1</near>"
+        << "  <far>3</far>"
+        << "</clip>"
+        << "</plugin>"
+        << "</sdf>";
+
+    sdf::ElementPtr FLSonarSDF(new sdf::Element);
+    sdf::initFile("plugin.sdf", FLSonarSDF);
+    sdf::readString(newSonarSS.str(), FLSonarSDF);
+
+    sonars[i] = new rendering::FLSonar(i ? "test_sonar_gpu" : "test_sonar_cpu", scene, false);
+    sonars[i]->Init();
+    sonars[i]->Load(FLSonarSDF);
+    sonars[i]->CreateTexture("GPUTexture");
+    sonars[i]->Processor().Noise().SetSeed(1);
+  }
+  ASSERT_FALSE(sonars[0]->GpuBinning());
+  ASSERT_TRUE(sonars[1]->GpuBinning());
+
+  ignition::math::Pose3d sonarPose(0,0,3,0,M_PI/2,M_PI/2);
+
+  SpawnOgreSphere(scene,ignition::math::Vector3d(0,0,1));
+
+  // Same seed and frame, so the same noise for both
+  std::vector<float> accumData[2];
+  for (int i = 0; i < 2; i++)
+  {
+    sonars[i]->PreRender(sonarPose);
+    sonars[i]->RenderImpl();
+    sonars[i]->GetSonarImage();
+    sonars[i]->PostRender();
+    accumData[i] = sonars[i]->Processor().AccumData();
+  }
+
+  // Samples on a bin edge can round to either side, so only the mean
+  // difference is tight
+  ASSERT_EQ(accumData[0].size(), accumData[1].size());
+  double difference = 0;
+  for (size_t i = 0; i < accumData[0].size(); i++)
+    difference += std::abs(accumData[0][i] - accumData[1][i]);
+  ASSERT_LT(difference / accumData[0].size(), 1e-3);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, SphereRayCast)
+{
+  Load("worlds/empty.world",false);
+
+  std::stringstream newSonarSS;
+  newSonarSS <<"<sdf version='1.6'>"
+      << "<plugin name='SonarVisual' filename='libfl_sonar_ros.so' >"
+      << "<horizontal_fov>1.1</horizontal_fov>"
+      << "<vfov>0.78539816339</vfov>"
+      << "<bin_count>720</bin_count>"
+      << "<beam_count>720</beam_count>"
+      << "<image>"
+      << "  <width>720</width>"
+      << "  <height>720</height>"
+      << "</image>"
+      << "<clip>"
+      << "  <near>0.1</near>"
+      << "  <far>3</far>"
+      << "</clip>"
+      << "</plugin>"
+      << "</sdf>";
+
+  sdf::ElementPtr FLSonarSDF(new sdf::Element);
+  sdf::initFile("plugin.sdf", FLSonarSDF);
+  sdf::readString(newSonarSS.str(), FLSonarSDF);
+
+  rendering::SonarProcessor processor;
+  processor.Load(FLSonarSDF, "test_sonar");
+
+  // Same sphere as SphereDraw, ray cast on the CPU instead of rendered
+  rendering::SonarRayCaster rayCaster;
+  int sphere = rayCaster.AddMesh(*common::MeshManager::Instance()->GetMesh("unit_sphere"),
+                                 ignition::math::Vector3d::One, 1.0);
+  rayCaster.SetPose(sphere, ignition::math::Pose3d(0,0,1,0,0,0));
+
+  ignition::math::Pose3d sonarPose(0,0,3,0,M_PI/2,M_PI/2);
+
+  cv::Mat rawImage;
+  processor.FitShaderImage(rawImage);
+  rayCaster.Render(sonarPose, processor.HorzFOV(), processor.VertFOV(), 0.1, 3,
+                   rawImage, processor.ThreadPool());
+  processor.Process(rawImage);
+
+  cv::Mat shaderOutput = processor.ShaderImage();
+  cv::Mat shaderMask = cv::Mat::zeros(shaderOutput.rows,shaderOutput.cols, CV_8UC1);
+  cv::Mat shaderRef = cv::Mat::zeros(shaderOutput.rows,shaderOutput.cols, CV_32FC3);
+
+  GetCVValuesSphere(shaderRef,shaderMask);
+
+  ApplyMask(shaderOutput,shaderMask);
+
+  // The rasterizer interpolates across pixels, the ray caster samples their
+  // centers
+  ASSERT_TRUE(CompareImages(shaderOutput,shaderRef,1e-2));
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, RayCastCulling)
+{
+  Load("worlds/empty.world",false);
+
+  rendering::SonarProcessor processor;
+  processor.SetHorzFOV(1.1);
+  processor.SetVertFOV(0.78539816339);
+  processor.SetImageWidth(256);
+  processor.SetImageHeight(256);
+
+  // Looking along +X: a sphere straddling the right edge of the field of
+  // view, then one just outside it, one behind and one beyond the far clip
+  const ignition::math::Pose3d poses[] = {
+    ignition::math::Pose3d(2 * cos(0.6), -2 * sin(0.6), 0, 0, 0, 0),
+    ignition::math::Pose3d(2 * cos(1.0), -2 * sin(1.0), 0, 0, 0, 0),
+    ignition::math::Pose3d(-2, 0, 0, 0, 0, 0),
+    ignition::math::Pose3d(4, 0, 0, 0, 0, 0)};
+
+  rendering::SonarRayCaster rayCaster;
+  cv::Mat straddling, all;
+  processor.FitShaderImage(straddling);
+  processor.FitShaderImage(all);
+  for (int i = 0; i < 4; i++)
+  {
+    int sphere = rayCaster.AddMesh(*common::MeshManager::Instance()->GetMesh("unit_sphere"),
+                                   ignition::math::Vector3d::One, 1.0);
+    rayCaster.SetPose(sphere, poses[i]);
+    if (i == 0)
+      rayCaster.Render(ignition::math::Pose3d::Zero, processor.HorzFOV(), processor.VertFOV(),
+                       0.1, 3, straddling, processor.ThreadPool());
+  }
+  rayCaster.Render(ignition::math::Pose3d::Zero, processor.HorzFOV(), processor.VertFOV(),
+                   0.1, 3, all, processor.ThreadPool());
+
+  // The straddling sphere is kept, it fills the last column
+  ASSERT_GT(straddling.at<cv::Vec3f>(128, 255)[1], 0);
+  ASSERT_EQ(cv::norm(straddling, all, cv::NORM_INF), 0);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, SphereRayCastFovTiles)
+{
+  Load("worlds/empty.world",false);
+
+  rendering::SonarProcessor processor;
+  processor.SetHorzFOV(1.1);
+  processor.SetVertFOV(0.78539816339);
+  processor.SetImageWidth(720);
+  processor.SetImageHeight(720);
+
+  rendering::SonarRayCaster rayCaster;
+  int sphere = rayCaster.AddMesh(*common::MeshManager::Instance()->GetMesh("unit_sphere"),
+                                 ignition::math::Vector3d::One, 1.0);
+  rayCaster.SetPose(sphere, ignition::math::Pose3d(0,0,1,0,0,0));
+
+  ignition::math::Pose3d sonarPose(0,0,3,0,M_PI/2,M_PI/2);
+
+  cv::Mat single, tiled;
+  processor.FitShaderImage(single);
+  processor.FitShaderImage(tiled);
+  rayCaster.Render(sonarPose, processor.HorzFOV(), processor.VertFOV(), 0.1, 3,
+                   single, processor.ThreadPool());
+  rayCaster.Render(sonarPose, processor.HorzFOV(), processor.VertFOV(), 0.1, 3,
+                   tiled, processor.ThreadPool(), 3);
+
+  // Along the middle row both see the same depth at the same angle, each
+  // tile projecting it with its own yawed camera
+  processor.SetFovTileCount(3);
+  const int row = 360;
+  const int tileWidth = processor.FovTileWidth();
+  const double singleFocal = 360 / tan(processor.HorzFOV() / 2);
+  const double tileFocal = tileWidth / 2 / tan(processor.HorzFOV() / 6);
+  int compared = 0;
+  for (double angle = -0.15; angle <= 0.15; angle += 0.01)
+  {
+    int singleColumn = static_cast<int>(360 + singleFocal * tan(angle));
+    int tile = static_cast<int>((angle + processor.HorzFOV() / 2) / (processor.HorzFOV() / 3));
+    int tiledColumn = static_cast<int>(tile * tileWidth + tileWidth / 2 +
+                                       tileFocal * tan(angle - processor.FovTileYaw(tile)));
+
+    float singleDepth = single.at<cv::Vec3f>(row, singleColumn)[1];
+    float tiledDepth = tiled.at<cv::Vec3f>(row, tiledColumn)[1];
+    ASSERT_GT(singleDepth, 0);
+    ASSERT_NEAR(singleDepth, tiledDepth, 1e-2);
+    compared++;
+  }
+  ASSERT_GT(compared, 0);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, BinFovTiles)
+{
+  // The whole shader image against its tiles binned one by one
+  rendering::SonarProcessor processors[2];
+  for (int k = 0; k < 2; k++)
+  {
+    processors[k].SetHorzFOV(1.1);
+    processors[k].SetVertFOV(0.78539816339);
+    processors[k].SetImageWidth(240);
+    processors[k].SetImageHeight(256);
+    processors[k].SetBeamCount(61);
+    processors[k].SetBinCount(93);
+    processors[k].SetFovTileCount(k ? 3 : 1);
+    processors[k].Noise().SetStdDev(0);
+  }
+
+  // Every column alike, so clamping the beams to their tile changes nothing
+  cv::Mat rawImage;
+  processors[0].FitShaderImage(rawImage);
+  for (int row = 0; row < rawImage.rows; row++)
+  {
+    cv::Vec3f pixel(0, static_cast<float>(row) / rawImage.rows, 0.5f + 0.5f * sin(row * 0.1f));
+    rawImage.row(row).setTo(pixel);
+  }
+  processors[0].Process(rawImage);
+
+  cv::Mat counts, tileImage;
+  processors[1].FitBinCounts(counts);
+  counts.setTo(cv::Scalar::all(-1));
+  processors[1].FitTileImage(tileImage);
+  ASSERT_EQ(tileImage.cols, 80);
+  for (int tile = 0; tile < 3; tile++)
+  {
+    rawImage.colRange(tile * 80, (tile + 1) * 80).copyTo(tileImage);
+    processors[1].BinTile(tileImage, tile, counts);
+  }
+
+  // Each beam belongs to exactly one tile
+  for (int beam = 0; beam < counts.rows; beam++)
+    ASSERT_GE(counts.at<cv::Vec3f>(beam, 0)[1], 0);
+
+  processors[1].ProcessBinCounts(counts);
+  const std::vector<float> &single = processors[0].AccumData();
+  const std::vector<float> &tiled = processors[1].AccumData();
+  ASSERT_EQ(single.size(), tiled.size());
+  for (size_t i = 0; i < single.size(); i++)
+    ASSERT_NEAR(single[i], tiled[i], 1e-5);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, StatsPercentiles)
+{
+  rendering::SonarStats stats(100);
+
+  // More samples than the window, only the last 100 are kept: 101 to 200
+  for (int i = 1; i <= 200; i++)
+    stats.Record(rendering::SonarStats::BINNING, i);
+
+  rendering::SonarStats::Summary summary = stats.Summarize(rendering::SonarStats::BINNING);
+  ASSERT_EQ(summary.count, 200u);
+  ASSERT_NEAR(summary.p50, 151, 1);
+  ASSERT_NEAR(summary.p95, 195, 1);
+  ASSERT_NEAR(summary.p99, 199, 1);
+  ASSERT_EQ(summary.max, 200);
+
+  ASSERT_EQ(stats.Summarize(rendering::SonarStats::RENDER).count, 0u);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, ThreadCountInvariant)
+{
+  cv::Mat rawImage;
+  std::vector<float> accumData[2];
+  cv::Mat sonarImage[2];
+  const int threads[2] = {1, 5};
+  for (int k = 0; k < 2; k++)
+  {
+    // Odd sizes so the workers get uneven chunks
+    rendering::SonarProcessor processor;
+    processor.SetHorzFOV(1.1);
+    processor.SetVertFOV(0.78539816339);
+    processor.SetImageWidth(255);
+    processor.SetImageHeight(257);
+    processor.SetBeamCount(61);
+    processor.SetBinCount(93);
+    processor.SetThreadCount(threads[k]);
+    ASSERT_EQ(processor.ThreadPool().Size(), static_cast<size_t>(threads[k]));
+
+    if (k == 0)
+    {
+      processor.FitShaderImage(rawImage);
+      cv::RNG rng(42);
+      rng.fill(rawImage, cv::RNG::UNIFORM, 0, 1);
+    }
+
+    // Same seed on both, and both point spread modes
+    processor.Noise().SetSeed(3);
+    processor.Process(rawImage);
+    processor.Psf().SetMode(rendering::SonarPsf::BOX);
+    processor.Process(rawImage);
+    accumData[k] = processor.AccumData();
+    sonarImage[k] = processor.SonarImage().clone();
+  }
+
+  // Bit for bit the serial output
+  ASSERT_EQ(accumData[0], accumData[1]);
+  ASSERT_EQ(cv::norm(sonarImage[0], sonarImage[1], cv::NORM_INF), 0);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, BinKernelMatchesScalar)
+{
+  rendering::SonarBinKernel scalar(rendering::SonarBinKernel::ISA_SCALAR);
+  rendering::SonarBinKernel best;
+  ASSERT_EQ(scalar.ActiveIsa(), rendering::SonarBinKernel::ISA_SCALAR);
+
+  // Depths out of [0, 1] and not numbers among them
+  const int binCount = 37;
+  cv::RNG rng(42);
+  std::vector<float> depth(64), intensity(64);
+  for (size_t i = 0; i < depth.size(); i++)
+  {
+    depth[i] = rng.uniform(-0.5f, 1.5f);
+    intensity[i] = rng.uniform(0.0f, 1.0f);
+  }
+  depth[3] = std::numeric_limits<float>::quiet_NaN();
+  depth[17] = std::numeric_limits<float>::infinity();
+  depth[18] = -std::numeric_limits<float>::infinity();
+  depth[62] = std::numeric_limits<float>::quiet_NaN();
+
+  // Every tail length of the SIMD bodies
+  for (size_t samples = 0; samples <= depth.size(); samples++)
+  {
+    std::vector<float> counts[2], sums[2], bins[2];
+    for (int k = 0; k < 2; k++)
+    {
+      const rendering::SonarBinKernel &kernel = k == 0 ? scalar : best;
+      counts[k].assign(binCount, 0);
+      sums[k].assign(binCount, 0);
+      bins[k].assign(binCount, 0);
+      kernel.Accumulate(depth.data(), intensity.data(), samples, binCount,
+                        counts[k].data(), sums[k].data());
+      kernel.Normalize(counts[k].data(), sums[k].data(), binCount, bins[k].data());
+    }
+    ASSERT_EQ(counts[0], counts[1]) << samples << " samples";
+    ASSERT_EQ(sums[0], sums[1]) << samples << " samples";
+    ASSERT_EQ(bins[0], bins[1]) << samples << " samples";
+    ASSERT_EQ(std::accumulate(counts[0].begin(), counts[0].end(), 0.0f), static_cast<float>(samples));
+  }
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, PipelineDropOldest)
+{
+  // The worker is slower than the renders
+  std::mutex mutex;
+  std::vector<int> processed;
+  SonarPipeline pipeline(2, SonarPipeline::DROP_OLDEST, [&](SonarFrame &_frame)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      std::lock_guard<std::mutex> lock(mutex);
+      processed.push_back(_frame.stamp.sec);
+    });
+  pipeline.Start();
+
+  // The newest frame is never refused
+  const int frameCount = 10;
+  for (int i = 1; i <= frameCount; i++)
+  {
+    SonarFrame *frame = pipeline.Acquire();
+    ASSERT_TRUE(frame != nullptr);
+    frame->stamp = common::Time(i, 0);
+    pipeline.Commit();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+
+  for (int i = 0; i < 200; i++)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!processed.empty() && processed.back() == frameCount)
+        break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  pipeline.Stop();
+
+  // The frame processed last is the newest one, the older ones in between
+  // are dropped
+  ASSERT_EQ(processed.back(), frameCount);
+  ASSERT_LT(processed.size(), static_cast<size_t>(frameCount));
+  ASSERT_EQ(pipeline.DroppedFrames(), frameCount - processed.size());
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, ColorMapLookup)
+{
+  // Ramp over the range, with noise outside of it
+  cv::Mat image(64, 64, CV_32FC1);
+  for (int i = 0; i < image.rows; i++)
+    for (int j = 0; j < image.cols; j++)
+      image.at<float>(i, j) = (i * image.cols + j) * 1.2f / image.total() - 0.1f;
+
+  cv::Mat mask = cv::Mat::zeros(image.rows, image.cols, CV_8UC1);
+  cv::circle(mask, cv::Point(32, 32), 20, cv::Scalar(255), -1);
+
+  // Former three pass conversion
+  cv::Mat image8, colored;
+  image.convertTo(image8, CV_8UC1, 255);
+  cv::applyColorMap(image8, colored, cv::COLORMAP_WINTER);
+  cv::Mat reference = cv::Mat::zeros(image.rows, image.cols, CV_8UC3);
+  colored.copyTo(reference, mask);
+
+  rendering::SonarColorMap colorMap;
+  cv::Mat output(image.rows, image.cols, CV_8UC3, cv::Scalar::all(7));
+  colorMap.Apply(image, mask, output);
+
+  cv::Mat diff;
+  cv::absdiff(output, reference, diff);
+  double maxDiff;
+  cv::minMaxLoc(diff.reshape(1), nullptr, &maxDiff);
+  ASSERT_LE(maxDiff, 2);
+
+  // A gain of 2 saturates the upper half
+  colorMap.SetColorMap("gray");
+  colorMap.SetGain(2);
+  cv::Mat gray(image.rows, image.cols, CV_8UC1);
+  colorMap.Apply(image, mask, gray);
+  ASSERT_EQ(gray.at<uchar>(50, 32), 255);
+  ASSERT_EQ(gray.at<uchar>(0, 0), 0);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, OutputImageSize)
+{
+  rendering::SonarProcessor processor;
+  processor.SetHorzFOV(1.1);
+  processor.SetVertFOV(0.78539816339);
+  processor.SetImageWidth(256);
+  processor.SetImageHeight(512);
+  processor.SetBeamCount(64);
+  processor.SetBinCount(128);
+
+  cv::Mat rawImage;
+  processor.FitShaderImage(rawImage);
+  rawImage.setTo(cv::Scalar::all(0.5));
+
+  // Follows the shader image unless set
+  processor.Process(rawImage);
+  ASSERT_EQ(processor.SonarImage().cols, 256);
+  ASSERT_EQ(processor.SonarImage().rows, 512);
+
+  processor.SetOutputWidth(200);
+  processor.SetOutputHeight(100);
+  processor.Process(rawImage);
+  ASSERT_EQ(processor.SonarImage().cols, 200);
+  ASSERT_EQ(processor.SonarImage().rows, 100);
+  ASSERT_EQ(processor.SonarMask().size(), processor.SonarImage().size());
+  ASSERT_GT(cv::countNonZero(processor.SonarMask()), 0);
+
+  // Beams only
+  processor.SetSonarImageEnabled(false);
+  processor.Process(rawImage);
+  ASSERT_TRUE(processor.SonarImage().empty());
+  ASSERT_EQ(processor.AccumData().size(), 64u * 128u);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, PsfMatchesGaussianBlur)
+{
+  // Beams x bins, odd sizes so the SIMD tails and the borders are covered
+  cv::Mat bins(61, 93, CV_32FC1);
+  cv::RNG rng(42);
+  rng.fill(bins, cv::RNG::UNIFORM, 0, 1);
+
+  // Former blur, 9 bins by 11 beams
+  cv::Mat reference;
+  cv::GaussianBlur(bins, reference, cv::Size(9, 11), 0);
+
+  rendering::SonarThreadPool threadPool(3);
+  rendering::SonarPsf psf;
+  cv::Mat output(bins.rows, bins.cols, CV_32FC1);
+  psf.Apply(bins, output.ptr<float>(), threadPool);
+
+  double maxDiff;
+  cv::minMaxLoc(cv::abs(output - reference), nullptr, &maxDiff);
+  ASSERT_LT(maxDiff, 1e-5);
+
+  // The box approximation keeps the level of flat areas and the energy of
+  // an isolated echo, centered on it
+  psf.SetMode(rendering::SonarPsf::BOX);
+  bins.setTo(cv::Scalar(0.25));
+  psf.Apply(bins, output.ptr<float>(), threadPool);
+  cv::minMaxLoc(cv::abs(output - 0.25), nullptr, &maxDiff);
+  ASSERT_LT(maxDiff, 1e-5);
+
+  bins.setTo(cv::Scalar(0));
+  bins.at<float>(30, 46) = 1;
+  psf.Apply(bins, output.ptr<float>(), threadPool);
+  ASSERT_NEAR(cv::sum(output)[0], 1, 1e-4);
+  cv::Point peak;
+  cv::minMaxLoc(output, nullptr, nullptr, nullptr, &peak);
+  ASSERT_EQ(peak, cv::Point(46, 30));
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, NoiseReproducible)
+{
+  // Philox4x32-10 known answer
+  const uint32_t counter[4] = {0, 0, 0, 0};
+  const uint32_t key[2] = {0, 0};
+  uint32_t bits[4];
+  rendering::SonarNoise::Philox(counter, key, bits);
+  ASSERT_EQ(bits[0], 0x6627e8d5u);
+  ASSERT_EQ(bits[1], 0xe169c58du);
+  ASSERT_EQ(bits[2], 0xbc57ac4cu);
+  ASSERT_EQ(bits[3], 0x9b00dbd8u);
+
+  const int count = 100001;
+  std::vector<float> means(count, 1), gains(count, 2), noisy[3];
+  for (auto &output : noisy)
+    output.resize(count);
+
+  // Additive noise of the configured deviation around the echoes
+  rendering::SonarNoise noise;
+  noise.SetSeed(7);
+  noise.Apply(3, 5, means.data(), gains.data(), count, noisy[0].data());
+  noise.Apply(3, 5, means.data(), gains.data(), count, noisy[1].data());
+  noise.SetSeed(8);
+  noise.Apply(3, 5, means.data(), gains.data(), count, noisy[2].data());
+  ASSERT_EQ(noisy[0], noisy[1]);
+  ASSERT_NE(noisy[0], noisy[2]);
+
+  // Default seeds, FNV-1a known answers and one per sonar
+  ASSERT_EQ(rendering::SonarNoise::NameSeed(""), 0xcbf29ce484222325ull);
+  ASSERT_EQ(rendering::SonarNoise::NameSeed("a"), 0xaf63dc4c8601ec8cull);
+  ASSERT_NE(rendering::SonarNoise::NameSeed("default::rov::sonar_link::sonar"),
+            rendering::SonarNoise::NameSeed("default::auv::sonar_link::sonar"));
+
+  cv::Scalar mean, stdDev;
+  cv::meanStdDev(noisy[0], mean, stdDev);
+  ASSERT_NEAR(mean[0], 2, 0.01);
+  ASSERT_NEAR(stdDev[0], 0.25, 0.01);
+
+  // Speckle alone keeps the mean echo, with the Rayleigh spread
+  noise.SetStdDev(0);
+  noise.SetSpeckle(true);
+  noise.Apply(3, 5, means.data(), gains.data(), count, noisy[0].data());
+  cv::meanStdDev(noisy[0], mean, stdDev);
+  ASSERT_NEAR(mean[0], 2, 0.02);
+  ASSERT_NEAR(stdDev[0], 2 * std::sqrt(4 / M_PI - 1), 0.02);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, RangeGainTable)
+{
+  const int binCount = 100;
+  std::vector<float> table(binCount);
+
+  // Former hard coded curve
+  rendering::SonarRangeGain rangeGain;
+  rangeGain.Fill(binCount, 10, table.data());
+  for (int i = 0; i < binCount; i++)
+    ASSERT_FLOAT_EQ(table[i], 0.5 + 7.0 * i * i / binCount / binCount);
+
+  // Spherical spreading and absorption, at the bin centers in meters
+  rangeGain.SetSpreading(0.5, 2, 0.1);
+  rangeGain.Fill(binCount, 10, table.data());
+  ASSERT_NEAR(table[49], 0.5 * 4.95 * 4.95 * std::exp(2 * 0.1 * 4.95), 1e-3);
+
+  // Curve interpolated between its points and held past its ends
+  std::string path = "/tmp/sonar_range_gain.csv";
+  std::ofstream csv(path);
+  csv << "# range,gain\n" << "range,gain\n" << "2,1\n" << "6,3\n";
+  csv.close();
+  std::vector<double> ranges, gains;
+  ASSERT_TRUE(rendering::SonarRangeGain::ReadCsv(path, ranges, gains));
+  ASSERT_EQ(ranges.size(), 2u);
+  ASSERT_TRUE(rangeGain.SetCurve(ranges, gains));
+  rangeGain.Fill(binCount, 10, table.data());
+  ASSERT_FLOAT_EQ(table[0], 1);
+  ASSERT_FLOAT_EQ(table[39], 1.975);
+  ASSERT_FLOAT_EQ(table[99], 3);
+
+  ASSERT_FALSE(rangeGain.SetCurve({3, 1}, {1, 1}));
+  ASSERT_EQ(rangeGain.GetType(), rendering::SonarRangeGain::CURVE);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, ReprocessUnchangedScene)
+{
+  rendering::SonarProcessor processor;
+  processor.SetHorzFOV(1.1);
+  processor.SetVertFOV(0.78539816339);
+  processor.SetImageWidth(256);
+  processor.SetImageHeight(256);
+  processor.SetBeamCount(64);
+  processor.SetBinCount(128);
+
+  // Nothing binned yet
+  ASSERT_FALSE(processor.Reprocess());
+
+  cv::Mat rawImage;
+  processor.FitShaderImage(rawImage);
+  cv::RNG rng(42);
+  rng.fill(rawImage, cv::RNG::UNIFORM, 0, 1);
+
+  // Without noise the frame binned again is the same
+  processor.Noise().SetStdDev(0);
+  processor.Process(rawImage);
+  std::vector<float> processed = processor.AccumData();
+  cv::Mat sonarImage = processor.SonarImage().clone();
+  ASSERT_TRUE(processor.Reprocess());
+  ASSERT_EQ(processor.AccumData(), processed);
+  ASSERT_EQ(cv::norm(processor.SonarImage(), sonarImage, cv::NORM_INF), 0);
+
+  // With noise only the noise changes
+  processor.Noise().SetStdDev(0.25);
+  ASSERT_TRUE(processor.Reprocess());
+  std::vector<float> first = processor.AccumData();
+  ASSERT_TRUE(processor.Reprocess());
+  ASSERT_NE(processor.AccumData(), first);
+
+  // A new geometry needs a new frame
+  processor.SetBinCount(64);
+  ASSERT_FALSE(processor.Reprocess());
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, BilinearScanConversion)
+{
+  const int beamCount = 32;
+  const int binCount = 64;
+  const int size = 256;
+
+  // Ramp over the beams and the bins, which the bilinear interpolation
+  // reproduces exactly
+  std::vector<float> ramp(beamCount * binCount);
+  for (int beam = 0; beam < beamCount; beam++)
+    for (int bin = 0; bin < binCount; bin++)
+      ramp[beam * binCount + bin] = beam + 0.5f * bin;
+
+  // Nearest then bilinear
+  ScanConvertProcessor processors[2];
+  cv::Mat images[2];
+  for (int k = 0; k < 2; k++)
+  {
+    processors[k].SetHorzFOV(1.1);
+    processors[k].SetVertFOV(0.78539816339);
+    processors[k].SetImageWidth(size);
+    processors[k].SetImageHeight(size);
+    processors[k].SetBeamCount(beamCount);
+    processors[k].SetBinCount(binCount);
+    processors[k].SetBilinearScanConversion(k == 1);
+    processors[k].UpdateTransferTable();
+    processors[k].TransferTableToSonar(ramp, processors[k].transferTable);
+    images[k] = processors[k].SonarImage();
+  }
+
+  // The four cells of each pixel stay inside the bins, at the fan edges
+  // too where the first cell is clamped
+  const auto &table = processors[1].transferTable;
+  ASSERT_FALSE(table.pixels.empty());
+  for (size_t i = 0; i < table.sources.size(); i++)
+  {
+    ASSERT_GE(table.sources[i], 0);
+    ASSERT_LT(table.sources[i] + binCount + 1, beamCount * binCount);
+    ASSERT_GE(table.beamWeights[i], 0);
+    ASSERT_LE(table.beamWeights[i], 1);
+    ASSERT_GE(table.binWeights[i], 0);
+    ASSERT_LE(table.binWeights[i], 1);
+  }
+
+  // Each pixel gets the ramp at its beam and bin, sampled at the cell
+  // centers and clamped to the edge cells
+  const double hfov = processors[1].HorzFOV();
+  const double binsPerPixel = binCount / (size * 0.5);
+  cv::Mat mask = processors[1].SonarMask();
+  int centers = 0;
+  for (int j = 0; j < size; j++)
+  {
+    for (int i = 0; i < size; i++)
+    {
+      if (!mask.at<uchar>(j, i))
+        continue;
+
+      double x = (i - size / 2) * binsPerPixel;
+      double y = (j - size / 2) * binsPerPixel;
+      double radius = sqrt(x * x + y * y);
+      double beam = ((atan2(x, -y) + hfov / 2) / hfov) * beamCount;
+      double beamCell = ignition::math::clamp(beam - 0.5, 0.0, beamCount - 1.0);
+      double binCell = ignition::math::clamp(radius - 0.5, 0.0, binCount - 1.0);
+
+      float bilinear = images[1].at<float>(j, i);
+      ASSERT_NEAR(bilinear, beamCell + 0.5 * binCell, 1e-3);
+
+      // Close to a cell center both agree
+      double beamOffset = beam - 0.5 - std::round(beam - 0.5);
+      double binOffset = radius - 0.5 - std::round(radius - 0.5);
+      if (std::abs(beamOffset) < 0.05 && std::abs(binOffset) < 0.05 &&
+          beam > 0.5 && beam < beamCount - 0.5 && radius > 0.5 && radius < binCount - 0.5)
+      {
+        ASSERT_NEAR(images[0].at<float>(j, i), bilinear, 0.1);
+        centers++;
+      }
+    }
+  }
+  ASSERT_GT(centers, 0);
+
+  // Every pixel of the fan is in the table, and the nearest cells at its
+  // far edge take the last bin of their own beam
+  for (int k = 0; k < 2; k++)
+  {
+    const auto &transfer = processors[k].transferTable;
+    ASSERT_EQ(static_cast<int>(transfer.pixels.size()),
+              cv::countNonZero(processors[k].SonarMask()));
+  }
+  for (size_t i = 0; i < processors[0].transferTable.pixels.size(); i++)
+  {
+    int pixel = processors[0].transferTable.pixels[i];
+    double x = (pixel % size - size / 2) * binsPerPixel;
+    double y = (pixel / size - size / 2) * binsPerPixel;
+    int bin = std::min(static_cast<int>(sqrt(x * x + y * y)), binCount - 1);
+    int source = processors[0].transferTable.sources[i];
+    ASSERT_LT(source, beamCount * binCount);
+    ASSERT_EQ(source % binCount, bin);
+  }
+
+  // Continuous away from the origin, where a pixel spans less than a beam,
+  // while the nearest cells step a whole beam
+  double maxStep[2] = {0, 0};
+  for (int j = 0; j < size; j++)
+  {
+    for (int i = 1; i < size; i++)
+    {
+      double x = (i - size / 2) * binsPerPixel;
+      double y = (j - size / 2) * binsPerPixel;
+      if (!mask.at<uchar>(j, i) || !mask.at<uchar>(j, i - 1) ||
+          sqrt(x * x + y * y) < binCount / 2)
+        continue;
+
+      for (int k = 0; k < 2; k++)
+      {
+        maxStep[k] = std::max(maxStep[k], static_cast<double>(
+                       std::abs(images[k].at<float>(j, i) - images[k].at<float>(j, i - 1))));
+      }
+    }
+  }
+  const double beamsPerPixel = binsPerPixel / (binCount / 2) * beamCount / hfov;
+  ASSERT_LE(maxStep[1], 1.01 * (beamsPerPixel + 0.5 * binsPerPixel));
+  ASSERT_GE(maxStep[0], 1);
+}
+
+/////////////////////////////////////////////////
+TEST_F(Sonar_TEST, DetachShaderImage)
+{
+  rendering::SonarProcessor processor;
+  processor.SetImageWidth(64);
+  processor.SetImageHeight(64);
+
+  cv::Mat rawImage;
+  processor.FitShaderImage(rawImage);
+  rawImage.setTo(cv::Scalar::all(0.5));
+
+  // The copy outlives the frame being written again
+  processor.Process(rawImage);
+  cv::Mat shaderImage = processor.ShaderImage();
+  processor.DetachShaderImage(true);
+  rawImage.setTo(cv::Scalar::all(0));
+  ASSERT_EQ(cv::norm(processor.ShaderImage(), shaderImage, cv::NORM_INF), 0);
+
+  // Without a copy nothing is left of the frame
+  processor.Process(rawImage);
+  processor.DetachShaderImage(false);
+  ASSERT_TRUE(processor.ShaderImage().empty());
+  ASSERT_TRUE(processor.Reprocess());
+}
+
 /////////////////////////////////////////////////
 int main(int argc, char **argv)
 {